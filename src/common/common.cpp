@@ -50,3 +50,117 @@ std::vector<std::string> split_path(std::string path) {
     if (!curr_path.empty()) res.push_back(curr_path);  // 处理最后一个目录/文件名
     return std::move(res);
 }
+
+// 各操作码对应的命令名（下标为操作码）
+static const char* const opcode_names[] = {
+    "", "cat", "cd", "check", "copy", "del", "dir", "info", "ls", "ll",
+    "log", "md", "newfile", "rd", "resize", "save", "stats", "su", "sudo", "exit", "du", "find"
+};
+static_assert(sizeof(opcode_names) / sizeof(opcode_names[0]) == (size_t)Opcode::COUNT);
+
+const char* Command::name(Opcode opcode) {
+    if (opcode >= Opcode::COUNT) return "";
+    return opcode_names[(size_t)opcode];
+}
+
+/**
+ * @brief 解析文本命令
+ *
+ * dir/ls/ll/du 的 "-s" 参数转换为 FLAG_RECURSIVE 标志，与原有的解析规则一致：
+ * 出现 "-s" 或者给出多于一个参数时设置该标志。
+ *
+ * @param text 文本命令
+ * @return Command 解析后的命令，未知命令的操作码为 Opcode::NONE
+ */
+Command Command::parse(const std::string& text) {
+    Command command;
+    std::vector<std::string> words = split_command(text);
+    if (words.empty()) return command;
+    for (size_t i = 1; i < (size_t)Opcode::COUNT; ++i) {
+        if (words[0] == opcode_names[i]) {
+            command.opcode = static_cast<Opcode>(i);
+            break;
+        }
+    }
+    command.args.assign(words.begin() + 1, words.end());
+    if (command.opcode == Opcode::DIR || command.opcode == Opcode::LS || command.opcode == Opcode::LL
+        || command.opcode == Opcode::DU) {
+        std::vector<std::string> paths;
+        for (auto& arg: command.args) {
+            if (arg == "-s") command.flags |= FLAG_RECURSIVE;
+            else paths.push_back(arg);
+        }
+        if (paths.size() > 1) {
+            command.flags |= FLAG_RECURSIVE;
+            paths.resize(1);
+        }
+        command.args = paths;
+    }
+    return command;
+}
+
+/**
+ * @brief 转换为文本命令（用于日志）
+ *
+ * @return std::string 文本命令
+ */
+std::string Command::text() const {
+    std::string text = name(opcode);
+    if (flags & FLAG_RECURSIVE) text += " -s";
+    for (const auto& arg: args) text += ' ' + arg;
+    return text;
+}
+
+/**
+ * @brief 编码为二进制请求
+ *
+ * @return std::string 编码后的数据
+ */
+std::string Command::encode() const {
+    std::string data;
+    data.push_back(static_cast<char>(opcode));
+    data.push_back(static_cast<char>(flags));
+    auto put = [&data](uint16_t value) {
+        data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+    put(static_cast<uint16_t>(args.size()));
+    for (const auto& arg: args) {
+        put(static_cast<uint16_t>(arg.size()));
+        data.append(arg);
+    }
+    return data;
+}
+
+/**
+ * @brief 解码二进制请求
+ *
+ * @param data 编码后的数据
+ * @param length 数据长度
+ * @param command 解码后的命令
+ * @return true 解码成功
+ * @return false 数据不完整或操作码无效
+ */
+bool Command::decode(const char* data, size_t length, Command& command) {
+    size_t offset = 0;
+    auto get = [&](uint16_t& value) {
+        if (offset + sizeof(value) > length) return false;
+        memcpy(&value, data + offset, sizeof(value));
+        offset += sizeof(value);
+        return true;
+    };
+    if (length < 2) return false;
+    command.opcode = static_cast<Opcode>(data[0]);
+    command.flags = static_cast<uint8_t>(data[1]);
+    offset = 2;
+    if (command.opcode >= Opcode::COUNT) return false;
+    uint16_t argc = 0;
+    if (!get(argc)) return false;
+    command.args.clear();
+    for (uint16_t i = 0; i < argc; ++i) {
+        uint16_t size = 0;
+        if (!get(size) || offset + size > length) return false;
+        command.args.emplace_back(data + offset, size);
+        offset += size;
+    }
+    return offset == length;
+}
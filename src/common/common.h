@@ -15,16 +15,23 @@
 #include <unistd.h>
 #include <thread>
 #include <chrono>
-#include <gtest/gtest.h>
 #include <queue>
 #include <mutex>
 #include <utility>
+#include <atomic>
+#include <vector>
 // 颜色宏定义
 #define GREEN   "\033[32m"
 #define YELLOW  "\033[33m"
 #define BLUE    "\033[1;34m"
 #define WHITE   "\033[1;37m"
 
+// 数据区大小（每个Shell独占的共享内存数据区，用于传输变长数据）
+#define ARENA_SIZE (16 * 1024 * 1024)
+// 流式传输的帧大小与环形队列的帧数（服务端最多领先Shell FRAME_NUM 帧）
+#define FRAME_SIZE (64 * 1024)
+#define FRAME_NUM 16
+
 // 错误码枚举
 enum class ErrorCode {
     SUCCESS,                // 操作成功
@@ -53,7 +60,16 @@ enum class Option {
     CAT,            // 查看文件内容
     SWITCH,         // 切换
     PATCH,          // 补丁
-    TAB             // 制表
+    TAB,            // 制表
+    STREAM,         // 流式传输
+    BATCH           // 批量请求
+};
+
+// 流状态枚举
+enum class StreamState : uint32_t {
+    OPEN,           // 传输中
+    CLOSED,         // 已结束
+    ABORTED,        // 已中止
 };
 
 // 字符串分割函数，用于解析命令
@@ -62,6 +78,84 @@ std::vector<std::string> split_command(const std::string& command);
 // 路径字符串分割函数，用于解析路径
 std::vector<std::string> split_path(std::string path);
 
+// 操作码枚举（取值写入审计日志和请求记录，新的操作码只能追加在 COUNT 之前）
+enum class Opcode : uint8_t {
+    NONE,           // 未知命令
+    CAT,            // 查看文件内容
+    CD,             // 切换目录
+    CHECK,          // 检查文件系统
+    COPY,           // 复制
+    DEL,            // 删除文件
+    DIR,            // 列出目录
+    INFO,           // 文件系统信息
+    LS,             // 列出目录
+    LL,             // 列出目录详细信息
+    LOG,            // 审计日志
+    MD,             // 创建目录
+    NEWFILE,        // 创建文件
+    RD,             // 删除目录
+    RESIZE,         // 扩大磁盘
+    SAVE,           // 备份
+    STATS,          // 请求统计
+    SU,             // 切换用户
+    SUDO,           // 以管理员身份执行
+    EXIT,           // 退出
+    DU,             // 统计目录大小
+    FIND,           // 查找文件
+    COUNT           // 操作码数量
+};
+
+// 命令标志
+enum CommandFlag : uint8_t {
+    FLAG_NONE = 0,              // 无标志
+    FLAG_RECURSIVE = 1 << 0,    // -s 参数（ls/ll 只列出目录，dir 递归列出子目录，du 只输出合计）
+    FLAG_RECORD = 1 << 1,       // 以结构化记录返回结果
+};
+
+// 命令结构体（文本命令解析后的形式，也是二进制请求的编码单位）
+struct Command {
+    Opcode opcode = Opcode::NONE;       // 操作码
+    uint8_t flags = FLAG_NONE;          // 标志
+    std::vector<std::string> args;      // 参数（不含命令名）
+
+    // 解析文本命令
+    static Command parse(const std::string& text);
+
+    // 编码为二进制请求：操作码(1) 标志(1) 参数个数(2)，随后每个参数为 长度(2) 内容
+    std::string encode() const;
+
+    // 解码二进制请求，格式错误返回 false
+    static bool decode(const char* data, size_t length, Command& command);
+
+    // 操作码对应的命令名
+    static const char* name(Opcode opcode);
+
+    // 转换为文本命令
+    std::string text() const;
+};
+
+// 目录项记录（ll/dir 以结构化记录返回的结果）
+struct EntryRecord {
+    uint32_t inode_id;       // i结点ID
+    uint32_t size;           // 文件大小
+    uint32_t capacity;       // 文件容量
+    uint32_t address;        // 首个数据块的地址
+    uint32_t mode;           // 文件权限
+    uint64_t total;          // 目录子树的总字节数（文件为 0）
+    char type;               // 文件类型
+    char owner[8];           // 文件所有者
+    char name[32];           // 名称
+};
+
+// 文件系统信息记录（info 以结构化记录返回的结果）
+struct InfoRecord {
+    uint32_t block_size;     // 块的大小
+    uint32_t blocks_num;     // 块的数量
+    uint32_t used_blocks;    // 已使用的块的数量
+    uint32_t inodes_num;     // inode 的数量
+    uint32_t used_inodes;    // 已使用的 inode 的数量
+};
+
 // 请求结构体
 struct Request {
     pid_t pid;               // 进程ID
@@ -69,16 +163,34 @@ struct Request {
     uint32_t id;             // ID
     char type;               // 类型
     Option option;           // 选项
+    uint32_t length;         // 数据长度
+    bool binary;             // 数据是否为二进制编码的命令
 
     // 发送请求
     void send(const char _data[2048], uint32_t& _id, Option _option = Option::NONE) {
         pid = getpid();
         strcpy(data, _data);
+        length = strlen(data);
+        binary = false;
         id += 1;
         _id = id;
         option = _option;
         type = 'n';
     }
+
+    // 发送二进制编码的命令
+    bool send_binary(const std::string& _data, uint32_t& _id, Option _option = Option::NONE) {
+        if (_data.size() > sizeof(data)) return false;
+        pid = getpid();
+        memcpy(data, _data.data(), _data.size());
+        length = _data.size();
+        binary = true;
+        id += 1;
+        _id = id;
+        option = _option;
+        type = 'n';
+        return true;
+    }
 };
 
 // 响应结构体
@@ -88,15 +200,84 @@ struct Response {
     ErrorCode code;          // 错误码
     char type;               // 类型
     Option option;           // 选项
+    uint32_t length;         // 数据长度
+    bool in_arena;           // 数据是否位于请求方的数据区中
 
-    // 发送响应
+    // 发送响应（数据随响应一起拷贝，超出部分被截断）
     void send(const char _data[2048], uint32_t _id, ErrorCode _code, Option _option) {
-        strcpy(data, _data);
+        strncpy(data, _data, sizeof(data) - 1);
+        data[sizeof(data) - 1] = '\0';
+        length = strlen(data);
+        in_arena = false;
         code = _code;
         option = _option;
         type = 'n';
         id = _id;
     }
+
+    // 发送响应（数据已由服务端直接写入请求方的数据区）
+    void send_arena(uint32_t _length, uint32_t _id, ErrorCode _code, Option _option) {
+        data[0] = '\0';
+        length = _length;
+        in_arena = true;
+        code = _code;
+        option = _option;
+        type = 'n';
+        id = _id;
+    }
+};
+
+// 数据区结构体（位于每个Shell独占的共享内存段头部，其后依次为流式传输的帧和 capacity 字节的数据）
+struct Arena {
+    uint32_t capacity;                      // 数据区容量
+    uint32_t length;                        // 数据长度
+    std::atomic<uint32_t> head;             // 服务端已发布的帧数
+    std::atomic<uint32_t> tail;             // Shell已取走的帧数（即归还给服务端的信用）
+    std::atomic<StreamState> state;         // 流状态
+    uint32_t frame_length[FRAME_NUM];       // 各帧的有效长度
+    // 数据在数据区中的响应，其响应头也写在这里，不占用共享的响应区；reply_id 最后写入
+    std::atomic<uint32_t> reply_id;         // 响应对应的请求ID，0 表示没有未取走的响应
+    ErrorCode reply_code;                   // 响应的错误码
+    Option reply_option;                    // 响应的选项
+
+    // 共享内存段的总大小
+    static constexpr size_t segment_size(size_t capacity) {
+        return sizeof(Arena) + (size_t)FRAME_NUM * FRAME_SIZE + capacity;
+    }
+
+    // 获取第 i 帧的起始地址
+    char* frame(uint32_t i) {
+        return reinterpret_cast<char*>(this + 1) + (size_t)(i % FRAME_NUM) * FRAME_SIZE;
+    }
+
+    // 获取数据区起始地址
+    char* payload() {
+        return reinterpret_cast<char*>(this + 1) + (size_t)FRAME_NUM * FRAME_SIZE;
+    }
+};
+
+// 批量请求/响应项的头部（位于数据区中，其后紧跟该项以'\0'结尾的数据）
+struct BatchItem {
+    Option option;           // 选项
+    ErrorCode code;          // 错误码（仅响应项有效）
+    uint32_t length;         // 数据长度（不含结尾的'\0'）
+    uint32_t elapsed;        // 执行耗时，单位为微秒（仅响应项有效）
+    bool binary;             // 数据是否为二进制编码的命令（仅请求项有效）
+
+    // 获取数据起始地址
+    char* data() {
+        return reinterpret_cast<char*>(this + 1);
+    }
+
+    // 一项占用的字节数（按4字节对齐）
+    static size_t space(uint32_t _length) {
+        return sizeof(BatchItem) + ((_length + 4) & ~3u);
+    }
+
+    // 获取下一项
+    BatchItem* next() {
+        return reinterpret_cast<BatchItem*>(reinterpret_cast<char*>(this) + space(length));
+    }
 };
 
 // 共享内存结构体
@@ -0,0 +1,463 @@
+#include "../common/common.h"
+#include <algorithm>
+#include <cstdio>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/wait.h>
+#include <vector>
+//
+// Created by eric on 12/10/23.
+//
+// loadgen.cpp
+
+// 每个客户端目录中最多保留的文件数（目录只有一个块，最多 32 个目录项）
+#define MAX_FILES 24
+// 客户端数的上限（所有客户端的目录都位于 /home 下）
+#define MAX_CLIENTS 24
+
+// 共享内存
+SharedMemory* sharedMemory;
+// 共享内存、信号量和父信号量的ID
+int shmId, semId, parSemId;
+
+// 负载中的命令
+static const Opcode mix_opcodes[] = {Opcode::LS, Opcode::CD, Opcode::NEWFILE, Opcode::CAT, Opcode::COPY, Opcode::DEL};
+static constexpr size_t MIX_SIZE = sizeof(mix_opcodes) / sizeof(mix_opcodes[0]);
+
+// 负载参数
+struct Options {
+    uint32_t clients = 4;                   // 客户端数
+    uint32_t ops = 1000;                    // 每个客户端的命令数
+    double duration = 0;                    // 最长运行时间，单位为秒，0 表示不限
+    uint32_t weights[MIX_SIZE] = {30, 10, 20, 20, 10, 10};  // 各命令的权重
+    uint32_t poll = 100;                    // 轮询响应的间隔，单位为微秒
+    uint32_t timeout = 5000;                // 等待响应的超时时间，单位为毫秒
+    uint32_t file_size = 4096;              // 种子文件的大小
+    uint32_t seed = 1;                      // 随机数种子
+};
+
+// 一条命令的测量结果
+struct Sample {
+    uint64_t latency;        // 从申请请求区到取得响应的时间，单位为纳秒
+    Opcode opcode;           // 操作码
+    ErrorCode code;          // 错误码
+    bool timeout;            // 是否超时
+};
+
+// 客户端测量结束后写回父进程的汇总
+struct Summary {
+    uint64_t elapsed;        // 测量阶段的耗时，单位为纳秒
+    uint32_t count;          // 样本数
+    bool attached;           // 是否注册成功
+};
+
+/**
+ * @brief 模拟的Shell客户端
+ *
+ * 与 simple-os-shell 使用相同的协议：在 semId 保护下写入请求区并通知 parSemId，
+ * 然后轮询响应区中与本请求ID匹配的响应。每个客户端是独立的进程，Simdisk 以进程ID区分会话。
+ * 所有客户端共用一个响应区：请求ID由 Request::send 在 semId 保护下从请求区的计数器分配，各不相同，
+ * 客户端只取走带有自己当前请求ID的未读响应。
+ */
+class Client {
+public:
+    Client(const Options& options, uint32_t index): options(options), rng(options.seed + index) {}
+
+    /**
+     * @brief 注册并准备工作目录
+     *
+     * 创建数据区后以 Option::NEW 注册，在 /home 下建立本客户端的目录，
+     * 并从主机复制一个种子文件供 cat 和 copy 使用。
+     *
+     * @param seed 主机上种子文件的路径
+     * @return true 准备完成
+     */
+    bool attach(const std::string& seed) {
+        arenaId = shmget(IPC_PRIVATE, Arena::segment_size(ARENA_SIZE), IPC_CREAT | 0666);
+        if (arenaId < 0) return false;
+        void* address = shmat(arenaId, nullptr, 0);
+        if (address == (void*)-1) {
+            shmctl(arenaId, IPC_RMID, nullptr);
+            arenaId = -1;
+            return false;
+        }
+        arena = (Arena*)address;
+        arena->capacity = ARENA_SIZE;
+        arena->length = 0;
+        arena->head = 0;
+        arena->tail = 0;
+        arena->state = StreamState::CLOSED;
+        arena->reply_id = 0;
+
+        Response response{};
+        send_request(std::to_string(arenaId), Option::NEW);
+        if (!get_response(response) || response.code != ErrorCode::SUCCESS) return false;
+        directory = "/home/lg" + std::to_string(getpid());
+        if (call({Opcode::MD, FLAG_NONE, {directory}}) != ErrorCode::SUCCESS) return false;
+        return call({Opcode::COPY, FLAG_NONE, {"<host>" + seed, directory + "/seed"}}) == ErrorCode::SUCCESS;
+    }
+
+    /**
+     * @brief 执行负载
+     *
+     * 按权重随机选择命令，直到执行完 ops 条或超过 duration。
+     */
+    void run(std::vector<Sample>& samples) {
+        uint32_t total = 0;
+        for (uint32_t weight: options.weights) total += weight;
+        auto begin = std::chrono::steady_clock::now();
+        auto deadline = begin + std::chrono::duration<double>(options.duration);
+        for (uint32_t i = 0; i < options.ops; ++i) {
+            if (options.duration > 0 && std::chrono::steady_clock::now() >= deadline) break;
+            uint32_t pick = std::uniform_int_distribution<uint32_t>(0, total - 1)(rng);
+            size_t k = 0;
+            while (pick >= options.weights[k]) pick -= options.weights[k++];
+            Command command = next(mix_opcodes[k]);
+
+            Sample sample{0, command.opcode, ErrorCode::SUCCESS, false};
+            auto start = std::chrono::steady_clock::now();
+            Response response{};
+            send_command(command, command.opcode == Opcode::CAT ? Option::CAT : Option::NONE);
+            sample.timeout = !get_response(response);
+            sample.latency = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            sample.code = sample.timeout ? ErrorCode::FAILURE : response.code;
+            samples.push_back(sample);
+            if (sample.code == ErrorCode::SUCCESS) apply(command);
+        }
+    }
+
+    // 删除工作目录并退出会话
+    void detach() {
+        for (const std::string& file: files) call({Opcode::DEL, FLAG_NONE, {directory + "/" + file}});
+        call({Opcode::DEL, FLAG_NONE, {directory + "/seed"}});
+        call({Opcode::CD, FLAG_NONE, {"/"}});
+        call({Opcode::RD, FLAG_NONE, {directory}});
+        Response response{};
+        send_request("exit");
+        get_response(response);
+        shmdt(arena);
+        shmctl(arenaId, IPC_RMID, nullptr);
+    }
+
+private:
+    // 生成下一条命令，文件数达到上限时 newfile 和 copy 改为 del，没有文件时 cat 和 del 作用于种子文件的副本
+    Command next(Opcode opcode) {
+        if ((opcode == Opcode::NEWFILE || opcode == Opcode::COPY) && files.size() >= MAX_FILES) opcode = Opcode::DEL;
+        if (opcode == Opcode::DEL && files.empty()) opcode = Opcode::COPY;
+        switch (opcode) {
+            case Opcode::LS:
+                return {opcode, FLAG_NONE, {}};
+            case Opcode::CD:
+                in_directory = !in_directory;
+                return {opcode, FLAG_NONE, {in_directory ? directory : "/home"}};
+            case Opcode::NEWFILE:
+                return {opcode, FLAG_NONE, {directory + "/f" + std::to_string(serial++)}};
+            case Opcode::COPY:
+                return {opcode, FLAG_NONE, {directory + "/seed", directory + "/f" + std::to_string(serial++)}};
+            case Opcode::CAT:
+                return {opcode, FLAG_NONE, {directory + "/" + (files.empty() ? "seed" : random_file())}};
+            default:
+                return {opcode, FLAG_NONE, {directory + "/" + random_file()}};
+        }
+    }
+
+    // 命令成功后更新本地记录的文件列表
+    void apply(const Command& command) {
+        if (command.opcode == Opcode::NEWFILE || command.opcode == Opcode::COPY) {
+            files.push_back(command.args.back().substr(directory.size() + 1));
+        } else if (command.opcode == Opcode::DEL) {
+            files.erase(std::find(files.begin(), files.end(), command.args[0].substr(directory.size() + 1)));
+        }
+    }
+
+    std::string random_file() {
+        return files[std::uniform_int_distribution<size_t>(0, files.size() - 1)(rng)];
+    }
+
+    // 执行一条不计入测量的命令
+    ErrorCode call(const Command& command) {
+        Response response{};
+        send_command(command);
+        if (!get_response(response)) return ErrorCode::FAILURE;
+        return response.code;
+    }
+
+    // 申请请求区并写入请求
+    void acquire() {
+        Semaphore::P(semId);
+        while (sharedMemory->request.type == 'n') {
+            usleep(options.poll);
+        }
+    }
+
+    void release() {
+        Semaphore::V(semId);
+        Semaphore::V(parSemId);
+    }
+
+    void send_request(const std::string& command, Option option = Option::NONE) {
+        acquire();
+        sharedMemory->request.send(command.c_str(), request_id, option);
+        release();
+    }
+
+    void send_command(const Command& command, Option option = Option::NONE) {
+        std::string data = command.encode();
+        if (data.size() > sizeof(sharedMemory->request.data)) {
+            send_request(command.text(), option);
+            return;
+        }
+        acquire();
+        sharedMemory->request.send_binary(data, request_id, option);
+        release();
+    }
+
+    // 轮询数据区和共享的响应区，直到出现本请求的未读响应，超时返回 false
+    bool get_response(Response& response) const {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.timeout);
+        while (sharedMemory->response.id != request_id || sharedMemory->response.type != 'n') {
+            // 数据在数据区中的响应，响应头也写在数据区中
+            if (arena != nullptr && arena->reply_id.load(std::memory_order_acquire) == request_id) {
+                response.id = request_id;
+                response.code = arena->reply_code;
+                response.option = arena->reply_option;
+                response.length = arena->length;
+                response.in_arena = true;
+                arena->reply_id.store(0, std::memory_order_relaxed);
+                return true;
+            }
+            if (std::chrono::steady_clock::now() >= deadline) return false;
+            usleep(options.poll);
+        }
+        response.id = sharedMemory->response.id;
+        response.code = sharedMemory->response.code;
+        response.option = sharedMemory->response.option;
+        response.length = sharedMemory->response.length;
+        response.in_arena = sharedMemory->response.in_arena;
+        sharedMemory->response.type = 'y';
+        return true;
+    }
+
+    const Options& options;
+    std::mt19937 rng;
+    Arena* arena = nullptr;
+    int arenaId = -1;
+    uint32_t request_id = 0;             // 当前请求的ID（发送时分配）
+    std::string directory;               // 本客户端的工作目录
+    std::vector<std::string> files;      // 工作目录中由负载创建的文件
+    uint32_t serial = 0;                 // 下一个文件的编号
+    bool in_directory = false;           // 当前目录是否为工作目录
+};
+
+/**
+ * @brief 客户端进程
+ *
+ * 准备完成后通知父进程，等到所有客户端都准备好后同时开始，
+ * 结束后把汇总和全部样本写入管道，等所有客户端都结束测量后再清理工作目录。
+ */
+static int client_main(const Options& options, uint32_t index, const std::string& seed, int ready, int go, int out, int done) {
+    void* address = shmat(shmId, nullptr, 0);
+    bool mapped = address != (void*)-1;
+    if (mapped) {
+        sharedMemory = (SharedMemory*)address;
+    } else {
+        perror("loadgen: shmat");
+    }
+    // 连接失败时仍参与同步，以未注册的身份汇报
+    Client client(options, index);
+    Summary summary{0, 0, mapped && client.attach(seed)};
+    char byte = 0;
+    write(ready, &byte, 1);
+    read(go, &byte, 1);
+
+    std::vector<Sample> samples;
+    samples.reserve(std::min<uint32_t>(options.ops, 1 << 20));
+    auto begin = std::chrono::steady_clock::now();
+    if (summary.attached) client.run(samples);
+    summary.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+    summary.count = samples.size();
+    write(out, &summary, sizeof(summary));
+    write(out, samples.data(), samples.size() * sizeof(Sample));
+    close(out);
+    read(done, &byte, 1);
+    if (summary.attached) client.detach();
+    if (mapped) shmdt(sharedMemory);
+    return 0;
+}
+
+static bool read_all(int fd, void* data, size_t size) {
+    auto* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// 百分位（latencies 已排序），单位为微秒
+static double percentile(const std::vector<uint64_t>& latencies, double p) {
+    if (latencies.empty()) return 0;
+    size_t i = std::min(latencies.size() - 1, (size_t)(p / 100 * latencies.size()));
+    return latencies[i] / 1000.;
+}
+
+// 输出一行统计
+static void report(const char* name, std::vector<uint64_t>& latencies, uint32_t errors, uint32_t timeouts) {
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << std::left << std::setw(9) << name << std::right << std::setw(8) << latencies.size()
+              << std::setw(8) << errors << std::setw(9) << timeouts << std::fixed << std::setprecision(1)
+              << std::setw(11) << percentile(latencies, 50) << std::setw(11) << percentile(latencies, 99)
+              << std::setw(11) << percentile(latencies, 99.9)
+              << std::setw(11) << (latencies.empty() ? 0 : latencies.back() / 1000.) << std::endl;
+}
+
+// 解析命令权重，如 ls=30,cd=10,newfile=20,cat=20,copy=10,del=10，未给出的命令权重为 0
+static bool parse_mix(const std::string& text, uint32_t weights[MIX_SIZE]) {
+    std::fill(weights, weights + MIX_SIZE, 0);
+    uint32_t total = 0;
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) return false;
+        std::string name = item.substr(0, eq);
+        size_t k = 0;
+        while (k < MIX_SIZE && name != Command::name(mix_opcodes[k])) ++k;
+        if (k == MIX_SIZE) return false;
+        weights[k] = std::strtoul(item.c_str() + eq + 1, nullptr, 10);
+        total += weights[k];
+    }
+    return total > 0;
+}
+
+/**
+ * @brief Simdisk 负载生成器的入口函数
+ *
+ * 从 "ids.txt" 读取共享内存和信号量的ID，启动多个客户端进程同时向 Simdisk 发送命令，
+ * 最后输出吞吐量、各命令的延迟分位数（微秒）和错误数。
+ *
+ * @return 全部客户端注册成功且没有超时返回 0，否则返回 1；参数错误返回 2
+ */
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "-c" && has_value) {
+            options.clients = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "-n" && has_value) {
+            options.ops = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "-d" && has_value) {
+            options.duration = std::strtod(argv[++i], nullptr);
+            if (options.ops == Options().ops) options.ops = UINT32_MAX;
+        } else if (arg == "--mix" && has_value) {
+            if (!parse_mix(argv[++i], options.weights)) {
+                fprintf(stderr, "%s: invalid mix '%s'\n", argv[0], argv[i]);
+                return 2;
+            }
+        } else if (arg == "--poll" && has_value) {
+            options.poll = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--timeout" && has_value) {
+            options.timeout = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--file-size" && has_value) {
+            options.file_size = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--seed" && has_value) {
+            options.seed = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            fprintf(stderr, "usage: %s [-c clients] [-n ops] [-d seconds] [--mix ls=30,cd=10,newfile=20,cat=20,copy=10,del=10]\n"
+                            "       [--poll us] [--timeout ms] [--file-size bytes] [--seed n]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (options.clients == 0 || options.clients > MAX_CLIENTS) {
+        fprintf(stderr, "%s: the number of clients must be between 1 and %d\n", argv[0], MAX_CLIENTS);
+        return 2;
+    }
+
+    // 从文件 "ids.txt" 读取共享内存、信号量等标识符
+    std::ifstream input("ids.txt");
+    if (!(input >> shmId >> semId >> parSemId)) {
+        fprintf(stderr, "%s: cannot read ids.txt, is simdisk running?\n", argv[0]);
+        return 1;
+    }
+    input.close();
+
+    // 主机上的种子文件，由各客户端复制到自己的目录中
+    char seed[] = "/tmp/simdisk-loadgen-XXXXXX";
+    int seed_fd = mkstemp(seed);
+    std::string contents(options.file_size, 'x');
+    write(seed_fd, contents.data(), contents.size());
+    close(seed_fd);
+
+    int ready[2], go[2], done[2];
+    pipe(ready);
+    pipe(go);
+    pipe(done);
+    std::vector<pid_t> pids;
+    std::vector<int> outs;
+    for (uint32_t i = 0; i < options.clients; ++i) {
+        int out[2];
+        pipe(out);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(go[1]);
+            close(done[1]);
+            close(out[0]);
+            exit(client_main(options, i, seed, ready[1], go[0], out[1], done[0]));
+        }
+        close(out[1]);
+        pids.push_back(pid);
+        outs.push_back(out[0]);
+    }
+    // 等所有客户端准备好后关闭 go 管道，客户端同时开始
+    char byte;
+    for (uint32_t i = 0; i < options.clients; ++i) read(ready[0], &byte, 1);
+    close(go[1]);
+
+    std::vector<uint64_t> latencies[MIX_SIZE], all;
+    uint32_t errors[MIX_SIZE]{}, timeouts[MIX_SIZE]{}, total_errors = 0, total_timeouts = 0, detached = 0;
+    uint64_t elapsed = 0;
+    for (int out: outs) {
+        Summary summary{};
+        std::vector<Sample> samples;
+        if (read_all(out, &summary, sizeof(summary))) {
+            samples.resize(summary.count);
+            if (!read_all(out, samples.data(), samples.size() * sizeof(Sample))) samples.clear();
+        }
+        close(out);
+        if (!summary.attached) ++detached;
+        elapsed = std::max(elapsed, summary.elapsed);
+        for (const Sample& sample: samples) {
+            size_t k = std::find(mix_opcodes, mix_opcodes + MIX_SIZE, sample.opcode) - mix_opcodes;
+            latencies[k].push_back(sample.latency);
+            all.push_back(sample.latency);
+            if (sample.timeout) {
+                ++timeouts[k];
+                ++total_timeouts;
+            } else if (sample.code != ErrorCode::SUCCESS) {
+                ++errors[k];
+                ++total_errors;
+            }
+        }
+    }
+    close(done[1]);
+    for (pid_t pid: pids) waitpid(pid, nullptr, 0);
+    unlink(seed);
+
+    std::cout << "clients " << options.clients << ", commands " << all.size() << ", elapsed " << std::fixed
+              << std::setprecision(3) << elapsed / 1e9 << " s, throughput " << std::setprecision(1)
+              << (elapsed == 0 ? 0 : all.size() * 1e9 / elapsed) << " commands/s" << std::endl;
+    if (detached > 0) std::cout << detached << " client(s) failed to register" << std::endl;
+    std::cout << std::left << std::setw(9) << "command" << std::right << std::setw(8) << "count" << std::setw(8) << "errors"
+              << std::setw(9) << "timeouts" << std::setw(11) << "p50(us)" << std::setw(11) << "p99(us)"
+              << std::setw(11) << "p999(us)" << std::setw(11) << "max(us)" << std::endl;
+    for (size_t k = 0; k < MIX_SIZE; ++k) {
+        if (!latencies[k].empty()) report(Command::name(mix_opcodes[k]), latencies[k], errors[k], timeouts[k]);
+    }
+    report("all", all, total_errors, total_timeouts);
+    return detached == 0 && total_timeouts == 0 ? 0 : 1;
+}
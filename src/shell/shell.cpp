@@ -1,12 +1,15 @@
 #include "../common/common.h"
 #include <iostream>
 #include <sys/shm.h>
+#include <cerrno>
 #include <cstring>
+#include <iomanip>
 #include <fstream>
 #include <string>
 #include <vector>
 #include <unistd.h>
 #include <termios.h>
+#include <sys/wait.h>
 //
 // Created by eric on 10/19/23.
 //
@@ -17,10 +20,17 @@
 #define DOWN 66
 #define LEFT 68
 #define RIGHT 67
+// 脚本模式下每个批量请求包含的最大命令数
+#define SCRIPT_BATCH 64
 // 共享内存
 SharedMemory* sharedMemory;
 // 共享内存、信号量和父信号量的ID
 int shmId, semId, parSemId;
+// 本Shell独占的数据区及其共享内存ID（创建失败时为空，大块响应退回共享的响应区和分段传输）
+Arena* arena = nullptr;
+int arenaId = -1;
+// 没有数据区时存放逐条执行的批量请求结果
+std::vector<char> batch_buffer;
 // 用于存储上一次的路径信息
 std::vector<std::string> last_path;
 // 用于存储当前路径信息
@@ -41,8 +51,8 @@ std::string current_password;
 std::vector<std::string> args;
 // 已定义的命令
 std::vector<std::string> defined_command = {
-        "cat","cd","check","chmod","clear","copy","del","dir","echo","exit","help","info",
-        "ls","ll","md","newfile","rd","su","sudo"
+        "cat","cd","check","chmod","clear","copy","del","dir","du","echo","exit","find","help","info",
+        "ls","ll","log","md","newfile","rd","resize","stats","su","sudo"
 };
 // 当前命令匹配的所有相关命令
 std::vector<std::string> matches;
@@ -182,9 +192,37 @@ public:
         return 0;
     }
 
+/**
+ * @brief 以二进制形式发送命令到Simdisk
+ *
+ * 命令已在Shell端解析，Simdisk按操作码直接分发，无需再解析文本。
+ * 编码后超出请求容量时退回文本形式。
+ *
+ * @param command 要发送的命令
+ * @param option 请求的选项，默认为 Option::NONE
+ * @return int 操作结果，通常为 0 表示成功
+ */
+    int send_command(const Command& command, Option option = Option::NONE) {
+        std::string data = command.encode();
+        if (data.size() > sizeof(sharedMemory->request.data)) {
+            return send_request(command.text(), option);
+        }
+        Semaphore::P(semId);
+        int time = 100000;
+        while (sharedMemory->request.type == 'n') {
+            usleep(time);
+        }
+        sharedMemory->request.send_binary(data, request_id, option);
+        Semaphore::V(semId);
+        Semaphore::V(parSemId);
+        return 0;
+    }
+
 /**
  * @brief 获取Simdisk的响应
  *
+ * 数据写在数据区中的响应，响应头也在数据区中；其余的响应经由共享的响应区，两处都要检查。
+ *
  * @param response 存储Simdisk响应的结构体
  * @param state 控制是否等待响应，默认为 true
  * @return int 操作结果，通常为 0 表示成功
@@ -192,8 +230,24 @@ public:
     int get_response(Response& response, bool state = true) const {
         int time = 100000;
         while (true) {
+            if (arena != nullptr && arena->reply_id.load(std::memory_order_acquire) == request_id) {
+                response.in_arena = true;
+                response.length = arena->length;
+                response.data[0] = '\0';
+                response.id = request_id;
+                response.code = arena->reply_code;
+                response.option = arena->reply_option;
+                arena->reply_id.store(0, std::memory_order_relaxed);
+                break;
+            }
             if (sharedMemory->response.id == request_id) {
-                strcpy(response.data, sharedMemory->response.data);
+                response.in_arena = sharedMemory->response.in_arena;
+                response.length = sharedMemory->response.length;
+                if (response.in_arena) {
+                    response.data[0] = '\0';
+                } else {
+                    strcpy(response.data, sharedMemory->response.data);
+                }
                 response.id = sharedMemory->response.id;
                 response.code = sharedMemory->response.code;
                 response.option = sharedMemory->response.option;
@@ -205,6 +259,265 @@ public:
         return 0;
     }
 
+/**
+ * @brief 获取响应数据
+ *
+ * 数据位于数据区时直接返回数据区地址（原地读取，不拷贝），否则返回响应自带的数据。
+ *
+ * @param response Simdisk的响应
+ * @return const char* 以'\0'结尾的响应数据
+ */
+    static const char* body(const Response& response) {
+        return response.in_arena ? arena->payload() : response.data;
+    }
+
+/**
+ * @brief 输出响应数据
+ *
+ * @param response Simdisk的响应
+ */
+    static void print(const Response& response) {
+        fwrite(body(response), 1, response.length, stdout);
+    }
+
+/**
+ * @brief 格式化输出 ll/dir 返回的目录项记录
+ *
+ * 目录的记录中总有"."，因此只有一条且不是"."的记录表示参数是文件。
+ *
+ * @param data 记录数据
+ * @param length 数据长度
+ * @param opcode Opcode::LL 或 Opcode::DIR
+ */
+    static void print_entries(const char* data, uint32_t length, Opcode opcode) {
+        std::vector<EntryRecord> records(length / sizeof(EntryRecord));
+        memcpy(records.data(), data, records.size() * sizeof(EntryRecord));
+        bool file = records.size() == 1 && records[0].type != 'd' && records[0].name[0] != '.';
+        if (opcode == Opcode::DIR) {
+            if (file) {
+                printf("%s\n", records[0].name);
+                return;
+            }
+            bool state = false;
+            for (const auto& record: records) {
+                if (record.name[0] == '.') continue;
+                printf("%s    ", record.name);
+                state = true;
+            }
+            if (state) printf("\n");
+            return;
+        }
+        printf("Permission      Owner      Group    Address      Size  Capacity     Total  File\n");
+        printf("-------------------------------------------------------------------------------\n");
+        for (const auto& record: records) {
+            char mode[10] = "rwxrwxrwx";
+            for (int i = 0; i < 9; ++i) {
+                if (!(record.mode & (0400 >> i))) mode[i] = '-';
+            }
+            char owner[sizeof(record.owner) + 1] = {};
+            memcpy(owner, record.owner, sizeof(record.owner));
+            printf("%c%s%11s%11s  0x%07x", record.type == 'd' ? 'd' : '-', mode, owner, owner, record.address);
+            if (record.size < 1024) printf("%9uB", record.size);
+            else if (record.size < 1024 * 1024) printf("%9.2fK", record.size / 1024.);
+            else printf("%9.2fM", record.size / (1024. * 1024));
+            if (record.capacity < 1024 * 1024) printf("%9uK", record.capacity / 1024);
+            else printf("%9.2fM", record.capacity / (1024. * 1024));
+            if (record.type != 'd') printf("%10s", "-");
+            else if (record.total < 1024) printf("%9luB", (unsigned long)record.total);
+            else if (record.total < 1024 * 1024) printf("%9.2fK", record.total / 1024.);
+            else printf("%9.2fM", record.total / (1024. * 1024));
+            const char* color = record.type == 'd' ? BLUE : record.type == 'x' ? GREEN : WHITE;
+            printf("%s  %s\n" WHITE, file ? "" : color, record.name);
+        }
+        printf("-------------------------------------------------------------------------------\n");
+    }
+
+// ll 和 dir（不含 dir -s）以结构化记录返回结果；记录只能经数据区返回，没有数据区时仍用文本
+    static bool as_records(const Command& command) {
+        if (arena == nullptr) return false;
+        return command.opcode == Opcode::LL || (command.opcode == Opcode::DIR && !(command.flags & FLAG_RECURSIVE));
+    }
+
+/**
+ * @brief 以结构化记录执行 ll/dir 并在Shell端格式化输出
+ *
+ * Simdisk只返回每个目录项的定长记录，不再逐项格式化文本；没有数据区时退回Simdisk格式化的文本。
+ */
+    void list_entries() {
+        Command command = Command::parse(current_command);
+        bool records = as_records(command);
+        if (records) command.flags |= FLAG_RECORD;
+        send_command(command);
+        Response response{};
+        get_response(response);
+        if (response.code == ErrorCode::SUCCESS && records) {
+            print_entries(body(response), response.length, command.opcode);
+        } else {
+            print(response);
+        }
+        current_command_state = response.code;
+    }
+
+/**
+ * @brief 以流式请求执行命令
+ *
+ * 用于 dir -s、du 和 find：Simdisk边遍历目录树边把结果按帧写入数据区，Shell边收边输出，
+ * 最后输出响应中的错误信息。
+ */
+    void stream_command() {
+        bool streaming = open_stream();
+        send_command(Command::parse(current_command), Option::STREAM);
+        if (streaming) receive_stream();
+        Response response{};
+        get_response(response);
+        print(response);
+        current_command_state = response.code;
+    }
+
+/**
+ * @brief 打开数据区中的流
+ *
+ * @return bool 没有数据区时返回 false，Simdisk退回普通响应
+ */
+    static bool open_stream() {
+        if (arena == nullptr) return false;
+        arena->head.store(0, std::memory_order_relaxed);
+        arena->tail.store(0, std::memory_order_relaxed);
+        arena->state.store(StreamState::OPEN, std::memory_order_release);
+        return true;
+    }
+
+/**
+ * @brief 接收流式响应
+ *
+ * 从数据区的环形队列中逐帧取出数据并输出，每取走一帧归还一个信用，
+ * 直到Simdisk关闭（或中止）流且队列中的帧全部取完。
+ */
+    static void receive_stream() {
+        uint32_t tail = 0;
+        while (true) {
+            StreamState state = arena->state.load(std::memory_order_acquire);
+            uint32_t head = arena->head.load(std::memory_order_acquire);
+            if (tail == head) {
+                if (state != StreamState::OPEN) break;
+                usleep(100);
+                continue;
+            }
+            for (; tail != head; ++tail) {
+                fwrite(arena->frame(tail), 1, arena->frame_length[tail % FRAME_NUM], stdout);
+                arena->tail.store(tail + 1, std::memory_order_release);
+            }
+            fflush(stdout);
+        }
+    }
+
+/**
+ * @brief 分段获取并输出超出数据区容量的响应
+ *
+ * @param header 服务端给出的 "总长度 段长"
+ */
+    void receive_patches(const char* header) {
+        // 文件超出数据区容量，按服务端给出的段长分段获取
+        std::istringstream iss(header);
+        uint32_t length = 0, chunk = 1024;
+        iss >> length >> chunk;
+        uint32_t size = (length + chunk - 1) / chunk;
+        Response response{};
+        for (uint32_t i = 0; i < size; ++i) {
+            send_request("cat " + std::to_string(i), Option::PATCH);
+            get_response(response, false);
+            print(response);
+        }
+    }
+
+/**
+ * @brief 批量发送请求
+ *
+ * 将多条命令写入数据区后作为一个 BATCH 请求发送，Simdisk依次执行，
+ * 并将每一项的结果写回数据区，整批只需一次往返。
+ *
+ * 需要后续交互的项（确认或分段传输）会结束本批次，results 中只包含已执行的项。
+ * 没有数据区时逐条发送，结果按相同的格式存放在 batch_buffer 中。
+ *
+ * @param items 命令及其选项
+ * @param results 各项的结果（位于数据区或 batch_buffer 中，在下一次请求前有效）
+ * @param binary 命令是否为二进制编码
+ * @return ErrorCode 已发送的项都已执行返回 SUCCESS，否则返回 FAILURE
+ */
+    ErrorCode send_batch(const std::vector<std::pair<std::string, Option>>& items, std::vector<BatchItem*>& results, bool binary = false) {
+        results.clear();
+        if (arena == nullptr) return send_each(items, results, binary);
+        char* base = arena->payload();
+        size_t offset = 0;
+        for (const auto& [command, option]: items) {
+            if (offset + BatchItem::space(command.size()) > arena->capacity) break;
+            auto* item = reinterpret_cast<BatchItem*>(base + offset);
+            item->option = option;
+            item->code = ErrorCode::SUCCESS;
+            item->length = command.size();
+            item->elapsed = 0;
+            item->binary = binary;
+            memcpy(item->data(), command.data(), command.size());
+            item->data()[command.size()] = '\0';
+            offset += BatchItem::space(item->length);
+        }
+        arena->length = offset;
+        send_request(std::to_string(items.size()), Option::BATCH);
+        Response response{};
+        get_response(response);
+        if (response.option != Option::BATCH) {
+            print(response);
+            return ErrorCode::FAILURE;
+        }
+        offset = 0;
+        while (offset + sizeof(BatchItem) <= response.length) {
+            auto* item = reinterpret_cast<BatchItem*>(base + offset);
+            results.push_back(item);
+            offset += BatchItem::space(item->length);
+        }
+        return response.code;
+    }
+
+/**
+ * @brief 没有数据区时逐条发送批量请求中的命令
+ *
+ * @param items 命令及其选项
+ * @param results 各项的结果（位于 batch_buffer 中）
+ * @param binary 命令是否为二进制编码
+ * @return ErrorCode 已发送的项都已执行返回 SUCCESS，否则返回 FAILURE
+ */
+    ErrorCode send_each(const std::vector<std::pair<std::string, Option>>& items, std::vector<BatchItem*>& results, bool binary) {
+        batch_buffer.clear();
+        Response response{};
+        for (const auto& [command, option]: items) {
+            Command parsed;
+            if (binary && Command::decode(command.data(), command.size(), parsed)) {
+                send_command(parsed, option);
+            } else {
+                send_request(command, option);
+            }
+            get_response(response);
+            uint32_t length = strlen(response.data);
+            size_t offset = batch_buffer.size();
+            batch_buffer.resize(offset + BatchItem::space(length));
+            auto* item = reinterpret_cast<BatchItem*>(batch_buffer.data() + offset);
+            item->option = response.option;
+            item->code = response.code;
+            item->length = length;
+            item->elapsed = 0;
+            item->binary = false;
+            memcpy(item->data(), response.data, length + 1);
+            if (response.option == Option::REQUEST || response.option == Option::PATCH) break;
+        }
+        size_t offset = 0;
+        while (offset < batch_buffer.size()) {
+            auto* item = reinterpret_cast<BatchItem*>(batch_buffer.data() + offset);
+            results.push_back(item);
+            offset += BatchItem::space(item->length);
+        }
+        return ErrorCode::SUCCESS;
+    }
+
     std::string get_string(const std::string& path = "") {
         std::string command;
         char ch;
@@ -322,7 +635,7 @@ public:
                             send_request(command, Option::TAB);
                             Response response{};
                             get_response(response);
-                            std::string match = response.data;
+                            std::string match = body(response);
                             std::istringstream iss(match);
                             std::vector<std::string> results;
                             std::string result;
@@ -354,7 +667,7 @@ public:
                         send_request(command, Option::TAB);
                         Response response{};
                         get_response(response);
-                        std::string match = response.data;
+                        std::string match = body(response);
                         std::istringstream iss(match);
                         std::vector<std::string> results;
                         std::string result;
@@ -436,23 +749,20 @@ public:
                 goto begin;
             }
             if (args.size() == 2) {
-                send_request("cat " + args[1], Option::CAT);
+                // 流式获取文件内容，每收到一帧立即输出
+                bool streaming = open_stream();
+                send_request("cat " + args[1], Option::STREAM);
+                if (streaming) receive_stream();
                 Response response{};
                 get_response(response);
                 if (response.code == ErrorCode::SUCCESS) {
                     if (response.option == Option::PATCH) {
-                        uint32_t size = (std::stoul(std::string(response.data)) + 1023) / 1024;
-                        std::string result;
-                        for (uint32_t i = 0; i < size; ++i) {
-                            send_request("cat " + std::to_string(i), Option::PATCH);
-                            get_response(response, false);
-                            printf("%s", response.data);
-                        }
+                        receive_patches(body(response));
                     } else {
-                        printf("%s", response.data);
+                        print(response);
                     }
                 } else {
-                    printf("%s", response.data);
+                    print(response);
                 }
                 return;
             } else {
@@ -460,23 +770,23 @@ public:
                 Response response{};
                 get_response(response);
                 if (response.code == ErrorCode::FAILURE) {
-                    printf("%s", response.data);
+                    print(response);
                     return;
                 }
                 if (args[1] == "-w") {
                     send_request("cat " + args[2], Option::GET);
                     get_response(response);
                     if (response.code == ErrorCode::FAILURE) {
-                        printf("%s", response.data);
+                        print(response);
                         return;
                     }
                     pid_t pid = fork();
-                    std::string name = response.data;
+                    std::string name = body(response);
                     if (pid == -1) {
                         printf("\n");
                         return;
                     } else if (pid == 0) {
-                        name = response.data;
+                        name = body(response);
                         system(("nano " + name).c_str());
                         exit(0);
                     } else {
@@ -491,16 +801,16 @@ public:
                     send_request("cat " + args[2], Option::READ);
                     get_response(response);
                     if (response.code == ErrorCode::FAILURE) {
-                        printf("%s", response.data);
+                        print(response);
                         return;
                     }
                     pid_t pid = fork();
-                    std::string name = response.data;
+                    std::string name = body(response);
                     if (pid == -1) {
                         printf("\n");
                         return;
                     } else if (pid == 0) {
-                        name = response.data;
+                        name = body(response);
                         system(("less -N " + name).c_str());
                         exit(0);
                     } else {
@@ -536,11 +846,22 @@ public:
         } else if (args[0] == "del") {
 
         } else if (args[0] == "dir") {
-
+            if (Command::parse(current_command).flags & FLAG_RECURSIVE) {
+                stream_command();
+            } else {
+                list_entries();
+            }
+            return;
+        } else if (args[0] == "du") {
+            stream_command();
+            return;
         } else if (args[0] == "echo") {
 
         } else if (args[0] == "exec") {
 
+        } else if (args[0] == "find") {
+            stream_command();
+            return;
         } else if (args[0] == "help") {
             std::cout << "These shell commands are defined internally.  Type 'help' to see this list." << std::endl;
             std::cout << "Type 'help name' to find out more about the function 'name'." << std::endl;
@@ -553,16 +874,21 @@ public:
             std::cout << std::right << std::setw(7) << "chmod" << std::setw(60) << "Change the permissions of a file or directory" << std::endl;
             std::cout << std::right << std::setw(7) << "clear" << std::setw(60) << "Clear the screen" << std::endl;            std::cout << std::right << std::setw(7) << "copy" << std::setw(60) << "Copy a file or directory to a specified location" << std::endl;
             std::cout << std::right << std::setw(7) << "del" << std::setw(60) << "Remove an existing file" << std::endl;
-            std::cout << std::right << std::setw(7) << "dir" << std::setw(60) << "List files and directories in the current directory" << std::endl;
+            std::cout << std::right << std::setw(7) << "dir" << std::setw(60) << "List files and directories (-s: all subdirectories)" << std::endl;
+            std::cout << std::right << std::setw(7) << "du" << std::setw(60) << "Show the size of each directory (-s: total only)" << std::endl;
             std::cout << std::right << std::setw(7) << "echo" << std::setw(60) << "Print a message to the console" << std::endl;
             std::cout << std::right << std::setw(7) << "exit" << std::setw(60) << "Exit the shell" << std::endl;
+            std::cout << std::right << std::setw(7) << "find" << std::setw(60) << "Search a directory tree by name (-name <pattern>)" << std::endl;
             std::cout << std::right << std::setw(7) << "help" << std::setw(60) << "Display a list of available commands and their descriptions" << std::endl;
             std::cout << std::right << std::setw(7) << "info" << std::setw(60) << "Show information about the file system" << std::endl;
             std::cout << std::right << std::setw(7) << "ls" << std::setw(60) << "List files and directories in the current directory" << std::endl;
             std::cout << std::right << std::setw(7) << "ll" << std::setw(60) << "List files and directories with detailed information" << std::endl;
+            std::cout << std::right << std::setw(7) << "log" << std::setw(60) << "Show or set the audit log level (off, audit, trace)" << std::endl;
             std::cout << std::right << std::setw(7) << "md" << std::setw(60) << "Create a new directory" << std::endl;
             std::cout << std::right << std::setw(7) << "newfile" << std::setw(60) << "Create a new file" << std::endl;
             std::cout << std::right << std::setw(7) << "rd" << std::setw(60) << "Remove an existing directory" << std::endl;
+            std::cout << std::right << std::setw(7) << "resize" << std::setw(60) << "Grow the disk to the given size" << std::endl;
+            std::cout << std::right << std::setw(7) << "stats" << std::setw(60) << "Show per-command latency statistics (-r to reset)" << std::endl;
             std::cout << std::right << std::setw(7) << "su" << std::setw(60) << "Switch to another user account" << std::endl;
             std::cout << std::right << std::setw(7) << "sudo" << std::setw(60) << "Execute a command with superuser privileges" << std::endl;
             std::cout << "-------------------------------------------------------------------" << std::endl;
@@ -572,7 +898,8 @@ public:
         } else if (args[0] == "ls") {
 
         } else if (args[0] == "ll") {
-
+            list_entries();
+            return;
         } else if (args[0] == "md") {
             if (args.size() == 1) {
                 printf("md: missing operand\n");
@@ -588,33 +915,52 @@ public:
                 printf("rd: missing operand\n");
                 goto begin;
             }
+            // 所有目录在一个批量请求中删除，遇到需要确认的目录时先确认，再发送剩余的目录
+            std::vector<std::pair<std::string, Option>> items;
             for (int i = 1; i < args.size(); ++i) {
-                std::string sub_command = "rd " + args[i];
-                send_request(sub_command);
-                Response response{};
-                get_response(response);
-                current_command_state = response.code;
-                if (response.code == ErrorCode::SUCCESS && strlen(response.data) > 0 && args.size() > 2) {
-                    printf("rd %s: %s ", args[i].c_str(), response.data);
-                } else {
-                    if (strlen(response.data) > 0) printf("%s ", response.data);
-                }
-                if (response.option == Option::REQUEST) {
-                    std::string option;
-                    std::getline(std::cin, option);
-                    if (option == "Y" || option == "y") {
-                        send_request(sub_command, Option::RESPONSE);
-                        get_response(response);
-                        current_command_state = response.code;
-                        printf("%s", response.data);
+                items.emplace_back("rd " + args[i], Option::NONE);
+            }
+            size_t next = 0;
+            while (next < items.size()) {
+                std::vector<std::pair<std::string, Option>> pending(items.begin() + next, items.end());
+                std::vector<BatchItem*> results;
+                current_command_state = send_batch(pending, results);
+                if (results.empty()) break;
+                for (auto result: results) {
+                    current_command_state = result->code;
+                    if (result->code == ErrorCode::SUCCESS && result->length > 0 && args.size() > 2) {
+                        printf("rd %s: %s ", args[next + 1].c_str(), result->data());
+                    } else {
+                        if (result->length > 0) printf("%s ", result->data());
+                    }
+                    if (result->option == Option::REQUEST) {
+                        std::string option;
+                        std::getline(std::cin, option);
+                        if (option == "Y" || option == "y") {
+                            send_request(items[next].first, Option::RESPONSE);
+                            Response response{};
+                            get_response(response);
+                            current_command_state = response.code;
+                            print(response);
+                        }
                     }
+                    ++next;
                 }
             }
             return;
+        } else if (args[0] == "resize") {
+            if (args.size() == 1) {
+                printf("resize: missing operand\n");
+                goto begin;
+            }
         } else if (args[0] == "scp") {
 
         } else if (args[0] == "save") {
 
+        } else if (args[0] == "stats") {
+
+        } else if (args[0] == "log") {
+
         } else if (args[0] == "su") {
             if (args.size() == 1) {
                 printf("su: missing operand\n");
@@ -629,7 +975,7 @@ public:
             send_request(current_command + ' ' + current_password, Option::SWITCH);
             Response response{};
             get_response(response);
-            printf("%s", response.data);
+            print(response);
             current_command_state = response.code;
             change_command = true;
             current_username = args[1];
@@ -681,12 +1027,156 @@ public:
             printf("%s: command not found\n", args[0].c_str());
             goto begin;
         }
-        send_request(current_command);
+        send_command(Command::parse(current_command));
         Response response{};
         get_response(response);
-        printf("%s", response.data);
+        print(response);
         current_command_state = response.code;
     }
+/**
+ * @brief 将脚本中的一行命令转换为批量请求项
+ *
+ * @param line 命令
+ * @param item 转换后的请求项（二进制编码的命令及其选项）
+ * @param error 不支持时的错误信息
+ * @return true 可以在脚本模式下执行
+ * @return false 不支持的命令
+ */
+    static bool script_item(const std::string& line, std::pair<std::string, Option>& item, std::string& error) {
+        Command command = Command::parse(line);
+        std::string name = split_command(line)[0];
+        if (command.opcode == Opcode::NONE) {
+            if (name == "clear" || name == "help") {
+                error = name + ": not supported in script mode\n";
+            } else {
+                error = name + ": command not found\n";
+            }
+            return false;
+        }
+        Option option = Option::NONE;
+        if (command.opcode == Opcode::CAT) {
+            if (command.args.size() != 1) {
+                error = "cat: editing files is not supported in script mode\n";
+                return false;
+            }
+            option = Option::CAT;
+        } else if (command.opcode == Opcode::SU) {
+            option = Option::SWITCH;
+        } else if (as_records(command)) {
+            command.flags |= FLAG_RECORD;
+        }
+        item = {command.encode(), option};
+        return true;
+    }
+
+/**
+ * @brief 以非交互方式执行命令脚本
+ *
+ * 逐行读取命令（忽略空行和以'#'开头的注释，遇到 exit 结束），在Shell端解析后
+ * 以二进制形式批量发送，每批最多 SCRIPT_BATCH 条。需要确认的命令在 yes 为 true 时
+ * 自动确认，否则视为拒绝。
+ *
+ * @param input 脚本输入流
+ * @param timing 是否向标准错误输出耗时：每条命令在Simdisk中的执行耗时（server），
+ *               每一批及总的往返耗时（client，包括排队、传输和执行）
+ * @param yes 是否自动确认
+ * @return int 全部命令执行成功返回 0，否则返回 1
+ */
+    int script(std::istream& input, bool timing, bool yes) {
+        send_request(arena == nullptr ? "" : std::to_string(arenaId), Option::NEW);
+        Response response{};
+        get_response(response);
+        if (response.code == ErrorCode::FAILURE) return 1;
+
+        std::vector<std::string> commands;
+        std::string line;
+        while (std::getline(input, line)) {
+            std::vector<std::string> words = split_command(line);
+            if (words.empty() || words[0][0] == '#') continue;
+            if (words[0] == "exit") break;
+            if (words[0] == "rd") {
+                // 与交互模式一致，逐个目录删除以便分别确认
+                for (size_t i = 1; i < words.size(); ++i) commands.push_back("rd " + words[i]);
+                continue;
+            }
+            commands.push_back(line);
+        }
+
+        uint32_t failures = 0;
+        auto begin = std::chrono::steady_clock::now();
+        size_t next = 0;
+        while (next < commands.size()) {
+            // 收集到下一条不支持的命令为止，保证输出顺序与脚本一致
+            std::vector<std::pair<std::string, Option>> items;
+            std::pair<std::string, Option> item;
+            std::string error;
+            for (size_t i = next; i < commands.size() && items.size() < SCRIPT_BATCH; ++i) {
+                if (!script_item(commands[i], item, error)) {
+                    if (items.empty()) {
+                        printf("%s", error.c_str());
+                        ++failures;
+                        ++next;
+                    }
+                    break;
+                }
+                items.push_back(item);
+            }
+            if (items.empty()) continue;
+            std::vector<BatchItem*> results;
+            auto sent = std::chrono::steady_clock::now();
+            send_batch(items, results, true);
+            auto round_trip = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sent).count();
+            if (results.empty()) {
+                ++failures;
+                break;
+            }
+            for (auto result: results) {
+                ErrorCode state = result->code;
+                Command command = Command::parse(commands[next]);
+                if (result->option == Option::PATCH) {
+                    receive_patches(result->data());
+                } else if (state == ErrorCode::SUCCESS && as_records(command)) {
+                    print_entries(result->data(), result->length, command.opcode);
+                } else {
+                    fwrite(result->data(), 1, result->length, stdout);
+                }
+                if (result->option == Option::REQUEST) {
+                    if (yes) {
+                        printf("y\n");
+                        auto confirmed = std::chrono::steady_clock::now();
+                        send_request(commands[next], Option::RESPONSE);
+                        get_response(response);
+                        round_trip += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - confirmed).count();
+                        print(response);
+                        state = response.code;
+                    } else {
+                        printf("n\n");
+                    }
+                }
+                if (state != ErrorCode::SUCCESS) ++failures;
+                if (timing) {
+                    fflush(stdout);
+                    fprintf(stderr, "[server %10.3f ms] %s\n", result->elapsed / 1000., commands[next].c_str());
+                }
+                ++next;
+            }
+            if (timing) fprintf(stderr, "[client %10.3f ms] round trip: %zu commands\n", round_trip / 1000., results.size());
+        }
+        fflush(stdout);
+        if (timing) {
+            auto total = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+            fprintf(stderr, "[client %10.3f ms] total: %zu commands, %u failed\n", total / 1000., commands.size(), failures);
+        }
+
+        send_request("exit");
+        shmdt(sharedMemory);
+        if (arena != nullptr) {
+            shmdt(arena);
+            shmctl(arenaId, IPC_RMID, nullptr);
+        }
+        return failures == 0 ? 0 : 1;
+    }
+
 /**
  * @brief 运行Simdisk Shell
  *
@@ -696,8 +1186,8 @@ public:
  * @note 当前实现中的具体操作逻辑需要根据实际代码来填写注释。
  */
     void run() {
-        // 发送 NEW 请求，告知Simdisk创建新的Shell
-        send_request("", Option::NEW);
+        // 发送 NEW 请求，告知Simdisk创建新的Shell，并附带本Shell数据区的共享内存ID
+        send_request(arena == nullptr ? "" : std::to_string(arenaId), Option::NEW);
         Response response{};
         // 获取Simdisk的初始化响应
         get_response(response);
@@ -721,8 +1211,12 @@ public:
             if (current_command == "exit") break;
         }
 
-        // 释放共享内存
+        // 释放共享内存和数据区
         shmdt(sharedMemory);
+        if (arena != nullptr) {
+            shmdt(arena);
+            shmctl(arenaId, IPC_RMID, nullptr);
+        }
     }
 
 };
@@ -731,10 +1225,35 @@ public:
  *
  * 从文件 "ids.txt" 中读取共享内存、信号量等标识符，
  * 然后将共享内存附加到进程中，创建 Shell 实例并运行。
+ * 使用 -f 指定脚本文件（"-" 表示标准输入）时以非交互方式执行脚本，
+ * --time 输出每条命令在Simdisk中的耗时和Shell端测得的往返耗时，--yes 自动确认。
  *
- * @return 程序执行成功返回 0
+ * @return 交互模式返回 0；脚本模式下全部命令成功返回 0，否则返回 1；参数错误返回 2
  */
-int main() {
+int main(int argc, char* argv[]) {
+    const char* script = nullptr;
+    bool timing = false, yes = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            script = argv[++i];
+        } else if (strcmp(argv[i], "--time") == 0) {
+            timing = true;
+        } else if (strcmp(argv[i], "--yes") == 0) {
+            yes = true;
+        } else {
+            fprintf(stderr, "usage: %s [-f <script|->] [--time] [--yes]\n", argv[0]);
+            return 2;
+        }
+    }
+    std::ifstream file;
+    if (script != nullptr && strcmp(script, "-") != 0) {
+        file.open(script);
+        if (!file) {
+            fprintf(stderr, "%s: cannot open script '%s'\n", argv[0], script);
+            return 2;
+        }
+    }
+
     // 从文件 "ids.txt" 读取共享内存、信号量等标识符
     std::ifstream input("ids.txt");
     input >> shmId >> semId >> parSemId;
@@ -743,8 +1262,36 @@ int main() {
     // 将共享内存附加到进程中
     sharedMemory = (SharedMemory*)shmat(shmId, nullptr, 0);
 
+    // 创建本Shell独占的数据区，Simdisk将大块响应直接写入其中
+    arenaId = shmget(IPC_PRIVATE, Arena::segment_size(ARENA_SIZE), IPC_CREAT | 0666);
+    int error = errno;
+    if (arenaId >= 0) {
+        void* address = shmat(arenaId, nullptr, 0);
+        error = errno;
+        if (address == (void*)-1) {
+            shmctl(arenaId, IPC_RMID, nullptr);
+        } else {
+            arena = (Arena*)address;
+        }
+    }
+    if (arena != nullptr) {
+        arena->capacity = ARENA_SIZE;
+        arena->length = 0;
+        arena->head = 0;
+        arena->tail = 0;
+        arena->state = StreamState::CLOSED;
+        arena->reply_id = 0;
+    } else {
+        // 没有数据区仍可使用，只是大块响应要经由共享的响应区分段传输
+        fprintf(stderr, "%s: cannot create the data arena: %s\n", argv[0], strerror(error));
+        arenaId = -1;
+    }
+
     // 创建 Shell 实例并运行
     Shell shell{};
+    if (script != nullptr) {
+        return shell.script(file.is_open() ? static_cast<std::istream&>(file) : std::cin, timing, yes);
+    }
     shell.run();
 
     return 0;
@@ -0,0 +1,128 @@
+//
+// Created by eric on 12/06/23.
+//
+#include "audit.h"
+#include <chrono>
+#include <fcntl.h>
+#include <iomanip>
+#include <thread>
+#include <algorithm>
+#include <vector>
+
+// 后台线程每次最多写入的记录数与队列为空时的休眠时间
+static constexpr size_t AUDIT_BATCH = 256;
+static constexpr auto AUDIT_IDLE = std::chrono::milliseconds(10);
+
+bool AuditLog::open(const std::string& file) {
+    if (fd >= 0) ::close(fd);
+    path = file;
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return false;
+    // 新文件先写入文件头
+    if (lseek(fd, 0, SEEK_END) == 0) {
+        AuditHeader header{AUDIT_MAGIC, sizeof(AuditRecord)};
+        write(fd, &header, sizeof(header));
+    }
+    return true;
+}
+
+/**
+ * @brief 后台线程的主循环
+ *
+ * 轮流取出两个队列中的记录，攒成一批后一次 write；两个队列都为空时休眠。
+ * 记录按入队的顺序写入各自的队列，两个队列之间的顺序由记录中的时间确定。
+ */
+void AuditLog::run() {
+    std::vector<AuditRecord> batch(AUDIT_BATCH);
+    while (true) {
+        size_t n = 0;
+        while (n < AUDIT_BATCH && (server_ring.pop(batch[n]) || cooker_ring.pop(batch[n]))) {
+            ++n;
+        }
+        if (n == 0) {
+            std::this_thread::sleep_for(AUDIT_IDLE);
+            continue;
+        }
+        if (fd >= 0 && write(fd, batch.data(), n * sizeof(AuditRecord)) == (ssize_t)(n * sizeof(AuditRecord))) {
+            written.fetch_add(n, std::memory_order_relaxed);
+        } else {
+            dropped.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+}
+
+const char* AuditLog::name(Level value) {
+    switch (value) {
+        case OFF: return "off";
+        case AUDIT: return "audit";
+        case TRACE: return "trace";
+    }
+    return "?";
+}
+
+bool AuditLog::parse(const std::string& text, Level& value) {
+    for (Level candidate: {OFF, AUDIT, TRACE}) {
+        if (text == name(candidate)) {
+            value = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// 错误码名称
+static const char* code_name(uint8_t code) {
+    static const char* const names[] = {
+        "SUCCESS", "FAILURE", "EXISTS", "EXCEEDED", "WAIT_REQUEST",
+        "FILE_NOT_FOUND", "FILE_NOT_MATCH", "PERMISSION_DENIED", "LOCKED"
+    };
+    return code < sizeof(names) / sizeof(names[0]) ? names[code] : "?";
+}
+
+/**
+ * @brief 把二进制日志转换为文本
+ *
+ * 每条记录一行：时间（精确到微秒）、Shell 的进程ID、请求ID、用户、事件，
+ * 命令记录另外输出命令名、结果、排队与执行时间、读写的块数和第一个参数。
+ */
+int AuditLog::decode(const std::string& file, std::ostream& out) {
+    int in = ::open(file.c_str(), O_RDONLY);
+    AuditHeader header{};
+    if (in < 0 || read(in, &header, sizeof(header)) != sizeof(header)
+        || header.magic != AUDIT_MAGIC || header.record_size != sizeof(AuditRecord)) {
+        std::cerr << "simdisk: '" << file << "' is not an audit log" << std::endl;
+        if (in >= 0) ::close(in);
+        return 1;
+    }
+    // 两个队列的记录在文件中交错，按时间排序后输出
+    std::vector<AuditRecord> records;
+    AuditRecord chunk[AUDIT_BATCH];
+    ssize_t n;
+    while ((n = read(in, chunk, sizeof(chunk))) > 0) {
+        records.insert(records.end(), chunk, chunk + n / sizeof(AuditRecord));
+    }
+    ::close(in);
+    std::stable_sort(records.begin(), records.end(), [](const AuditRecord& a, const AuditRecord& b) { return a.time < b.time; });
+    for (const AuditRecord& record: records) {
+        std::time_t seconds = record.time / 1000000000;
+        out << std::put_time(std::localtime(&seconds), "%Y-%m-%d %H:%M:%S") << '.'
+            << std::setfill('0') << std::setw(6) << record.time % 1000000000 / 1000 << std::setfill(' ')
+            << " pid " << std::left << std::setw(7) << record.pid << " req " << std::setw(6) << record.id
+            << std::setw(9) << std::string(record.user, strnlen(record.user, sizeof(record.user)));
+        switch (record.event) {
+            case RECEIVED:
+                out << "received";
+                break;
+            case RESPONDED:
+                out << "responded after " << record.elapsed << "us";
+                break;
+            default:
+                out << std::setw(8) << Command::name((Opcode)record.opcode) << std::setw(18) << code_name(record.code)
+                    << std::right << "wait " << std::setw(6) << record.wait << "us  exec " << std::setw(8) << record.elapsed
+                    << "us  r " << std::setw(5) << record.reads << " w " << std::setw(5) << record.writes << "  "
+                    << std::string(record.detail, strnlen(record.detail, sizeof(record.detail)));
+        }
+        out << std::right << '\n';
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+//
+// Created by eric on 12/06/23.
+//
+
+#ifndef SIMPLE_OS_AUDIT_H
+#define SIMPLE_OS_AUDIT_H
+#include "../common/common.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+#define AUDIT_MAGIC 0x31445541                    // 审计日志文件标志 "AUD1"
+
+/**
+ * @brief 审计日志记录
+ *
+ * 定长 64 字节，直接以二进制写入日志文件，由 simdisk --decode-log 离线转换为文本。
+ */
+struct AuditRecord {
+    int64_t time;            // 时间，自 1970 年起的纳秒数
+    uint32_t pid;            // Shell 的进程ID
+    uint32_t id;             // 请求ID
+    uint32_t wait;           // 排队时间，单位为微秒
+    uint32_t elapsed;        // 执行时间（RESPONDED 为从入队到响应的时间），单位为微秒
+    uint32_t reads;          // 读取的块数
+    uint32_t writes;         // 写入的块数
+    char user[8];            // 用户名
+    uint8_t event;           // 事件类型
+    uint8_t opcode;          // 操作码
+    uint8_t option;          // 请求选项
+    uint8_t code;            // 错误码
+    char detail[20];         // 第一个参数的前 20 个字节
+};
+static_assert(sizeof(AuditRecord) == 64);
+
+// 审计日志文件头
+struct AuditHeader {
+    uint32_t magic;          // AUDIT_MAGIC
+    uint32_t record_size;    // 每条记录的字节数
+};
+
+/**
+ * @brief 单生产者单消费者的无锁环形队列
+ *
+ * 生产者只写 head，消费者只写 tail，两者位于不同的缓存行。队列满时 push 失败，
+ * 生产者不会等待。
+ *
+ * @tparam T 元素类型
+ * @tparam N 容量，必须是 2 的幂
+ */
+template <typename T, size_t N>
+class SpscRing {
+    static_assert((N & (N - 1)) == 0);
+public:
+    bool push(const T& item) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == N) return false;
+        items[head & (N - 1)] = item;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) return false;
+        item = items[tail & (N - 1)];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+    alignas(64) std::array<T, N> items{};
+};
+
+/**
+ * @brief 审计日志
+ *
+ * 接收线程和处理线程各自把记录放入自己的环形队列，由后台线程批量写入 <磁盘镜像>.audit。
+ * 请求路径上只需填写一条记录并入队，不做格式化和 I/O；队列满时丢弃记录并计数。
+ */
+struct AuditLog {
+    // 日志级别
+    enum Level : uint8_t {
+        OFF,             // 不记录
+        AUDIT,           // 每条命令一条记录
+        TRACE,           // 另外记录请求的接收与响应
+    };
+    // 事件类型
+    enum Event : uint8_t {
+        RECEIVED,        // 接收线程收到请求
+        COMMAND,         // 一条命令执行完毕
+        RESPONDED,       // 响应已发送
+    };
+    static constexpr size_t RING_SIZE = 4096;
+
+    inline static std::atomic<uint8_t> level{AUDIT};
+    inline static SpscRing<AuditRecord, RING_SIZE> server_ring;  // 接收线程的队列
+    inline static SpscRing<AuditRecord, RING_SIZE> cooker_ring;  // 处理线程的队列
+    inline static std::atomic<uint64_t> written{0};              // 已写入的记录数
+    inline static std::atomic<uint64_t> dropped{0};              // 因队列满而丢弃的记录数
+    inline static std::string path;                              // 日志文件路径
+    inline static int fd = -1;
+
+    // 当前时间，自 1970 年起的纳秒数
+    static int64_t now() {
+        timespec ts{};
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    // 日志级别不低于 at 时放入队列
+    static void push(SpscRing<AuditRecord, RING_SIZE>& ring, Level at, const AuditRecord& record) {
+        if (level.load(std::memory_order_relaxed) < at) return;
+        if (!ring.push(record)) dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // 打开（追加）日志文件
+    static bool open(const std::string& file);
+
+    // 后台线程的主循环
+    [[noreturn]] static void run();
+
+    // 级别名称与解析
+    static const char* name(Level value);
+    static bool parse(const std::string& text, Level& value);
+
+    // 把二进制日志转换为文本输出，返回进程退出码
+    static int decode(const std::string& file, std::ostream& out);
+};
+#endif //SIMPLE_OS_AUDIT_H
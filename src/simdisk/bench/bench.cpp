@@ -0,0 +1,187 @@
+//
+// Created by eric on 12/08/23.
+//
+#include "../filesystem.h"
+#include <benchmark/benchmark.h>
+#include <filesystem>
+#include <random>
+#include <unistd.h>
+
+static Filesystem fs;
+using AutoEntry = Filesystem::AutoEntry;
+
+/**
+ * @brief 基准测试使用的临时镜像
+ *
+ * 第一次使用时在临时目录中格式化一个 256 MiB 的镜像，并建好各项测试用到的文件，
+ * 进程退出时删除镜像及其附属文件。
+ */
+struct BenchImage {
+    static constexpr uint32_t MAX_DEPTH = 16;
+
+    std::string path;
+
+    BenchImage() {
+        path = (std::filesystem::temp_directory_path() / ("simdisk-bench-" + std::to_string(getpid()) + ".img")).string();
+        Geometry::size = 256ull << 20;
+        fs._new(path);
+        // 深度为 n 的路径由 /root 和 n-1 级子目录 d 组成
+        std::string dir = "/root";
+        for (uint32_t depth = 2; depth <= MAX_DEPTH; ++depth) {
+            dir += "/d";
+            fs.md(dir);
+        }
+        // 分别只用直接块、一级间接块和二级间接块的文件
+        write("/root/direct", 6 * BLOCK_SIZE);
+        write("/root/indirect", (6 + POINTERS_PER_BLOCK) * BLOCK_SIZE);
+        write("/root/double", 4096 * BLOCK_SIZE);
+        fs.newfile("/root/data");
+        fs.response.str("");
+    }
+
+    ~BenchImage() {
+        std::filesystem::remove(path);
+        std::filesystem::remove(path + ".cbt");
+    }
+
+    static void write(const std::string& file, size_t size) {
+        fs.newfile(file);
+        AutoEntry parent(fs.get_path_entry("/root").second);
+        fs.write_data(parent.elem(), file.substr(6).c_str(), std::string(size, 'x'));
+    }
+
+    // 深度为 depth 的路径
+    static std::string path_at(uint32_t depth) {
+        std::string res = "/root";
+        for (uint32_t i = 1; i < depth; ++i) res += "/d";
+        return res;
+    }
+};
+
+static void image() {
+    static BenchImage instance;
+}
+
+// 位图中已有 range(0)% 的位被占用时分配并释放一个位置
+static void BM_BitmapNewDelete(benchmark::State& state) {
+    image();
+    Bitmap* bitmap = Filesystem::blocks_bitmap;
+    std::vector<uint32_t> filled;
+    uint32_t target = (uint64_t)Filesystem::super->superblock.blocks_num * state.range(0) / 100;
+    while (bitmap->counter < target) filled.push_back(bitmap->_new());
+    for (auto _: state) {
+        uint32_t i = bitmap->_new();
+        benchmark::DoNotOptimize(i);
+        bitmap->_delete(i);
+    }
+    for (uint32_t i: filled) bitmap->_delete(i);
+}
+BENCHMARK(BM_BitmapNewDelete)->Arg(0)->Arg(50)->Arg(90);
+
+// 随机读取已分配的 Inode
+static void BM_GetInode(benchmark::State& state) {
+    image();
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<uint32_t> pick(0, Filesystem::inodes_bitmap->counter - 1);
+    for (auto _: state) {
+        benchmark::DoNotOptimize(Filesystem::get_inode(pick(rng)));
+    }
+}
+BENCHMARK(BM_GetInode);
+
+// 解析深度为 range(0) 的绝对路径
+static void BM_GetPathEntry(benchmark::State& state) {
+    image();
+    std::string path = BenchImage::path_at(state.range(0));
+    for (auto _: state) {
+        Entry* entry = fs.get_path_entry(path).second;
+        benchmark::DoNotOptimize(entry);
+        Entry::release(entry);
+    }
+}
+BENCHMARK(BM_GetPathEntry)->Arg(1)->Arg(4)->Arg(8)->Arg(16);
+
+// 取出文件的全部块号
+static void BM_GetBlocks(benchmark::State& state, const char* file) {
+    image();
+    AutoEntry entry(fs.get_path_entry(file).second);
+    Inode* inode = Filesystem::get_inode(entry.elem()->inode_id);
+    for (auto _: state) {
+        benchmark::DoNotOptimize(get_blocks(inode));
+    }
+    state.counters["blocks"] = get_blocks(inode).size();
+}
+BENCHMARK_CAPTURE(BM_GetBlocks, direct, "/root/direct");
+BENCHMARK_CAPTURE(BM_GetBlocks, indirect, "/root/indirect");
+BENCHMARK_CAPTURE(BM_GetBlocks, double_indirect, "/root/double");
+
+// 覆盖写入 range(0) 字节
+static void BM_WriteData(benchmark::State& state) {
+    image();
+    AutoEntry parent(fs.get_path_entry("/root").second);
+    std::string contents(state.range(0), 'x');
+    for (auto _: state) {
+        ErrorCode err = fs.write_data(parent.elem(), "data", contents);
+        if (err != ErrorCode::SUCCESS) {
+            state.SkipWithError("write_data failed");
+            break;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_WriteData)->RangeMultiplier(8)->Range(1 << 10, 64 << 20)->Unit(benchmark::kMicrosecond);
+
+// 读出 range(0) 字节的文件
+static void BM_CatLog(benchmark::State& state) {
+    image();
+    AutoEntry parent(fs.get_path_entry("/root").second);
+    fs.write_data(parent.elem(), "data", std::string(state.range(0), 'x'));
+    AutoEntry entry(fs.get_path_entry("/root/data").second);
+    for (auto _: state) {
+        benchmark::DoNotOptimize(fs.cat_log(entry.elem()));
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CatLog)->RangeMultiplier(8)->Range(1 << 10, 64 << 20)->Unit(benchmark::kMicrosecond);
+
+// 列出含 range(0) 个文件的目录
+static void BM_ListDirectory(benchmark::State& state) {
+    image();
+    std::string dir = "/root/list" + std::to_string(state.range(0));
+    fs.md(dir);
+    for (int64_t i = 0; i < state.range(0); ++i) fs.newfile(dir + "/f" + std::to_string(i));
+    fs.response.str("");
+    AutoEntry entry(fs.get_path_entry(dir).second);
+    std::vector<std::string> names;
+    for (auto _: state) {
+        names.clear();
+        fs.list_directory(entry.elem(), names);
+        benchmark::DoNotOptimize(names.data());
+    }
+}
+BENCHMARK(BM_ListDirectory)->Arg(1)->Arg(10)->Arg(30);
+
+/**
+ * @brief 入口
+ *
+ * 默认把结果以 JSON 写入 simdisk-bench.json，命令行中给出 --benchmark_out 时以其为准。
+ */
+int main(int argc, char** argv) {
+    std::vector<char*> args(argv, argv + argc);
+    bool has_out = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]).starts_with("--benchmark_out=")) has_out = true;
+    }
+    std::string out = "--benchmark_out=simdisk-bench.json";
+    std::string format = "--benchmark_out_format=json";
+    if (!has_out) {
+        args.push_back(out.data());
+        args.push_back(format.data());
+    }
+    int count = (int)args.size();
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data())) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
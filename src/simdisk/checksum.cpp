@@ -0,0 +1,106 @@
+//
+// Created by eric on 12/02/23.
+//
+#include "filesystem.h"
+#include "checksum.h"
+
+// 每个表块保存的校验和个数，随块大小变化
+#define CHECKSUMS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+
+// 初始化新磁盘的校验和表
+void ChecksumTable::format(uint32_t _start, uint32_t _size, bool _data) {
+    start = _start;
+    size = _size;
+    data = _data;
+    table.assign((size_t)size * CHECKSUMS_PER_BLOCK, 0);
+    dirty.clear();
+    for (uint32_t i = 0; i < size; ++i) {
+        Disk::write_raw(start + i, &table[(size_t)i * CHECKSUMS_PER_BLOCK]);
+    }
+}
+
+// 载入校验和表，载入之前读出的块不校验
+void ChecksumTable::load(uint32_t _start, uint32_t _size, bool _data) {
+    table.assign((size_t)_size * CHECKSUMS_PER_BLOCK, 0);
+    for (uint32_t i = 0; i < _size; ++i) {
+        pread(Disk::fd, &table[(size_t)i * CHECKSUMS_PER_BLOCK], BLOCK_SIZE, (off_t)(_start + i) * BLOCK_SIZE);
+    }
+    start = _start;
+    size = _size;
+    data = _data;
+    dirty.clear();
+}
+
+/**
+ * @brief 块写回原位置时更新其校验和
+ *
+ * 不计算校验和的数据块把表项清零，避免该块以前作为元数据时的校验和造成误报。
+ *
+ * @param block_num 块号
+ * @param block     块的内容
+ * @param is_data   是否为文件数据块
+ */
+void ChecksumTable::update(uint32_t block_num, const void* block, bool is_data) {
+    if (!enabled() || !covers(block_num)) return;
+    deferred.erase(block_num);
+    uint32_t checksum = (is_data && !data) ? 0 : crc32c(0, block, BLOCK_SIZE);
+    if (table[block_num] == checksum) return;
+    table[block_num] = checksum;
+    dirty.insert(block_num / CHECKSUMS_PER_BLOCK);
+}
+
+/**
+ * @brief 事务中数据块写回原位置之前清除其校验和
+ *
+ * ordered 模式下数据块先于提交写回原位置，而表块在事务结束后才写回，期间崩溃会让旧的校验和
+ * 对应新的内容。因此先把表项清零并立即写回所在的表块（0 表示不校验），再由调用者写入数据；
+ * 新的校验和在数据落盘后由 settle 记录。
+ *
+ * @param block_num 块号
+ * @param block     块的内容
+ */
+void ChecksumTable::defer(uint32_t block_num, const void* block) {
+    if (!enabled() || !covers(block_num)) return;
+    if (data) {
+        deferred[block_num] = crc32c(0, block, BLOCK_SIZE);
+    } else {
+        deferred.erase(block_num);
+    }
+    if (table[block_num] == 0) return;
+    table[block_num] = 0;
+    uint32_t i = block_num / CHECKSUMS_PER_BLOCK;
+    Disk::write_raw(start + i, &table[(size_t)i * CHECKSUMS_PER_BLOCK]);
+}
+
+// 记录已落盘的数据块的校验和，表块随下一次 flush 写回
+void ChecksumTable::settle() {
+    for (auto [block_num, checksum]: deferred) {
+        table[block_num] = checksum;
+        dirty.insert(block_num / CHECKSUMS_PER_BLOCK);
+    }
+    deferred.clear();
+}
+
+// 块的内容与校验和是否一致
+bool ChecksumTable::matches(uint32_t block_num, const void* block) {
+    if (!enabled() || !covers(block_num) || table[block_num] == 0) return true;
+    return crc32c(0, block, BLOCK_SIZE) == table[block_num];
+}
+
+// 校验从原位置读出的块
+bool ChecksumTable::verify(uint32_t block_num, const void* block) {
+    if (!enabled() || !covers(block_num) || table[block_num] == 0) return true;
+    ++verified;
+    if (matches(block_num, block)) return true;
+    ++mismatches;
+    printf("Simdisk: checksum mismatch in block %u\n", block_num);
+    return false;
+}
+
+// 写回修改过的表块
+void ChecksumTable::flush() {
+    for (uint32_t i: dirty) {
+        Disk::write_raw(start + i, &table[(size_t)i * CHECKSUMS_PER_BLOCK]);
+    }
+    dirty.clear();
+}
@@ -5,6 +5,14 @@
 #include "filesystem.h"
 #include <fstream>
 #include <cstring>
+#include <algorithm>
+#include <sys/file.h>
+// 是否载入已有的磁盘镜像（否则格式化新镜像）
+bool state = false;
+// 初始化日志信息
+Entry* user_log = nullptr;
+//Entry* system_log = nullptr;
+//Entry* lock_log = nullptr;
 // 设置 Inode 的数据块信息，根据需要的块数和分配的块列表
 void set_blocks(Inode* inode, const std::vector<uint32_t>& blocks, uint32_t needed_blocks_num) {
     using AutoBlock = Filesystem::AutoBlock;
@@ -25,7 +33,7 @@ void set_blocks(Inode* inode, const std::vector<uint32_t>& blocks, uint32_t need
         // 创建一级间接块
         AutoBlock block;
         inode->i_block[6] = block.id();
-        memset(block.elem()->pointers, null, sizeof(block.elem()->pointers));
+        memset(block.elem()->pointers, null, POINTERS_PER_BLOCK * sizeof(uint32_t));
 
         // 填充一级间接块
         for (uint32_t i = 6; i < needed_blocks_num; ++i) {
@@ -42,7 +50,7 @@ void set_blocks(Inode* inode, const std::vector<uint32_t>& blocks, uint32_t need
         // 创建一级间接块
         AutoBlock block;
         inode->i_block[6] = block.id();
-        memset(block.elem()->pointers, null, sizeof(block.elem()->pointers));
+        memset(block.elem()->pointers, null, POINTERS_PER_BLOCK * sizeof(uint32_t));
 
         // 填充一级间接块
         for (uint32_t i = 6; i < 6 + POINTERS_PER_BLOCK; ++i) {
@@ -52,7 +60,7 @@ void set_blocks(Inode* inode, const std::vector<uint32_t>& blocks, uint32_t need
         // 创建二级间接块
         AutoBlock indirect_block;
         inode->i_block[7] = indirect_block.id();
-        memset(indirect_block.elem()->pointers, null, sizeof(indirect_block.elem()->pointers));
+        memset(indirect_block.elem()->pointers, null, POINTERS_PER_BLOCK * sizeof(uint32_t));
 
         uint32_t cnt = needed_blocks_num - 6 - POINTERS_PER_BLOCK;
         bool flag = false;
@@ -61,7 +69,7 @@ void set_blocks(Inode* inode, const std::vector<uint32_t>& blocks, uint32_t need
         for (uint32_t i = 0; i < POINTERS_PER_BLOCK; ++i) {
             if (flag) break;
             AutoBlock block;
-            memset(block.elem()->pointers, null, sizeof(block.elem()->pointers));
+            memset(block.elem()->pointers, null, POINTERS_PER_BLOCK * sizeof(uint32_t));
             indirect_block.elem()->pointers[i] = block.id();
 
             // 填充块
@@ -86,7 +94,7 @@ void set_blocks(Inode* inode, const std::vector<uint32_t>& blocks, uint32_t need
         // 创建一级间接块
         AutoBlock block;
         inode->i_block[6] = block.id();
-        memset(block.elem()->pointers, null, sizeof(block.elem()->pointers));
+        memset(block.elem()->pointers, null, POINTERS_PER_BLOCK * sizeof(uint32_t));
 
         // 填充一级间接块
         for (uint32_t i = 6; i < 6 + POINTERS_PER_BLOCK; ++i) {
@@ -96,7 +104,7 @@ void set_blocks(Inode* inode, const std::vector<uint32_t>& blocks, uint32_t need
         // 创建二级间接块
         AutoBlock indirect_block;
         inode->i_block[7] = indirect_block.id();
-        memset(indirect_block.elem()->pointers, null, sizeof(indirect_block.elem()->pointers));
+        memset(indirect_block.elem()->pointers, null, POINTERS_PER_BLOCK * sizeof(uint32_t));
 
         uint32_t cnt = needed_blocks_num - 6 - POINTERS_PER_BLOCK;
         bool flag = false;
@@ -105,7 +113,7 @@ void set_blocks(Inode* inode, const std::vector<uint32_t>& blocks, uint32_t need
         for (uint32_t i = 0; i < POINTERS_PER_BLOCK; ++i) {
             if (flag) break;
             AutoBlock block;
-            memset(block.elem()->pointers, null, sizeof(block.elem()->pointers));
+            memset(block.elem()->pointers, null, POINTERS_PER_BLOCK * sizeof(uint32_t));
             indirect_block.elem()->pointers[i] = block.id();
 
             // 填充块
@@ -181,23 +189,36 @@ std::vector<uint32_t> get_blocks(Inode* inode) {
 }
 // 创建一个新的数据块
 std::pair<uint32_t, Block*> Filesystem::new_block() {
-    // 从块位图中获取一个新的块索引
-    uint32_t i = blocks_bitmap->_new();
+    // 从目标块组开始依次查找空闲块，使文件的数据块靠近它的 inode
+    uint32_t i = null;
+    uint32_t groups = blocks_bitmap->groups();
+    for (uint32_t k = 0; k < groups && i == null; ++k) {
+        i = blocks_bitmap->_new((goal_group + k) % groups);
+    }
+    // 没有空闲块时先回收 rd 留下的目录树，再查找一遍
+    if (i == null && Reclaimer::reclaim()) {
+        for (uint32_t k = 0; k < groups && i == null; ++k) {
+            i = blocks_bitmap->_new((goal_group + k) % groups);
+        }
+    }
 
-    // 保存块位图的状态
-    blocks_bitmap->save();
+    // 保存块位图中该位所在的块
+    blocks_bitmap->save(i);
 
     // 如果块索引为空，返回空指针
     if (i == null) {
         return {null, nullptr};
     } else {
+        // 新分配的块不属于任何快照，覆盖时不需要复制
+        NamedSnapshot::born(i);
+        Journal::allocate(i);
         // 否则，返回块索引和相应的块指针
         return {i, Disk::read_block(i)};
     }
 }
 
 // 获取指定索引的数据块
-inline Block* Filesystem::get_block(uint32_t i) {
+Block* Filesystem::get_block(uint32_t i) {
     // 如果索引为空，返回空指针
     if (i == null) {
         return nullptr;
@@ -214,11 +235,21 @@ void Filesystem::delete_block(uint32_t i) {
         return;
     }
 
+    // 块被重新分配后不会再复制，释放前先为快照保存其内容
+    NamedSnapshot::preserve(i);
+
     // 从块位图中删除指定索引的块
     blocks_bitmap->_delete(i);
 
-    // 保存块位图的状态
-    blocks_bitmap->save();
+    // 保存块位图中该位所在的块
+    blocks_bitmap->save(i);
+
+    // 该块在事务提交（持久化模式下为同步）前不能被当作数据块直接覆盖，打洞也等到那之后
+    if (Journal::active()) {
+        Journal::release(i);
+    } else {
+        Disk::punch({i});
+    }
 }
 
 // 保存数据块到指定索引
@@ -234,15 +265,103 @@ void Filesystem::release_block(Block* block) {
 }
 
 
-void Filesystem::_new(std::string name) {
+/**
+ * @brief 按格式化参数计算几何参数和各区域的位置
+ *
+ * 依次为超级块、块位图、inode 位图、inode 表、日志区、校验和表和数据区。
+ * 块位图和校验和表按扩容上限预留，扩容时只需扩大镜像文件，其余区域的位置不变。
+ *
+ * @param disk_size 镜像大小，单位为字节
+ * @param ratio 每个 inode 对应的字节数
+ * @param max_size 扩容上限，单位为字节，0 表示镜像大小的 4 倍
+ * @return bool 数据区至少还有 64 个块时返回 true
+ */
+bool Superblock::layout(uint64_t disk_size, uint32_t size, uint32_t ratio, uint64_t max_size) {
+    BlockSize::bytes = block_size = size;
+    if (max_size == 0) max_size = std::min(disk_size * 4, Geometry::MAX_SIZE);
+    blocks_num = disk_size / BLOCK_SIZE / 8 * 8;
+    max_blocks_num = std::max<uint64_t>(max_size / BLOCK_SIZE / 8 * 8, blocks_num);
+    inode_ratio = ratio;
+    inodes_num = std::max<uint64_t>(disk_size / ratio / INODES_PER_BLOCK, 1) * INODES_PER_BLOCK;
+    blocks_bitmap_num = max_blocks_num / 8 / BLOCK_SIZE + 1;
+    inodes_bitmap_num = inodes_num / 8 / BLOCK_SIZE + 1;
+    inodes_table_block = inodes_num / INODES_PER_BLOCK;
+    blocks_bitmap_start = 1;
+    inodes_bitmap_start = blocks_bitmap_start + blocks_bitmap_num;
+    inodes_table_start = inodes_bitmap_start + inodes_bitmap_num;
+    // 日志区按镜像大小缩放，小镜像不必预留整整 1 MiB
+    journal_magic = JOURNAL_MAGIC;
+    journal_start = inodes_table_start + inodes_table_block;
+    journal_blocks = std::clamp<uint32_t>(blocks_num / 16, 64, JOURNAL_BLOCKS);
+    // 校验和表每个块占 4 字节
+    checksum_magic = CHECKSUM_MAGIC;
+    checksum_start = journal_start + journal_blocks;
+    checksum_blocks = ((uint64_t)max_blocks_num * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    data_start = checksum_start + checksum_blocks;
+    split_groups();
+    return (uint64_t)data_start + 64 <= blocks_num;
+}
+
+// 一个位图块描述一个块组，inode 按格式化时的块组数均分，每组的 inode 占整数个 inode 表块
+void Superblock::split_groups() {
+    group_blocks = 8 * BLOCK_SIZE;
+    uint32_t groups = (blocks_num + group_blocks - 1) / group_blocks;
+    uint32_t per_group = groups * INODES_PER_BLOCK;
+    group_inodes = (inodes_num + per_group - 1) / per_group * INODES_PER_BLOCK;
+}
+
+// 旧版磁盘没有记录各区域的位置，按原来的布局补齐，这类磁盘不能扩容
+void Superblock::derive() {
+    if (group_blocks == 0) split_groups();
+    if (blocks_bitmap_start != 0) return;
+    max_blocks_num = blocks_num;
+    inode_ratio = (uint64_t)blocks_num * block_size / inodes_num;
+    blocks_bitmap_start = 1;
+    inodes_bitmap_start = blocks_bitmap_start + blocks_bitmap_num;
+    inodes_table_start = inodes_bitmap_start + inodes_bitmap_num;
+    data_start = inodes_table_start + inodes_table_block;
+    if (journal_magic == JOURNAL_MAGIC) data_start += journal_blocks;
+    if (checksum_magic == CHECKSUM_MAGIC) data_start += checksum_blocks;
+}
+
+// 解析带单位（K/M/G，默认为 M）的大小
+bool parse_size(const std::string& text, uint64_t& bytes) {
+    size_t digits = 0;
+    while (digits < text.size() && isdigit(text[digits])) ++digits;
+    if (digits == 0 || digits > 9 || text.size() > digits + 1) return false;
+    uint64_t unit = 1 << 20;
+    if (text.size() == digits + 1) {
+        switch (toupper(text[digits])) {
+            case 'K': unit = 1 << 10; break;
+            case 'M': unit = 1 << 20; break;
+            case 'G': unit = 1 << 30; break;
+            default: return false;
+        }
+    }
+    bytes = std::stoull(text.substr(0, digits)) * unit;
+    return true;
+}
+
+ErrorCode Filesystem::_new(std::string name) {
     Disk::disk_name = std::move(name);
-    Disk::new_disk();
+    // 几何参数在格式化时确定，各区域的位置都记录在超级块中
+    Superblock superblock;
+    superblock.layout(Geometry::size, Geometry::block_size, Geometry::inode_ratio, Geometry::max_size);
+    ErrorCode err = Disk::new_disk((uint64_t)superblock.blocks_num * BLOCK_SIZE);
+    if (err != ErrorCode::SUCCESS) return err;
+    Snapshot::format(superblock.blocks_num);
+    NamedSnapshot::format(superblock.blocks_num);
     super = Disk::read_block(0);
-    super->superblock = Superblock();
-    blocks_bitmap = new Bitmap(super->superblock.blocks_num, 1);
-    inodes_bitmap = new Bitmap(super->superblock.inodes_num, 1 + super->superblock.blocks_bitmap_num);
-    inodes_table = new InodesTable(super->superblock.inodes_table_block, 1 + super->superblock.blocks_bitmap_num + super->superblock.inodes_bitmap_num);
-    uint32_t offset = 1 + super->superblock.blocks_bitmap_num + super->superblock.inodes_bitmap_num + super->superblock.inodes_table_block;
+    super->superblock = superblock;
+    blocks_bitmap = new Bitmap(super->superblock.blocks_num, super->superblock.blocks_bitmap_start);
+    inodes_bitmap = new Bitmap(super->superblock.inodes_num, super->superblock.inodes_bitmap_start);
+    inodes_table = new InodesTable(super->superblock.inodes_table_block, super->superblock.inodes_table_start);
+    blocks_bitmap->group(super->superblock.group_blocks);
+    inodes_bitmap->group(super->superblock.group_inodes);
+    Journal::format(super->superblock.journal_start, super->superblock.journal_blocks);
+    super->superblock.checksum_flags = ChecksumTable::data ? CHECKSUM_DATA : 0;
+    ChecksumTable::format(super->superblock.checksum_start, super->superblock.checksum_blocks, ChecksumTable::data);
+    uint32_t offset = super->superblock.data_start;
     for (uint32_t i = 0; i < offset; ++i) {
         blocks_bitmap->set(i);
     }
@@ -250,12 +369,12 @@ void Filesystem::_new(std::string name) {
     auto [root_block_id, root_block] = new_block();
     super->superblock.root_block_id = root_block_id;
     root = root_block;
-    for (auto& entry: root->entries) {
+    for (auto& entry: root->all_entries()) {
         entry.is_valid = false;
     }
 
     // 根目录 i结点
-    auto [root_inode_id, root_inode] = new_inode();
+    auto [root_inode_id, root_inode] = new_inode(null, true);
     super->superblock.root_inode_id = root_inode_id;
     root->entries[0].is_valid = true;
     root->entries[0].inode_id = root_inode_id;
@@ -263,19 +382,20 @@ void Filesystem::_new(std::string name) {
 
     // 新建block，用于给根目录存放内容
     auto [block_id, block] = new_block();
-    for (auto& entry : block->entries) {
+    for (auto& entry : block->all_entries()) {
         entry.is_valid = false;
     }
     // 根目录的内容
     root_inode->is_valid = true;
     root_inode->link_cnt = 3;
     root_inode->size = sizeof(Entry) * 2;
-    root_inode->capacity = 1024;
+    root_inode->capacity = BLOCK_SIZE;
     root_inode->mode = to_mode("rwxr-xr-x");
     root_inode->type = 'd';
     strcpy(root_inode->owner, "root");
     memset(root_inode->i_block, -1, sizeof(root_inode->i_block));
     root_inode->i_block[0] = block_id;
+    root_inode->set_usage(0, 1);
 
     // 创建 . 文件夹
     block->entries[0].is_valid = true;
@@ -312,7 +432,7 @@ void Filesystem::_new(std::string name) {
     user_log = get_path_entry("/usr/user.log").second;
 //    system_log = get_path_entry("/usr/system.log").second;
 //    lock_log = get_path_entry("/usr/lock/lock.log").second;
-    write_log(user_log, "username    password");
+    write_log(user_log, "username    password", "/usr");
     useradd("root", "root");
     auto only_root_read = [&](const std::string& path) {
         chmod("g-r", path);
@@ -324,33 +444,53 @@ void Filesystem::_new(std::string name) {
 //    only_root_read("/usr/user.log");
 //    only_root_read("/usr/system.log");
     chmod("a-w", "/");
-    system(("zip backup.zip " + Disk::disk_name).c_str());
-//    std::cout << "zip backup.zip " + Disk::disk_name << std::endl;
-    copy_host("backup.zip", "/lost+found/backup.img");
-//    Block* beforeblock = Disk::read_block(6438);
-//    std::string content;
-//    for (uint32_t i = 0; i < BLOCK_SIZE; ++i) {
-//        content.push_back(*((char*)((void*)beforeblock) + i));
-//    }
-//    std::ofstream test("before.zip", std::ios::binary);
-//    test << content;
-//    test.close();
-//    delete beforeblock;
-    system("rm backup.zip");
+    return ErrorCode::SUCCESS;
 }
 
 // 加载文件系统
-void Filesystem::load(std::string name) {
+ErrorCode Filesystem::load(std::string name) {
     // 设置磁盘文件名
     Disk::disk_name = std::move(name);
+    ErrorCode err = Disk::load_disk();
+    if (err != ErrorCode::SUCCESS) return err;
 
-    // 读取超级块
+    // 读取超级块：超级块总在前 1 KiB 中，先取出其中记录的块大小，再按块大小读取整块
+    Superblock probe;
+    if (pread(Disk::fd, &probe, sizeof(probe), 0) != sizeof(probe) || !BlockSize::valid(probe.block_size)) {
+        probe.block_size = MIN_BLOCK_SIZE;
+    }
+    BlockSize::bytes = probe.block_size;
     super = Disk::read_block(0);
 
+    // 载入校验和表，之后读出的块都会被校验；重放日志时会同时更新校验和
+    if (super->superblock.checksum_magic == CHECKSUM_MAGIC) {
+        ChecksumTable::load(super->superblock.checksum_start, super->superblock.checksum_blocks,
+                            super->superblock.checksum_flags & CHECKSUM_DATA);
+        ChecksumTable::verify(0, super);
+    }
+    super->superblock.derive();
+
+    // 重放日志之前开始跟踪变更
+    Snapshot::load(super->superblock.blocks_num);
+    NamedSnapshot::load(super->superblock.blocks_num);
+    if (!NamedSnapshot::chain.empty()) {
+        printf("Simdisk: %zu named snapshot(s) loaded\n", NamedSnapshot::chain.size());
+    }
+
+    // 重放日志中已提交但可能未写回的事务，必须在读取位图和 inode 表之前完成
+    if (super->superblock.journal_magic == JOURNAL_MAGIC) {
+        uint32_t n = Journal::recover(super->superblock.journal_start, super->superblock.journal_blocks);
+        printf("Simdisk: journal replayed %u transaction(s)\n", n);
+    } else {
+        printf("Simdisk: disk has no journal, metadata is written in place\n");
+    }
+
     // 初始化位图和InodesTable
-    blocks_bitmap = new Bitmap(super->superblock.blocks_num, 1);
-    inodes_bitmap = new Bitmap(super->superblock.inodes_num, 1 + super->superblock.blocks_bitmap_num);
-    inodes_table = new InodesTable(super->superblock.inodes_table_block, 1 + super->superblock.blocks_bitmap_num + super->superblock.inodes_bitmap_num);
+    blocks_bitmap = new Bitmap(super->superblock.blocks_num, super->superblock.blocks_bitmap_start);
+    inodes_bitmap = new Bitmap(super->superblock.inodes_num, super->superblock.inodes_bitmap_start);
+    inodes_table = new InodesTable(super->superblock.inodes_table_block, super->superblock.inodes_table_start);
+    blocks_bitmap->group(super->superblock.group_blocks);
+    inodes_bitmap->group(super->superblock.group_inodes);
 
     // 读取根目录块
     root = Disk::read_block(super->superblock.root_block_id);
@@ -366,6 +506,22 @@ void Filesystem::load(std::string name) {
 
     // 获取系统日志、用户日志、锁日志的Entry
     user_log = get_path_entry("/usr/user.log").second;
+
+    // 旧版磁盘的目录没有缓存子树用量，统计一次后写回
+    if (!get_inode(super->superblock.root_inode_id)->has_usage()) {
+        uint32_t n = 0;
+        if (Journal::transact([&] { n = rebuild_usage(true); return ErrorCode::SUCCESS; }) == ErrorCode::SUCCESS) {
+            printf("Simdisk: usage totals rebuilt for %u directories\n", n);
+        } else {
+            printf("Simdisk: usage totals of %u directories do not fit in the journal and were not rebuilt\n", n);
+        }
+    }
+
+    // 上次退出时尚未回收完的目录树，由回收线程继续释放
+    Reclaimer::load();
+    if (Reclaimer::pending > 0) {
+        printf("Simdisk: %u deleted directory tree(s) pending reclamation\n", Reclaimer::pending.load());
+    }
 //    system_log = get_path_entry("/usr/system.log").second;
 //    lock_log = get_path_entry("/usr/lock/lock.log").second;
 
@@ -411,6 +567,37 @@ void Filesystem::load(std::string name) {
 //
 //    // 将重启信息写入系统日志
 //    write_log(system_log, log_data.empty() ? "" : log_data.back() + "\n" + ss.str());
+    return ErrorCode::SUCCESS;
+}
+
+/**
+ * @brief 从磁盘重新读取内存中的元数据
+ *
+ * 事务被放弃后调用，此时磁盘（包括持久化模式下等待写回的块）保持上一个事务提交后的状态。
+ * 位图按超级块中的大小重建，因此放弃的扩容也一并撤销。
+ */
+void Filesystem::reload() {
+    Block* block = Disk::read_block(0);
+    memcpy(super, block, BLOCK_SIZE);
+    delete block;
+    super->superblock.derive();
+
+    bool loaded = state;
+    state = true;
+    delete blocks_bitmap;
+    delete inodes_bitmap;
+    blocks_bitmap = new Bitmap(super->superblock.blocks_num, super->superblock.blocks_bitmap_start);
+    inodes_bitmap = new Bitmap(super->superblock.inodes_num, super->superblock.inodes_bitmap_start);
+    blocks_bitmap->group(super->superblock.group_blocks);
+    inodes_bitmap->group(super->superblock.group_inodes);
+    state = loaded;
+    delete inodes_table;
+    inodes_table = new InodesTable(super->superblock.inodes_table_block, super->superblock.inodes_table_start);
+
+    block = Disk::read_block(super->superblock.root_block_id);
+    memcpy(root, block, BLOCK_SIZE);
+    delete block;
+    Reclaimer::load();
 }
 
 // 释放文件系统相关资源
@@ -425,11 +612,55 @@ void Filesystem::release() {
 //    delete lock_log;
 }
 
-// 创建一个新的inode，返回inode的索引和指针
-std::pair<uint32_t, Inode *> Filesystem::new_inode() {
-    uint32_t i = inodes_bitmap->_new();
-    inodes_bitmap->save();
+/**
+ * @brief 为新目录选择块组
+ *
+ * 从上一个目录所在块组的下一个开始轮流查找，选择空闲 inode 和空闲块都不低于平均值的块组，
+ * 使目录分散到各个块组，而目录中的文件留在目录所在的块组。找不到时留在父目录的块组。
+ *
+ * @param parent_group 父目录所在的块组
+ * @return uint32_t 块组号
+ */
+uint32_t Filesystem::find_dir_group(uint32_t parent_group) {
+    uint32_t groups = inodes_bitmap->groups();
+    uint32_t avg_inodes = (super->superblock.inodes_num - inodes_bitmap->counter) / groups;
+    uint32_t avg_blocks = (super->superblock.blocks_num - blocks_bitmap->counter) / blocks_bitmap->groups();
+    for (uint32_t k = 1; k <= groups; ++k) {
+        uint32_t g = (last_dir_group + k) % groups;
+        uint32_t free_inodes = inodes_bitmap->group_capacity(g) - inodes_bitmap->group_used[g];
+        uint32_t free_blocks = g < blocks_bitmap->groups() ? blocks_bitmap->group_capacity(g) - blocks_bitmap->group_used[g] : 0;
+        if (free_inodes > 0 && free_inodes >= avg_inodes && free_blocks >= avg_blocks) {
+            return last_dir_group = g;
+        }
+    }
+    return parent_group;
+}
+
+/**
+ * @brief 创建一个新的inode，返回inode的索引和指针
+ *
+ * 文件的 inode 放在父目录所在的块组，新目录由 find_dir_group 选择块组，
+ * 所在块组已满时依次使用后面的块组。之后分配的数据块优先放在 inode 所在的块组。
+ *
+ * @param parent_id 父目录的 inode 编号，null 表示根目录
+ * @param directory 是否为目录
+ */
+std::pair<uint32_t, Inode *> Filesystem::new_inode(uint32_t parent_id, bool directory) {
+    uint32_t groups = inodes_bitmap->groups();
+    uint32_t group = parent_id == null ? 0 : inode_group(parent_id) % groups;
+    if (directory && parent_id != null) group = find_dir_group(group);
+    uint32_t i = null;
+    for (uint32_t k = 0; k < groups && i == null; ++k) {
+        i = inodes_bitmap->_new((group + k) % groups);
+    }
+    if (i == null && Reclaimer::reclaim()) {
+        for (uint32_t k = 0; k < groups && i == null; ++k) {
+            i = inodes_bitmap->_new((group + k) % groups);
+        }
+    }
+    inodes_bitmap->save(i);
     if (i == null) return {null, nullptr};
+    goal_group = inode_group(i);
     uint32_t inodeIndex = i / INODES_PER_BLOCK;
     uint32_t inodeOffset = i % INODES_PER_BLOCK;
     return {i, &inodes_table->inodes_table[inodeIndex]->inodes[inodeOffset]};
@@ -464,7 +695,7 @@ ErrorCode Filesystem::dir(const std::string &path, bool with_args, const char *u
         return ErrorCode::FAILURE;
     }
     AutoBlock block(0, inode);
-    for (const auto& file: block.elem()->entries) {
+    for (const auto& file: block.elem()->all_entries()) {
         if (with_args) {
             // 带参数模式下，只打印目录（排除"."和".."）的名称
             if (file.is_valid && get_inode(file.inode_id)->type == 'd') {
@@ -503,17 +734,17 @@ ErrorCode Filesystem::new_directory(Entry *parent, const char *name, const char
     if (block == nullptr) return ErrorCode::FAILURE;
 
     // 检查是否已存在同名的目录
-    for (auto& entry: block.elem()->entries) {
+    for (auto& entry: block.elem()->all_entries()) {
         if (entry.is_valid && strcmp(entry.name, name) == 0) {
             return ErrorCode::EXISTS;
         }
     }
 
     // 新建子目录的Inode
-    auto [child_inode_id, child_inode] = new_inode();
+    auto [child_inode_id, child_inode] = new_inode(parent->inode_id, true);
 
     // 在父目录中添加新目录的Entry
-    for (auto& entry: block.elem()->entries) {
+    for (auto& entry: block.elem()->all_entries()) {
         if (!entry.is_valid) {
             entry.is_valid = true;
             entry.inode_id = child_inode_id;
@@ -525,7 +756,7 @@ ErrorCode Filesystem::new_directory(Entry *parent, const char *name, const char
     }
 
     // 设置子目录的Inode信息
-    child_inode->set_data(true, 2, sizeof(Entry) * 2, 1024, to_mode("rwxr-xr-x"), 'd', user);
+    child_inode->set_data(true, 2, sizeof(Entry) * 2, BLOCK_SIZE, to_mode("rwxr-xr-x"), 'd', user);
     memset(child_inode->i_block, -1, sizeof(child_inode->i_block));
 
     // 获取子目录的数据块
@@ -533,10 +764,13 @@ ErrorCode Filesystem::new_directory(Entry *parent, const char *name, const char
     child_inode->i_block[0] = child_block.id();
 
     // 初始化子目录的数据块中的Entries
-    for (auto& entry : child_block.elem()->entries) {
+    for (auto& entry : child_block.elem()->all_entries()) {
         entry.is_valid = false;
     }
 
+    // 新目录的子树只有它自己的数据块
+    child_inode->set_usage(0, 1);
+
     // 设置子目录的特殊Entries（. 和 ..）
     child_block.elem()->entries[0].is_valid = true;
     child_block.elem()->entries[0].inode_id = child_inode_id;
@@ -548,6 +782,7 @@ ErrorCode Filesystem::new_directory(Entry *parent, const char *name, const char
     // 保存父目录和子目录的Inode信息
     save_inode(parent->inode_id);
     save_inode(child_inode_id);
+    account(parent->inode_id, 0, 1);
 
     return ErrorCode::SUCCESS;
 }
@@ -566,7 +801,7 @@ ErrorCode Filesystem::delete_file(Entry *parent, const char *name, const char *u
     if (block == nullptr) return ErrorCode::FAILURE;
 
     // 遍历父目录的Entries
-    for (auto& entry: block.elem()->entries) {
+    for (auto& entry: block.elem()->all_entries()) {
         if (entry.is_valid && strcmp(entry.name, name) == 0) {
             // 获取待删除文件的Inode
             Inode* inode = get_inode(entry.inode_id);
@@ -595,6 +830,7 @@ ErrorCode Filesystem::delete_file(Entry *parent, const char *name, const char *u
             // 保存父目录的Inode和数据块
             save_inode(parent->inode_id);
             block.save();
+            account(parent->inode_id, -(int64_t)inode->size, -(int64_t)(inode->capacity / super->superblock.block_size));
 
             return ErrorCode::SUCCESS;
         }
@@ -618,7 +854,7 @@ ErrorCode Filesystem::chmod_file(Entry *parent, const char *name, const std::str
     if (block == nullptr) return ErrorCode::FAILURE;
 
     // 遍历父目录的Entries
-    for (auto& entry: block.elem()->entries) {
+    for (auto& entry: block.elem()->all_entries()) {
         if (entry.is_valid && strcmp(entry.name, name) == 0) {
             Inode* inode = get_inode(entry.inode_id);
             mode_t& mode = inode->mode;
@@ -712,11 +948,13 @@ ErrorCode Filesystem::chmod_file(Entry *parent, const char *name, const std::str
     }
     return ErrorCode::FILE_NOT_FOUND;
 }
-ErrorCode Filesystem::write_log(Entry* log, const std::string& contents) {
+ErrorCode Filesystem::write_log(Entry* log, const std::string& contents, const char* directory) {
     Inode* inode = get_inode(log->inode_id);
     if (inode->type == 'd') {
         return ErrorCode::FILE_NOT_MATCH;
     }
+    uint32_t old_size = inode->size, old_capacity = inode->capacity;
+    goal_group = inode_group(log->inode_id);
     std::vector<uint32_t> blocks = get_blocks(inode);
     uint32_t needed_blocks_num = (contents.size() + super->superblock.block_size - 1) / super->superblock.block_size;
     if (needed_blocks_num == 0) needed_blocks_num = 1;
@@ -729,11 +967,12 @@ ErrorCode Filesystem::write_log(Entry* log, const std::string& contents) {
         blocks.resize(needed_blocks_num);
         for (uint32_t i = blocks_num; i < needed_blocks_num; ++i) {
             AutoBlock data_block;
+            data_block.mask(DATA_MODE);
             blocks[i] = data_block.id();
         }
     }
     for (uint32_t i = 0; i < needed_blocks_num; ++i) {
-        AutoBlock data_block(blocks[i], GET | WRITE_MODE);
+        AutoBlock data_block(blocks[i], GET | WRITE_MODE | DATA_MODE);
         size_t length = std::min((uint32_t)contents.size(), (i + 1) * super->superblock.block_size) - i * super->superblock.block_size;
 //        strcpy(data_block.elem()->data, contents.substr(i * super->superblock.block_size, length).c_str());
         memcpy(data_block.elem()->data, contents.substr(i * super->superblock.block_size, length).c_str(), length);
@@ -752,6 +991,14 @@ ErrorCode Filesystem::write_log(Entry* log, const std::string& contents) {
     inode->size = contents.size();
     inode->capacity = needed_blocks_num * super->superblock.block_size;
     save_inode(log->inode_id);
+    // 日志的大小很少变化，变化时才查找所在目录
+    if (inode->size != old_size || inode->capacity != old_capacity) {
+        AutoEntry parent(get_path_entry(directory).second);
+        if (parent != nullptr) {
+            account(parent.elem()->inode_id, (int64_t)inode->size - old_size,
+                    ((int64_t)inode->capacity - old_capacity) / super->superblock.block_size);
+        }
+    }
     return ErrorCode::SUCCESS;
 }
 ErrorCode Filesystem::write_file(Entry *parent, const char *name, const char *user) {
@@ -761,7 +1008,7 @@ ErrorCode Filesystem::write_file(Entry *parent, const char *name, const char *us
     if (parent_inode == nullptr || !parent_inode->is_valid) return ErrorCode::FAILURE;
     AutoBlock block(0, parent_inode);
     if (block == nullptr) return ErrorCode::FAILURE;
-    for (auto& entry: block.elem()->entries) {
+    for (auto& entry: block.elem()->all_entries()) {
         if (entry.is_valid && strcmp(entry.name, name) == 0) {
             Inode* inode = get_inode(entry.inode_id);
             if (inode->type == 'd') {
@@ -773,6 +1020,8 @@ ErrorCode Filesystem::write_file(Entry *parent, const char *name, const char *us
             buffer << file.rdbuf();
             file.close();
             std::string contents = buffer.str();
+            goal_group = inode_group(entry.inode_id);
+            uint32_t old_size = inode->size, old_capacity = inode->capacity;
             std::vector<uint32_t> blocks = get_blocks(inode);
             uint32_t needed_blocks_num = (contents.size() + super->superblock.block_size - 1) / super->superblock.block_size;
             if (needed_blocks_num == 0) needed_blocks_num = 1;
@@ -786,11 +1035,12 @@ ErrorCode Filesystem::write_file(Entry *parent, const char *name, const char *us
                 blocks.resize(needed_blocks_num);
                 for (uint32_t i = blocks_num; i < needed_blocks_num; ++i) {
                     AutoBlock data_block;
+                    data_block.mask(DATA_MODE);
                     blocks[i] = data_block.id();
                 }
             }
             for (uint32_t i = 0; i < needed_blocks_num; ++i) {
-                AutoBlock data_block(blocks[i], GET | WRITE_MODE);
+                AutoBlock data_block(blocks[i], GET | WRITE_MODE | DATA_MODE);
                 Block* data = data_block.elem();
                 size_t length = std::min((uint32_t)contents.size(), (i + 1) * super->superblock.block_size) - i * super->superblock.block_size;
 //                strcpy(data->data, contents.substr(i * super->superblock.block_size, length).c_str());
@@ -811,6 +1061,8 @@ ErrorCode Filesystem::write_file(Entry *parent, const char *name, const char *us
             inode->capacity = needed_blocks_num * super->superblock.block_size;
             save_inode(entry.inode_id);
             save_inode(parent->inode_id);
+            account(parent->inode_id, (int64_t)inode->size - old_size,
+                    ((int64_t)inode->capacity - old_capacity) / super->superblock.block_size);
             unlock(entry.inode_id, inode, Lock::WRITE_LOCK);
             return ErrorCode::SUCCESS;
         }
@@ -824,7 +1076,7 @@ ErrorCode Filesystem::write_data(Entry *parent, const char* name, const std::str
     if (inode == nullptr || !inode->is_valid) return ErrorCode::FAILURE;
     AutoBlock block(0, inode);
     if (block == nullptr) return ErrorCode::FAILURE;
-    for (auto& entry: block.elem()->entries) {
+    for (auto& entry: block.elem()->all_entries()) {
         if (entry.is_valid && strcmp(entry.name, name) == 0) {
             ErrorCode err = check_entry(&entry, user, Option::WRITE);
             if (err != ErrorCode::SUCCESS) return ErrorCode::PERMISSION_DENIED;
@@ -834,6 +1086,8 @@ ErrorCode Filesystem::write_data(Entry *parent, const char* name, const std::str
             }
             err = lock(entry.inode_id, inode, Lock::WRITE_LOCK);
             if (err != ErrorCode::SUCCESS) return ErrorCode::LOCKED;
+            goal_group = inode_group(entry.inode_id);
+            uint32_t old_size = inode->size, old_capacity = inode->capacity;
             std::vector<uint32_t> blocks = get_blocks(inode);
             uint32_t needed_blocks_num = (contents.size() + super->superblock.block_size - 1) / super->superblock.block_size;
             if (needed_blocks_num == 0) needed_blocks_num = 1;
@@ -847,6 +1101,7 @@ ErrorCode Filesystem::write_data(Entry *parent, const char* name, const std::str
                 blocks.resize(needed_blocks_num);
                 for (uint32_t i = blocks_num; i < needed_blocks_num; ++i) {
                     AutoBlock data_block;
+                    data_block.mask(DATA_MODE);
                     blocks[i] = data_block.id();
                 }
             }
@@ -857,7 +1112,7 @@ ErrorCode Filesystem::write_data(Entry *parent, const char* name, const std::str
 //                }
 //            }
             for (uint32_t i = 0; i < needed_blocks_num; ++i) {
-                AutoBlock data_block(blocks[i], GET | WRITE_MODE);
+                AutoBlock data_block(blocks[i], GET | WRITE_MODE | DATA_MODE);
                 Block* data = data_block.elem();
                 size_t length = std::min((uint32_t)contents.size(), (i + 1) * super->superblock.block_size) - i * super->superblock.block_size;
                 memcpy(data->data, contents.substr(i * super->superblock.block_size, length).c_str(), length);
@@ -894,6 +1149,8 @@ ErrorCode Filesystem::write_data(Entry *parent, const char* name, const std::str
             inode->capacity = needed_blocks_num * super->superblock.block_size;
             save_inode(entry.inode_id);
             save_inode(parent->inode_id);
+            account(parent->inode_id, (int64_t)inode->size - old_size,
+                    ((int64_t)inode->capacity - old_capacity) / super->superblock.block_size);
             unlock(entry.inode_id, inode, Lock::WRITE_LOCK);
             return ErrorCode::SUCCESS;
         }
@@ -908,15 +1165,15 @@ ErrorCode Filesystem::new_file(Entry *parent, const char *name, const char *user
     if (inode == nullptr || !inode->is_valid) return ErrorCode::FAILURE;
     AutoBlock block(0, inode);
     if (block == nullptr) return ErrorCode::FAILURE;
-    for (auto& entry: block.elem()->entries) {
+    for (auto& entry: block.elem()->all_entries()) {
         if (entry.is_valid && strcmp(entry.name, name) == 0) {
             return ErrorCode::EXISTS;
         }
     }
     // Inode of child
     // 新建文件夹的对应i结点
-    auto [child_inode_id, child_inode] = new_inode();
-    for (auto& entry: block.elem()->entries) {
+    auto [child_inode_id, child_inode] = new_inode(parent->inode_id, false);
+    for (auto& entry: block.elem()->all_entries()) {
         if (!entry.is_valid) {
             entry.is_valid = true;
             entry.inode_id = child_inode_id;
@@ -926,14 +1183,15 @@ ErrorCode Filesystem::new_file(Entry *parent, const char *name, const char *user
             break;
         }
     }
-    child_inode->set_data(true, 1, 0, 1024, to_mode("rwxr-xr-x"), 'f', user);
+    child_inode->set_data(true, 1, 0, BLOCK_SIZE, to_mode("rwxr-xr-x"), 'f', user);
     memset(child_inode->i_block, -1, sizeof(child_inode->i_block));
     AutoBlock child_block;
     child_inode->i_block[0] = child_block.id();
 //    strcpy(child_block.elem()->data, "\0");
-    memcpy(child_block.elem()->data, "\0", BLOCK_SIZE);
+    memset(child_block.elem()->data, 0, BLOCK_SIZE);
     save_inode(parent->inode_id);
     save_inode(child_inode_id);
+    account(parent->inode_id, 0, 1);
     return ErrorCode::SUCCESS;
 }
 
@@ -954,7 +1212,7 @@ ErrorCode Filesystem::get_file(Entry *parent, const char *name, const char *user
     if (block == nullptr) return ErrorCode::FAILURE;
 
     // 遍历父目录的Entries
-    for (auto& entry: block.elem()->entries) {
+    for (auto& entry: block.elem()->all_entries()) {
         if (entry.is_valid && strcmp(entry.name, name) == 0) {
             // 检查目标是否为文件夹
             if (get_inode(entry.inode_id)->type == 'd') {
@@ -983,7 +1241,7 @@ ErrorCode Filesystem::release_file(Entry *parent, const char *name) {
     if (block == nullptr) return ErrorCode::FAILURE;
 
     // 遍历父目录的Entries
-    for (auto& entry: block.elem()->entries) {
+    for (auto& entry: block.elem()->all_entries()) {
         if (entry.is_valid && strcmp(entry.name, name) == 0) {
             // 检查目标是否为文件夹
             if (get_inode(entry.inode_id)->type == 'd') {
@@ -998,14 +1256,14 @@ ErrorCode Filesystem::release_file(Entry *parent, const char *name) {
     return ErrorCode::FILE_NOT_FOUND;
 }
 
-ErrorCode Filesystem::cat_data(Entry *parent, const char *name, std::string& data, const char *user) {
+ErrorCode Filesystem::cat_data(Entry *parent, const char *name, std::ostream& out, const char *user) {
     if (strlen(name) > MAX_LENGTH) return ErrorCode::EXCEEDED;
     if (!parent->is_valid) return ErrorCode::FAILURE;
     Inode* inode = get_inode(parent->inode_id);
     if (inode == nullptr || !inode->is_valid) return ErrorCode::FAILURE;
     AutoBlock block(0, inode);
     if (block == nullptr) return ErrorCode::FAILURE;
-    for (auto& entry: block.elem()->entries) {
+    for (auto& entry: block.elem()->all_entries()) {
         if (entry.is_valid && strcmp(entry.name, name) == 0) {
             ErrorCode err = check_entry(&entry, user, Option::READ);
             if (err != ErrorCode::SUCCESS) return ErrorCode::PERMISSION_DENIED;
@@ -1014,7 +1272,7 @@ ErrorCode Filesystem::cat_data(Entry *parent, const char *name, std::string& dat
             }
             err = lock(entry.inode_id, inode, Lock::READ_LOCK);
             if (err != ErrorCode::SUCCESS) return ErrorCode::LOCKED;
-            data = cat_log(&entry);
+            cat_log(&entry, out);
             return ErrorCode::SUCCESS;
         }
     }
@@ -1032,6 +1290,18 @@ std::string Filesystem::cat_log(Entry *log) {
     contents = contents.substr(0, inode->size);
     return contents;
 }
+uint32_t Filesystem::cat_log(Entry *log, std::ostream& out) {
+    Inode* inode = get_inode(log->inode_id);
+    uint32_t remain = inode->size;
+    std::vector<uint32_t> blocks = get_blocks(inode);
+    for (uint32_t i = 0; i < blocks.size() && remain > 0 && out; ++i) {
+        AutoBlock data_block(blocks[i]);
+        uint32_t length = std::min(remain, super->superblock.block_size);
+        out.write(data_block.elem()->data, length);
+        remain -= length;
+    }
+    return inode->size - remain;
+}
 ErrorCode Filesystem::cat_file(Entry *parent, const char *name, Option option, const char *user) {
     // Inode of parent
     if (strlen(name) > MAX_LENGTH) return ErrorCode::EXCEEDED;
@@ -1040,7 +1310,7 @@ ErrorCode Filesystem::cat_file(Entry *parent, const char *name, Option option, c
     if (inode == nullptr || !inode->is_valid) return ErrorCode::FAILURE;
     AutoBlock block(0, inode);
     if (block == nullptr) return ErrorCode::FAILURE;
-    for (auto& entry: block.elem()->entries) {
+    for (auto& entry: block.elem()->all_entries()) {
         if (entry.is_valid && strcmp(entry.name, name) == 0) {
             ErrorCode err = check_entry(&entry, user, option);
             if (err != ErrorCode::SUCCESS) return ErrorCode::PERMISSION_DENIED;
@@ -1149,7 +1419,7 @@ std::pair<ErrorCode, Entry*> Filesystem::get_path_entry(std::string path) {
         bool state = false;
 
         // 遍历数据块中的所有Entry
-        for (auto& entry: block.elem()->entries) {
+        for (auto& entry: block.elem()->all_entries()) {
             // 如果Entry有效且与子路径名匹配，更新当前Entry
             if (entry.is_valid && strcmp(entry.name, subpath.c_str()) == 0) {
                 delete res;
@@ -1174,24 +1444,90 @@ Inode* Filesystem::get_inode(uint32_t i) {
     if (i == null) return nullptr;
     uint32_t inodeIndex = i / INODES_PER_BLOCK;
     uint32_t inodeOffset = i % INODES_PER_BLOCK;
+    // 快照视图中的 inode 从快照创建时的 inode 表读取
+    if (NamedSnapshot::view) {
+        auto [it, inserted] = NamedSnapshot::inodes.try_emplace(inodeIndex);
+        if (inserted) NamedSnapshot::read(inodes_table->offset + inodeIndex, &it->second);
+        return &it->second.inodes[inodeOffset];
+    }
     return &inodes_table->inodes_table[inodeIndex]->inodes[inodeOffset];
 }
 
 // 保存指定Inode编号对应的Inode
 void Filesystem::save_inode(uint32_t i) {
-    // TODO: 添加保存Inode的实现
     if (i == null) return;
-    inodes_table->save();
+    // 只写回该 inode 所在的块
+    inodes_table->save(i);
+}
+
+/**
+ * @brief 更新目录及其所有上级目录缓存的子树用量
+ *
+ * 沿 .. 向上直到根目录，每一级只修改并保存一个 inode。遇到尚未统计的目录时停止，
+ * 这样的目录在载入磁盘时会整体重新统计。
+ *
+ * @param directory_id 发生变化的目录
+ * @param bytes 文件字节数的变化
+ * @param blocks 占用块数的变化
+ */
+void Filesystem::account(uint32_t directory_id, int64_t bytes, int64_t blocks) {
+    if (bytes == 0 && blocks == 0) return;
+    uint32_t root_id = super->superblock.root_inode_id;
+    uint32_t id = directory_id;
+    // 最多走 inode 数量那么多级，防止损坏的目录树中出现环
+    for (uint32_t i = 0; i < super->superblock.inodes_num && id != null; ++i) {
+        Inode* inode = get_inode(id);
+        if (inode == nullptr || !inode->has_usage()) return;
+        inode->set_usage(inode->usage_bytes() + bytes, inode->usage_blocks() + blocks);
+        save_inode(id);
+        if (id == root_id) return;
+        AutoBlock block(0, inode);
+        id = block.elem()->entries[1].inode_id;
+    }
 }
 
 // 删除指定Inode编号对应的Inode
 void Filesystem::delete_inode(uint32_t i) {
     if (i == null) return;
     inodes_bitmap->_delete(i);
-    inodes_bitmap->save();
+    inodes_bitmap->save(i);
     uint32_t inodeIndex = i / INODES_PER_BLOCK;
     uint32_t inodeOffset = i % INODES_PER_BLOCK;
     inodes_table->inodes_table[inodeIndex]->inodes[inodeOffset].is_valid = false;
+    inodes_table->save(i);
+}
+
+/**
+ * @brief 批量释放数据块
+ *
+ * 与逐个调用 delete_block 的效果相同，但每个位图块只写一次，打洞时相邻的块合并为一次调用。
+ *
+ * @param ids 要释放的块号
+ */
+void Filesystem::delete_blocks(const std::vector<uint32_t>& ids) {
+    std::set<uint32_t> freed;
+    for (uint32_t i: ids) {
+        if (i == null) continue;
+        NamedSnapshot::preserve(i);
+        blocks_bitmap->_delete(i);
+        freed.insert(i);
+    }
+    blocks_bitmap->save(ids);
+    if (Journal::active()) {
+        for (uint32_t i: freed) Journal::release(i);
+    } else {
+        Disk::punch(freed);
+    }
+}
+
+// 批量释放 inode，inode 位图块和 inode 表块各只写一次
+void Filesystem::delete_inodes(const std::vector<uint32_t>& ids) {
+    for (uint32_t i: ids) {
+        inodes_bitmap->_delete(i);
+        inodes_table->inodes_table[i / INODES_PER_BLOCK]->inodes[i % INODES_PER_BLOCK].is_valid = false;
+    }
+    inodes_bitmap->save(ids);
+    inodes_table->save(ids);
 }
 
 
@@ -1228,7 +1564,7 @@ ErrorCode Filesystem::ls(const std::string &path, bool with_args, const char *us
         return ErrorCode::FAILURE;
     }
     AutoBlock block(0, inode);
-    for (const auto& file: block.elem()->entries) {
+    for (const auto& file: block.elem()->all_entries()) {
         if (with_args) {
             if (file.is_valid && get_inode(file.inode_id)->type == 'd') {
                 if (file.name[0] != '.') {
@@ -1271,13 +1607,14 @@ ErrorCode Filesystem::ll(const std::string &path, bool with_args, const char* us
         response << std::left << std::setw(11) << "    Address";
         response << std::left << std::setw(10) << "      Size";
         response << std::left << std::setw(10) << "  Capacity";
+        response << std::left << std::setw(10) << "     Total";
         response << std::left << "  File\n";
-        response << "---------------------------------------------------------------------\n";
+        response << "-------------------------------------------------------------------------------\n";
         response << std::right << '-' << std::setw(9) << to_string(inode->mode);
         response << std::right << std::setw(11) << inode->owner;
         response << std::right << std::setw(11) << inode->owner;
         response << "  ";
-        response << std::right << "0x" << std::hex << std::setw(7) << std::setfill('0') << inode->i_block[0] * 1024;
+        response << std::right << "0x" << std::hex << std::setw(7) << std::setfill('0') << (uint64_t)inode->i_block[0] * BLOCK_SIZE;
         response << std::dec;
         response << std::setfill(' ');
         if (inode->size < 1024) {
@@ -1289,9 +1626,10 @@ ErrorCode Filesystem::ll(const std::string &path, bool with_args, const char* us
         }
         if (inode->capacity < 1024 * 1024) response << std::right << std::setw(9) << inode->capacity / 1024 << "K";
         else response << std::right << std::setw(9) << std::fixed << std::setprecision(2) << inode->capacity / (1024. * 1024) << "M";
+        response << std::right << std::setw(10) << '-';
         response << "  " << std::left << entry.elem()->name << '\n';
         response << WHITE;
-        response << "---------------------------------------------------------------------\n";
+        response << "-------------------------------------------------------------------------------\n";
         return ErrorCode::SUCCESS;
     }
     ErrorCode err = check_entry(entry.elem(), user, Option::READ);
@@ -1305,10 +1643,11 @@ ErrorCode Filesystem::ll(const std::string &path, bool with_args, const char* us
     response << std::left << std::setw(11) << "    Address";
     response << std::left << std::setw(10) << "      Size";
     response << std::left << std::setw(10) << "  Capacity";
+    response << std::left << std::setw(10) << "     Total";
     response << std::left << "  File\n";
-    response << "---------------------------------------------------------------------\n";
+    response << "-------------------------------------------------------------------------------\n";
     AutoBlock block(0, inode);
-    for (const auto& file: block.elem()->entries) {
+    for (const auto& file: block.elem()->all_entries()) {
         if (file.is_valid) {
             Inode* inode = get_inode(file.inode_id);
             if (inode->type == 'd') {
@@ -1320,7 +1659,7 @@ ErrorCode Filesystem::ll(const std::string &path, bool with_args, const char* us
             response << std::right << std::setw(11) << inode->owner;
             response << std::right << std::setw(11) << inode->owner;
             response << "  ";
-            response << std::right << "0x" << std::hex << std::setw(7) << std::setfill('0') << inode->i_block[0] * 1024;
+            response << std::right << "0x" << std::hex << std::setw(7) << std::setfill('0') << (uint64_t)inode->i_block[0] * BLOCK_SIZE;
             response << std::dec;
             response << std::setfill(' ');
             if (inode->size < 1024) {
@@ -1332,6 +1671,15 @@ ErrorCode Filesystem::ll(const std::string &path, bool with_args, const char* us
             }
             if (inode->capacity < 1024 * 1024) response << std::right << std::setw(9) << inode->capacity / 1024 << "K";
             else response << std::right << std::setw(9) << std::fixed << std::setprecision(2) << inode->capacity / (1024. * 1024) << "M";
+            if (inode->type != 'd') {
+                response << std::right << std::setw(10) << '-';
+            } else if (inode->usage_bytes() < 1024) {
+                response << std::right << std::setw(9) << inode->usage_bytes() << "B";
+            } else if (inode->usage_bytes() < 1024 * 1024) {
+                response << std::right << std::setw(9) << std::fixed << std::setprecision(2) << inode->usage_bytes() / 1024. << "K";
+            } else {
+                response << std::right << std::setw(9) << std::fixed << std::setprecision(2) << inode->usage_bytes() / (1024. * 1024) << "M";
+            }
             if (inode->type == 'd') {
                 response << BLUE;
             } else if (inode->type == 'x') {
@@ -1343,7 +1691,7 @@ ErrorCode Filesystem::ll(const std::string &path, bool with_args, const char* us
             response << WHITE;
         }
     }
-    response << "---------------------------------------------------------------------\n";
+    response << "-------------------------------------------------------------------------------\n";
     return ErrorCode::SUCCESS;
 }
 // 删除目录或文件对应的Entry及其关联的Inode和数据块
@@ -1381,7 +1729,7 @@ ErrorCode delete_entry(Entry* current) {
     Filesystem::AutoBlock block(0, inode);
 
     // 递归删除目录下的所有文件和子目录
-    for (auto& entry : block.elem()->entries) {
+    for (auto& entry : block.elem()->all_entries()) {
         if (entry.is_valid && Filesystem::get_inode(entry.inode_id)->type == 'f') {
             delete_entry(&entry);
             block.save();
@@ -1389,7 +1737,7 @@ ErrorCode delete_entry(Entry* current) {
     }
 
     // 删除目录下的所有子目录
-    for (auto& entry : block.elem()->entries) {
+    for (auto& entry : block.elem()->all_entries()) {
         if (entry.is_valid && strcmp(entry.name, ".") != 0 && strcmp(entry.name, "..") != 0) {
             delete_entry(&entry);
             block.save();
@@ -1432,7 +1780,7 @@ ErrorCode Filesystem::delete_directory(Entry* parent, const char* name, Option o
     }
 
     // 遍历父目录的所有Entry
-    for (auto& entry : block.elem()->entries) {
+    for (auto& entry : block.elem()->all_entries()) {
         // 如果Entry有效且名称匹配
         if (entry.is_valid && strcmp(entry.name, name) == 0) {
             // 获取对应Inode
@@ -1450,11 +1798,20 @@ ErrorCode Filesystem::delete_directory(Entry* parent, const char* name, Option o
                 }
             }
 
-            // 删除Entry，更新父目录Inode的大小，保存Inode和数据块
-            delete_entry(&entry);
+            // 删除Entry，更新父目录Inode的大小，保存Inode和数据块；
+            // 非空目录只从父目录中摘下，其中的内容交给后台回收线程释放
+            uint64_t bytes = inode->has_usage() ? inode->usage_bytes() : 0;
+            uint32_t blocks = inode->has_usage() ? inode->usage_blocks() : 0;
+            if (inode->size > 2 * sizeof(Entry)) {
+                Reclaimer::orphan(entry.inode_id);
+                entry.is_valid = false;
+            } else {
+                delete_entry(&entry);
+            }
             parent_inode->size -= sizeof(Entry);
             save_inode(parent->inode_id);
             block.save();
+            account(parent->inode_id, -(int64_t)bytes, -(int64_t)blocks);
 
             // 返回成功
             return ErrorCode::SUCCESS;
@@ -1465,71 +1822,298 @@ ErrorCode Filesystem::delete_directory(Entry* parent, const char* name, Option o
     return ErrorCode::FILE_NOT_FOUND;
 }
 
-// 新建磁盘文件
-ErrorCode Disk::new_disk() {
-    // 以二进制、读写方式创建磁盘文件
-    std::fstream disk_file(disk_name, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
-
-    // 如果文件打开失败，返回失败
-    if (!disk_file) {
+/**
+ * @brief resize 命令，在线扩大磁盘
+ *
+ * 块位图和校验和表在格式化时已按扩容上限预留，扩容只需扩大镜像文件、
+ * 扩大内存中的块位图并更新超级块，新增的块都是零块，不需要写入。
+ * inode 的数量在格式化时确定，扩容不会增加 inode。
+ *
+ * @param args 新的大小（K/M/G，默认为 M）
+ * @param user 用户名
+ * @return ErrorCode 操作结果
+ */
+ErrorCode Filesystem::resize(const std::string& args, const char* user) {
+    if (strcmp(user, "root") != 0) {
+        response << "resize: Permission denied" << std::endl;
+        return ErrorCode::PERMISSION_DENIED;
+    }
+    uint64_t size = 0;
+    if (!parse_size(args, size)) {
+        response << "usage: resize <size>[K|M|G]" << std::endl;
         return ErrorCode::FAILURE;
     }
+    Superblock& sb = super->superblock;
+    uint64_t blocks_num = size / BLOCK_SIZE / 8 * 8;
+    auto megabytes = [](uint64_t blocks) { return std::to_string(blocks * BLOCK_SIZE / (1024 * 1024)) + "M"; };
+    if (blocks_num < sb.blocks_num) {
+        response << "resize: shrinking is not supported (the disk is " << megabytes(sb.blocks_num) << ")" << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    if (blocks_num > sb.max_blocks_num) {
+        response << "resize: the disk can grow to at most " << megabytes(sb.max_blocks_num)
+                 << ", format it with a larger --max-size" << std::endl;
+        return ErrorCode::EXCEEDED;
+    }
+    if (blocks_num == sb.blocks_num) {
+        response << "resize: the disk is already " << megabytes(sb.blocks_num) << std::endl;
+        return ErrorCode::SUCCESS;
+    }
+    // 先扩大镜像文件，此时崩溃只会留下未使用的尾部
+    if (ftruncate(Disk::fd, (off_t)blocks_num * BLOCK_SIZE) != 0) {
+        response << "resize: cannot grow '" << Disk::disk_name << "': " << strerror(errno) << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    uint32_t old_blocks_num = sb.blocks_num;
+    blocks_bitmap->grow(blocks_num);
+    Snapshot::grow(blocks_num);
+    NamedSnapshot::grow(blocks_num);
+    sb.blocks_num = blocks_num;
+    save_block(0, super);
+    response << "resize: grew from " << megabytes(old_blocks_num) << " to " << megabytes(blocks_num)
+             << " (" << blocks_num - old_blocks_num << " blocks added)" << std::endl;
+    return ErrorCode::SUCCESS;
+}
 
-    // 创建数据缓冲区
-    char* data_buffer = new char[BLOCK_SIZE];
-
-    // 循环写入数据块
-    for (int i = 0; i < BLOCKS_NUM; ++i) {
-        disk_file.seekp(i * BLOCK_SIZE);
-        disk_file.write(reinterpret_cast<const char*>(data_buffer), BLOCK_SIZE);
+// 新建磁盘文件并打开，镜像正被其他进程使用时返回 LOCKED
+ErrorCode Disk::new_disk(uint64_t size) {
+    close_disk();
+    int disk_fd = ::open(disk_name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (disk_fd < 0) {
+        return ErrorCode::FAILURE;
+    }
+    // 先取得锁再截断，不能破坏其他进程正在使用的镜像
+    if (flock(disk_fd, LOCK_EX | LOCK_NB) != 0) {
+        ::close(disk_fd);
+        return ErrorCode::LOCKED;
+    }
+    // 创建稀疏的磁盘文件，未写入的块读出为零且不占用宿主机的磁盘空间
+    if (ftruncate(disk_fd, 0) != 0 || ftruncate(disk_fd, (off_t)size) != 0) {
+        ::close(disk_fd);
+        return ErrorCode::FAILURE;
     }
+    fd = disk_fd;
+    return ErrorCode::SUCCESS;
+}
 
-    // 关闭文件，释放内存，返回成功
-    disk_file.close();
-    delete[] data_buffer;
+/**
+ * @brief 打开磁盘文件，之后的读写都使用同一个文件描述符
+ *
+ * 打开的同时取得镜像的独占锁（flock），直到 close_disk 或进程退出才释放，
+ * 同一个镜像不会同时被两个 Simdisk 或 Volume 修改。
+ *
+ * @return ErrorCode 镜像正被其他进程使用时返回 LOCKED
+ */
+ErrorCode Disk::load_disk() {
+    close_disk();
+    int disk_fd = ::open(disk_name.c_str(), O_RDWR);
+    if (disk_fd < 0) {
+        return ErrorCode::FAILURE;
+    }
+    if (flock(disk_fd, LOCK_EX | LOCK_NB) != 0) {
+        ::close(disk_fd);
+        return ErrorCode::LOCKED;
+    }
+    fd = disk_fd;
     return ErrorCode::SUCCESS;
 }
-void Disk::load_disk() {
 
+// 关闭磁盘文件，释放镜像的锁
+void Disk::close_disk() {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+/**
+ * @brief 在镜像中为仍然空闲的块打洞
+ *
+ * 调用方保证释放这些块的元数据已经写回（持久化模式下已经同步），
+ * 之后又被重新分配的块跳过。相邻的块合并成一次 fallocate，宿主机的文件系统
+ * 只回收完整覆盖的块，其余部分清零。打洞后块的内容为零，校验和随之更新。
+ *
+ * @param block_nums 块号
+ */
+void Disk::punch(const std::set<uint32_t>& block_nums) {
+    const Bitmap* bitmap = Filesystem::blocks_bitmap;
+    if (fd < 0 || !punch_holes || block_nums.empty() || bitmap == nullptr) return;
+    static const Block zero{};
+    auto it = block_nums.begin();
+    while (it != block_nums.end()) {
+        uint32_t first = *it, last = *it;
+        if (bitmap->bitmap[first / 8] & (1 << (first % 8))) {
+            ++it;
+            continue;
+        }
+        for (++it; it != block_nums.end() && *it == last + 1 && !(bitmap->bitmap[*it / 8] & (1 << (*it % 8))); ++it) {
+            last = *it;
+        }
+        for (uint32_t i = first; i <= last; ++i) {
+            NamedSnapshot::preserve(i);
+            Snapshot::track(i);
+            ChecksumTable::update(i, &zero, true);
+        }
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)first * BLOCK_SIZE, (off_t)(last - first + 1) * BLOCK_SIZE) == 0) {
+            punched += last - first + 1;
+        }
+    }
+    ChecksumTable::flush();
 }
 
 // 从磁盘读取指定块号的数据块
 Block* Disk::read_block(uint32_t block_num) {
-    // 以二进制、读写方式打开磁盘文件
-    std::fstream disk_file(disk_name, std::ios::binary | std::ios::in | std::ios::out);
-
-    // 如果文件未成功打开，返回空指针
-    if (!disk_file.is_open()) {
+    // 如果磁盘文件未成功打开，返回空指针
+    if (fd < 0) {
         return nullptr;
     }
 
+    Stats::reads.fetch_add(1, std::memory_order_relaxed);
+
     // 创建一个字符数组来存储读取的块数据
     char* block = new char[BLOCK_SIZE];
 
-    // 定位到指定块号的位置
-    disk_file.seekg(block_num * BLOCK_SIZE);
+    // 快照视图中读取快照创建时的内容
+    if (NamedSnapshot::view) {
+        NamedSnapshot::read(block_num, block);
+        return reinterpret_cast<Block*>(block);
+    }
+
+    // 事务中修改过的块以日志中的内容为准
+    if (Journal::lookup(block_num, reinterpret_cast<Block*>(block))) {
+        return reinterpret_cast<Block*>(block);
+    }
 
-    // 读取块数据到字符数组
-    disk_file.read(block, BLOCK_SIZE);
+    // 读取块数据到字符数组，超出文件末尾的部分补零
+    ssize_t n = pread(fd, block, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+    if (n < BLOCK_SIZE) {
+        memset(block + std::max<ssize_t>(n, 0), 0, BLOCK_SIZE - std::max<ssize_t>(n, 0));
+    }
 
-    // 关闭文件
-    disk_file.close();
+    // 校验块的内容，不一致时只计数并报告，由调用方和 check 处理
+    ChecksumTable::verify(block_num, block);
 
     // 将字符数组的地址转换为块对象的指针并返回
     return reinterpret_cast<Block*>(block);
 }
 
-// 将数据块写入磁盘的指定块号位置
+// 将元数据块写入磁盘的指定块号位置
 void Disk::write_block(uint32_t block_num, const Block* block) {
-    // 以二进制、读写方式打开磁盘文件
-    std::fstream disk_file(disk_name, std::ios::binary | std::ios::in | std::ios::out);
+    // 快照视图是只读的
+    if (NamedSnapshot::view) return;
+    Stats::writes.fetch_add(1, std::memory_order_relaxed);
+    // 事务进行中时先记入日志，提交时再写回原位置
+    if (Journal::active()) {
+        Journal::record(block_num, block);
+        return;
+    }
+    ChecksumTable::update(block_num, block, false);
+    write_raw(block_num, block);
+    ChecksumTable::flush();
+}
+
+// 将文件数据块写入磁盘的指定块号位置
+void Disk::write_data(uint32_t block_num, const Block* block) {
+    if (NamedSnapshot::view) return;
+    Stats::writes.fetch_add(1, std::memory_order_relaxed);
+    if (Journal::active()) {
+        // 该块在日志中有未失效的旧内容时，也必须经过日志，否则重放会覆盖新数据
+        if (!Journal::ordered(block_num)) {
+            Journal::record(block_num, block);
+            return;
+        }
+        // 改写已有的块要等到确定提交，放弃事务时不能留下改动
+        if (!Journal::allocated.count(block_num)) {
+            Journal::overwrite(block_num, block);
+            return;
+        }
+        // 先清除校验和再写入数据，新的校验和在数据落盘后记录
+        ChecksumTable::defer(block_num, block);
+        write_raw(block_num, block);
+        return;
+    }
+    ChecksumTable::update(block_num, block, true);
+    write_raw(block_num, block);
+    ChecksumTable::flush();
+}
+
+// 直接写入磁盘的指定块号位置
+void Disk::write_raw(uint32_t block_num, const void* data) {
+    if (fd < 0) {
+        return;
+    }
+    Snapshot::track(block_num);
+    NamedSnapshot::preserve(block_num);
+    pwrite(fd, data, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+}
 
-    // 定位到指定块号的位置
-    disk_file.seekp(block_num * BLOCK_SIZE);
+// 提示内核预读给定的块（快照视图中的块可能位于快照文件中，不预读）
+void Disk::prefetch(uint32_t block_num) {
+    if (fd < 0 || block_num == null || NamedSnapshot::view) return;
+    posix_fadvise(fd, (off_t)block_num * BLOCK_SIZE, BLOCK_SIZE, POSIX_FADV_WILLNEED);
+}
 
-    // 将块对象的内容以字符数组形式写入文件
-    disk_file.write(reinterpret_cast<const char*>(block), BLOCK_SIZE);
+EntryRecord Filesystem::entry_record(const Entry& file, const Inode* inode) {
+    EntryRecord record{};
+    record.inode_id = file.inode_id;
+    record.size = inode->size;
+    record.capacity = inode->capacity;
+    record.address = inode->i_block[0] * super->superblock.block_size;
+    record.mode = inode->mode;
+    record.type = inode->type;
+    record.total = inode->type == 'd' ? inode->usage_bytes() : 0;
+    memcpy(record.owner, inode->owner, sizeof(record.owner));
+    strncpy(record.name, file.name, sizeof(record.name) - 1);
+    return record;
+}
 
-    // 关闭文件
-    disk_file.close();
+/**
+ * @brief 以结构化记录返回目录内容
+ *
+ * 每个目录项输出一条 EntryRecord（路径为文件时只输出该文件），由客户端自行格式化。
+ *
+ * @param command 命令名（用于错误信息）
+ * @param path 路径，为空时为当前目录
+ * @param with_args 是否只返回目录
+ * @param user 用户名
+ * @return ErrorCode 操作结果
+ */
+ErrorCode Filesystem::records(const char* command, const std::string &path, bool with_args, const char* user) {
+    if (!response.bound()) {
+        response << command << ": structured records require a data arena" << '\n';
+        return ErrorCode::FAILURE;
+    }
+    AutoEntry entry;
+    if (path.empty()) {
+        entry.set(Entry::clone(pid_map[current_shell_pid].current_entry.elem()));
+    } else {
+        entry.set(get_path_entry(path).second);
+        if (entry == nullptr) {
+            response << command << ": cannot access '" << path << "': No such file or directory" << '\n';
+            return ErrorCode::FAILURE;
+        }
+    }
+    auto emit = [](const Entry& file, const Inode* inode) {
+        EntryRecord record = entry_record(file, inode);
+        response.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    };
+    Inode* inode = get_inode(entry.elem()->inode_id);
+    if (inode == nullptr || !inode->is_valid) return ErrorCode::FAILURE;
+    if (inode->type == 'f') {
+        emit(*entry.elem(), inode);
+        return ErrorCode::SUCCESS;
+    }
+    ErrorCode err = check_entry(entry.elem(), user, Option::READ);
+    if (err == ErrorCode::FAILURE) {
+        response << command << ": Permission denied" << '\n';
+        return ErrorCode::FAILURE;
+    }
+    AutoBlock block(0, inode);
+    for (const auto& file: block.elem()->all_entries()) {
+        if (!file.is_valid) continue;
+        Inode* child = get_inode(file.inode_id);
+        if (with_args && child->type != 'd') continue;
+        emit(file, child);
+    }
+    return ErrorCode::SUCCESS;
 }
@@ -5,6 +5,7 @@
 #ifndef SIMPLE_OS_FILESYSTEM_H
 #define SIMPLE_OS_FILESYSTEM_H
 #include "../common/common.h"
+#include "response.h"
 #include <iostream>
 #include <bitset>
 #include <iomanip>
@@ -17,18 +18,52 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <cstring>
-#define INODES_PER_BLOCK 16
-#define POINTERS_PER_BLOCK 256
-#define ENTRY_PER_BLOCK 32
+#include <fcntl.h>
+#include <functional>
+#include <algorithm>
+#include <span>
 #define DISK_SIZE (100 * 1024 * 1024)
 #define BLOCKS_NUM (100 * 1024)
-#define BLOCK_SIZE 1024
+#define MIN_BLOCK_SIZE 1024                       // 最小的块大小，超级块总在镜像的前 1 KiB 中
+#define MAX_BLOCK_SIZE 8192                       // 最大的块大小，Block 中的数组按此大小声明
+#define BLOCK_SIZE (BlockSize::bytes)             // 当前磁盘的块大小
 #define INODES_NUM (100 * 1024)
 #define INODE_SIZE 64
+#define ENTRY_SIZE 32
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+#define POINTERS_PER_BLOCK (BLOCK_SIZE / 4)
+#define ENTRY_PER_BLOCK (BLOCK_SIZE / ENTRY_SIZE)
 #define MAX_LENGTH 24
+#define JOURNAL_MAGIC 0x4a524e4c                  // 日志区标志 "JRNL"
+#define JOURNAL_DESCRIPTOR 0x4a444553             // 描述块标志 "JDES"
+#define JOURNAL_COMMIT 0x4a434d54                 // 提交块标志 "JCMT"
+#define JOURNAL_BLOCKS 1024                       // 日志区块数
+#define JOURNAL_TAGS ((BLOCK_SIZE - 12) / 4)      // 一个描述块可记录的块号个数
+#define MAX_JOURNAL_TAGS ((MAX_BLOCK_SIZE - 12) / 4)
+#define CHECKSUM_MAGIC 0x43524343                 // 校验和表标志 "CRCC"
+#define CHECKSUM_DATA 1                           // 校验和标志：文件数据块也计算校验和
+#define SNAPSHOT_MAGIC 0x534e4150                 // 快照文件标志 "SNAP"
+#define TRACKING_MAGIC 0x43425431                 // 变更跟踪文件标志 "CBT1"
+#define COW_MAGIC 0x434f5731                      // 写时复制快照文件标志 "COW1"
 static constexpr uint32_t null = (uint32_t)-1;
 extern bool state;
+
+/**
+ * @brief 当前磁盘的块大小
+ *
+ * 块大小（1、4 或 8 KiB）在格式化时选定并记录在超级块中，载入磁盘时读出。
+ * 一块中的 inode、目录项和间接指针的个数，以及位图块、校验和表块能描述的块数都随之变化；
+ * 内存中读入的块只分配 BLOCK_SIZE 字节，Block 中按最大块大小声明的数组只能访问前 BLOCK_SIZE 字节。
+ */
+struct BlockSize {
+    inline static uint32_t bytes = MIN_BLOCK_SIZE;
+
+    static bool valid(uint32_t size) {
+        return size == 1024 || size == 4096 || size == 8192;
+    }
+};
 // Superblock 结构体定义了超级块的一些属性，用于描述文件系统的基础信息。
 struct Superblock {
     uint32_t magic_number = 0xffffff; // 魔数是一个用于识别文件系统的标志
@@ -48,7 +83,42 @@ struct Superblock {
     time_t last_write_time; // 最后写入时间，是一个time_t类型的变量
     uint32_t root_block_id; // 根目录项所在块ID
     uint32_t root_inode_id; // 根目录项对应inodeID
+    uint32_t journal_magic = 0; // 日志区标志，等于 JOURNAL_MAGIC 时磁盘带有元数据日志区
+    uint32_t journal_start = 0; // 日志区起始块号
+    uint32_t journal_blocks = 0; // 日志区块数
+    uint32_t checksum_magic = 0; // 校验和表标志，等于 CHECKSUM_MAGIC 时磁盘带有块校验和
+    uint32_t checksum_start = 0; // 校验和表起始块号
+    uint32_t checksum_blocks = 0; // 校验和表块数
+    uint32_t checksum_flags = 0; // 校验和标志
+    uint32_t max_blocks_num = 0; // 在线扩容的块数上限，块位图和校验和表按此大小预留
+    uint32_t inode_ratio = 0; // 格式化时每个 inode 对应的字节数
+    uint32_t blocks_bitmap_start = 0; // 块位图起始块号，0 表示旧版磁盘（各区域依次紧跟超级块）
+    uint32_t inodes_bitmap_start = 0; // inode 位图起始块号
+    uint32_t inodes_table_start = 0; // inode 表起始块号
+    uint32_t data_start = 0; // 数据区起始块号
+    uint32_t group_blocks = 0; // 每个块组的块数，等于一个位图块能描述的块数
+    uint32_t group_inodes = 0; // 每个块组的 inode 数，按格式化时的块组数均分
+    uint32_t orphan_inode = 0; // 已从目录树摘下、等待回收的第一个目录的 inode，0 表示没有
+
+    // 按格式化参数计算几何参数和各区域的位置，并切换到该块大小；空间不足时返回 false
+    bool layout(uint64_t disk_size, uint32_t size, uint32_t ratio, uint64_t max_size);
+    // 旧版磁盘没有记录各区域的位置，按原来的布局补齐
+    void derive();
+    // 划分块组
+    void split_groups();
+};
+
+// 格式化新磁盘时使用的几何参数（由命令行参数指定）
+struct Geometry {
+    inline static uint64_t size = DISK_SIZE;                    // 镜像大小，单位为字节
+    inline static uint32_t inode_ratio = DISK_SIZE / INODES_NUM; // 每个 inode 对应的字节数
+    inline static uint64_t max_size = 0;                        // 在线扩容的上限，0 表示镜像大小的 4 倍
+    inline static uint32_t block_size = MIN_BLOCK_SIZE;         // 块大小，1、4 或 8 KiB
+    static constexpr uint64_t MAX_SIZE = 16ull << 30;           // 镜像大小的上限
 };
+
+// 解析带单位（K/M/G，默认为 M）的大小
+bool parse_size(const std::string& text, uint64_t& bytes);
 // 一个Inode占用64字节
 struct Inode {                // Inode
     bool is_valid = false;    // Inode是否有效
@@ -69,7 +139,27 @@ struct Inode {                // Inode
         type = _type;
         strcpy(owner, _owner);
     }
+    // 目录只使用 i_block[0]，i_block[6] 缓存子树占用的块数，i_block[7]、i_block[8] 缓存子树中文件的总字节数；
+    // i_block[6] 为 null 表示尚未统计
+    bool has_usage() const {
+        return type == 'd' && i_block[6] != null;
+    }
+    uint32_t usage_blocks() const {
+        return i_block[6];
+    }
+    uint64_t usage_bytes() const {
+        return i_block[7] | (uint64_t)i_block[8] << 32;
+    }
+    void set_usage(uint64_t bytes, uint32_t blocks) {
+        i_block[6] = blocks;
+        i_block[7] = (uint32_t)bytes;
+        i_block[8] = (uint32_t)(bytes >> 32);
+    }
 };
+// 按顺序取出 Inode 的全部数据块号（含间接块中的）
+std::vector<uint32_t> get_blocks(Inode* inode);
+// 按块列表重建 Inode 的直接块与间接块
+void set_blocks(Inode* inode, const std::vector<uint32_t>& blocks, uint32_t needed_blocks_num);
 struct Entry {
     bool is_valid = false;                              // 目录项是否有效
     uint32_t inode_id = null;                           // 目录项对应的i结点ID
@@ -86,28 +176,194 @@ struct Entry {
     }
 };
 
-// 数据块
+// 日志头（日志区的第一块），记录重放的起点
+struct JournalHeader {
+    uint32_t magic;                       // 日志区标志
+    uint32_t sequence;                    // 起点处事务的序号
+    uint32_t start;                       // 起点在日志区中的位置
+};
+
+// 描述块，其后依次为 count 个块的新内容
+struct JournalDescriptor {
+    uint32_t magic;                       // 描述块标志
+    uint32_t sequence;                    // 所属事务的序号
+    uint32_t count;                       // 记录的块数
+    uint32_t blocks[MAX_JOURNAL_TAGS];    // 各块的块号，前 JOURNAL_TAGS 个有效
+};
+
+// 提交块，校验通过才表示事务完整写入日志
+struct JournalCommit {
+    uint32_t magic;                       // 提交块标志
+    uint32_t sequence;                    // 所属事务的序号
+    uint32_t count;                       // 事务的总块数
+    uint32_t checksum;                    // 序号、块号与块内容的 CRC32C 校验和
+};
+
+// 数据块，数组按最大的块大小声明，只有前 BLOCK_SIZE 字节属于当前磁盘的一块
 union Block {
     Superblock superblock;                // 超级块
-    Inode inodes[INODES_PER_BLOCK];       // 16个i节点（一个i节点占用64个字节）的块
-    Entry entries[ENTRY_PER_BLOCK];       // 32个目录项（一个目录项占用32个字节）
-    uint32_t pointers[POINTERS_PER_BLOCK];// 间接指针块
-    uint8_t bmp[BLOCK_SIZE];              // 位图数据
-    char data[BLOCK_SIZE];                // 纯数据块
-    Block() {}
+    Inode inodes[MAX_BLOCK_SIZE / INODE_SIZE];       // INODES_PER_BLOCK 个i节点（一个i节点占用64个字节）的块
+    Entry entries[MAX_BLOCK_SIZE / ENTRY_SIZE];      // ENTRY_PER_BLOCK 个目录项（一个目录项占用32个字节）
+    uint32_t pointers[MAX_BLOCK_SIZE / 4];           // 间接指针块
+    uint8_t bmp[MAX_BLOCK_SIZE];          // 位图数据
+    char data[MAX_BLOCK_SIZE];            // 纯数据块
+    JournalHeader journal_header;         // 日志头
+    JournalDescriptor descriptor;         // 日志描述块
+    JournalCommit commit;                 // 日志提交块
+    Block(): data{} {}
+
+    // 当前块大小下块中的全部目录项
+    std::span<Entry> all_entries() {
+        return {entries, ENTRY_PER_BLOCK};
+    }
+    // 当前块大小下块中的全部间接指针
+    std::span<uint32_t> all_pointers() {
+        return {pointers, POINTERS_PER_BLOCK};
+    }
 };
+static_assert(sizeof(Entry) == ENTRY_SIZE && sizeof(Inode) == INODE_SIZE);
 
 struct Disk {
     // 磁盘名字
     inline static std::string disk_name;
-    // 创建新的磁盘
-    static ErrorCode new_disk();
-    // 加载已有磁盘
-    static void load_disk();
+    // 磁盘镜像文件的文件描述符
+    inline static int fd = -1;
+    // 创建新的磁盘并打开
+    static ErrorCode new_disk(uint64_t size);
+    // 加载已有磁盘，同时取得镜像的独占锁
+    static ErrorCode load_disk();
+    // 关闭磁盘文件，释放镜像的锁
+    static void close_disk();
     // 根据所给定的块号从磁盘中读取相应的块
     static Block* read_block(uint32_t block_num);
-    // 根据所给定的块号往磁盘中读取相应的块
+    // 根据所给定的块号往磁盘中写入元数据块（事务进行中时先记入日志）
     static void write_block(uint32_t block_num, const Block* block);
+    // 根据所给定的块号往磁盘中写入文件数据块（不经过日志）
+    static void write_data(uint32_t block_num, const Block* block);
+    // 直接写入磁盘，不经过日志
+    static void write_raw(uint32_t block_num, const void* data);
+    // 提示内核预读给定的块，不等待读取完成
+    static void prefetch(uint32_t block_num);
+    // 在镜像中为仍然空闲的块打洞，归还宿主机的磁盘空间
+    static void punch(const std::set<uint32_t>& block_nums);
+
+    inline static bool punch_holes = false;           // 释放块时是否打洞
+    inline static std::set<uint32_t> holes;           // 已提交、等待组提交同步的事务释放的块：同步后才打洞，之前不能直接覆盖
+    inline static uint64_t punched = 0;               // 已打洞的块数
+};
+
+/**
+ * @brief Journal 结构体
+ *
+ * 元数据的预写日志。日志区是磁盘上循环使用的一段连续块，第一块为日志头。
+ * 一条命令对元数据块的全部修改组成一个事务：提交时依次写入描述块、各块的新内容
+ * 和带校验和的提交块，然后才写回原位置。载入磁盘时从日志头记录的起点开始，
+ * 按序号重放校验通过的事务，因此恢复时间不超过读一遍日志区的时间。
+ * 文件数据块不经过日志，在提交前写入（ordered 模式）：新分配的块立即写入，
+ * 改写已有的块要等到确定提交时才写入。
+ * 事务总是整体提交：超出日志区容量的事务被整体放弃，内存中的元数据从磁盘重新读取。
+ */
+struct Journal {
+    inline static uint32_t start = 0;                 // 日志区起始块号
+    inline static uint32_t size = 0;                  // 日志区块数，0 表示未启用日志
+    inline static uint32_t head = 1;                  // 下一个事务在日志区中的位置
+    inline static uint32_t sequence = 1;              // 下一个事务的序号
+    inline static uint32_t depth = 0;                 // 事务嵌套深度
+    inline static std::map<uint32_t, Block> blocks;   // 当前事务修改的块（按块号去重）
+    inline static std::set<uint32_t> freed;           // 当前事务释放的块
+    inline static std::set<uint32_t> allocated;       // 当前事务新分配的块
+    inline static std::map<uint32_t, Block> overwrites; // 当前事务改写的已有数据块，确定提交后才写入原位置
+    inline static std::set<uint32_t> journaled;       // 日志中仍可能被重放的块
+    inline static uint64_t committed = 0;             // 已提交的事务数
+    inline static uint64_t logged = 0;                // 已记入日志的块数
+    inline static uint32_t replayed = 0;              // 载入时重放的事务数
+    inline static uint64_t aborted = 0;               // 超出容量而放弃的事务数
+    inline static bool overflowed = false;            // 最近结束的事务是否因超出容量而被放弃
+    inline static bool cancelled = false;             // 当前事务是否已被取消，结束时整体放弃
+
+    // 持久化模式：事务写入日志后先不写回原位置，由组提交统一 fdatasync 后再写回
+    inline static bool durable = false;               // 是否启用持久化模式
+    inline static uint32_t window = 2000;             // 组提交窗口，单位为微秒
+    inline static uint32_t batch = 32;                // 一组最多确认的命令数
+    inline static std::map<uint32_t, Block> checkpoints; // 已写入日志、等待写回原位置的块
+    inline static uint32_t unsynced = 0;              // 尚未持久化的事务数
+    inline static uint64_t syncs = 0;                 // fdatasync 次数
+    inline static uint64_t synced = 0;                // 已持久化的事务数
+    inline static uint64_t acknowledged = 0;          // 组提交确认的命令数
+    inline static uint32_t largest = 0;               // 最大的一组包含的命令数
+
+    // 初始化新磁盘的日志区
+    static void format(uint32_t _start, uint32_t _size);
+    // 载入磁盘时重放日志，返回重放的事务数
+    static uint32_t recover(uint32_t _start, uint32_t _size);
+    // 开始事务（可嵌套，最外层结束时提交）
+    static void begin();
+    // 结束事务
+    static void commit();
+    // 将当前事务写入日志并写回原位置（持久化模式下只写入日志）
+    static void flush();
+    // 放弃当前事务，从磁盘重新读取内存中的元数据
+    static void abort();
+    // 取消当前事务，最外层结束时整体放弃
+    static void cancel();
+    // 持久化已写入日志的事务，再将其写回原位置
+    static void sync();
+    // 记录事务中修改的块
+    static void record(uint32_t block_num, const Block* block);
+    // 读取事务中尚未写回的块
+    static bool lookup(uint32_t block_num, Block* block);
+    // 记录事务中释放的块
+    static void release(uint32_t block_num);
+    // 记录事务中新分配的块
+    static void allocate(uint32_t block_num);
+    // 暂存事务中对已有数据块的改写
+    static void overwrite(uint32_t block_num, const Block* block);
+    // 数据块能否不经过日志直接写入
+    static bool ordered(uint32_t block_num);
+    // 一个事务最多记录的块数
+    static uint32_t capacity();
+
+    static bool enabled() {
+        return size != 0;
+    }
+
+    static bool active() {
+        return depth > 0 && enabled();
+    }
+
+    /**
+     * @brief AutoTransaction 结构体
+     *
+     * 在作用域内开始事务，离开作用域时提交。
+     */
+    struct AutoTransaction {
+        AutoTransaction() {
+            begin();
+        }
+        ~AutoTransaction() {
+            commit();
+        }
+    };
+
+    /**
+     * @brief 在一个事务中执行 body
+     *
+     * 嵌套调用时并入外层事务，由外层判断是否提交。
+     *
+     * @return ErrorCode body 的结果；事务超出日志区容量而被放弃时返回 EXCEEDED
+     */
+    template<typename Body>
+    static ErrorCode transact(Body&& body) {
+        ErrorCode code;
+        {
+            AutoTransaction transaction;
+            code = body();
+        }
+        return depth == 0 && overflowed ? ErrorCode::EXCEEDED : code;
+    }
+
+    // 写入日志头，之前的事务不再重放
+    static void write_header();
 };
 
 struct Bitmap {
@@ -116,6 +372,8 @@ struct Bitmap {
     uint32_t counter;                 // 位图有效位个数
     std::vector<uint8_t> bitmap;      // 位图数据
     std::vector<Block*> blocks;       // 位图在磁盘中对应的块
+    uint32_t group_size = 0;          // 每组的位数，0 表示不分组
+    std::vector<uint32_t> group_used; // 各组有效位个数
     Bitmap(uint32_t size, uint32_t offset): size(size), offset(offset), counter(0) {
         bitmap.resize(size / 8);
         blocks.resize(size / 8 / BLOCK_SIZE + 1);
@@ -140,6 +398,47 @@ struct Bitmap {
             }
         }
     }
+    /**
+     * @brief 扩大位图
+     *
+     * 新增的位都为 0，其所在的位图块位于格式化时预留的区域中，内容为零。
+     *
+     * @param new_size 新的位图大小
+     */
+    void grow(uint32_t new_size) {
+        size = new_size;
+        bitmap.resize(size / 8, 0);
+        for (uint32_t i = blocks.size(); i < size / 8 / BLOCK_SIZE + 1; ++i) {
+            blocks.push_back(Disk::read_block(i + offset));
+        }
+        if (group_size != 0) group_used.resize(groups(), 0);
+    }
+
+    /**
+     * @brief 把位图按 n 位一组划分，并统计各组的有效位个数
+     *
+     * 之后 set 和 reset 会同时更新所在组的计数。
+     *
+     * @param n 每组的位数，必须是 8 的倍数
+     */
+    void group(uint32_t n) {
+        group_size = n;
+        group_used.assign(groups(), 0);
+        for (uint32_t i = 0; i < bitmap.size(); ++i) {
+            group_used[i * 8 / group_size] += __builtin_popcount(bitmap[i]);
+        }
+    }
+
+    // 组的个数，最后一组可能不满
+    uint32_t groups() const {
+        return (size + group_size - 1) / group_size;
+    }
+
+    // 第 g 组的位数
+    uint32_t group_capacity(uint32_t g) const {
+        return std::min(size - g * group_size, group_size);
+    }
+
     /**
     * @brief 设置位图中指定位置的位为1
     *
@@ -153,6 +452,7 @@ struct Bitmap {
         bitmap[byteIndex] |= (1 << bitOffset);
         keep(i, bitmap[byteIndex]);
         ++counter;
+        if (group_size != 0) ++group_used[i / group_size];
     }
 
 /**
@@ -168,6 +468,7 @@ struct Bitmap {
         bitmap[byteIndex] &= ~(1 << bitOffset);
         keep(i, bitmap[byteIndex]);
         --counter;
+        if (group_size != 0) --group_used[i / group_size];
     }
 
 /**
@@ -206,6 +507,28 @@ struct Bitmap {
         return -1;
     }
 
+/**
+ * @brief 在第 g 组中分配一个新的位置
+ *
+ * 组内同样取第一个为0的位置，组已满时直接返回。
+ *
+ * @param g 组号
+ * @return uint32_t 分配的位置，如果该组没有可用位置，返回-1
+ */
+    uint32_t _new(uint32_t g) {
+        if (g >= groups() || group_used[g] >= group_capacity(g)) return -1;
+        uint32_t end = (g * group_size + group_capacity(g)) / 8;
+        for (uint32_t i = g * group_size / 8; i < end; ++i) {
+            uint8_t byte = bitmap[i];
+            if (byte != 0xFF) {
+                uint32_t j = __builtin_ctz(~byte);
+                set(i * 8 + j);
+                return i * 8 + j;
+            }
+        }
+        return -1;
+    }
+
 /**
  * @brief 释放指定位置
  *
@@ -227,6 +550,16 @@ struct Bitmap {
         i = i / (8 * BLOCK_SIZE);
         Disk::write_block(i + offset, blocks[i]);
     }
+    // 保存给定各位置所在的位图块，每块只写一次
+    void save(const std::vector<uint32_t>& positions) {
+        std::set<uint32_t> dirty;
+        for (uint32_t i: positions) {
+            if (i != null) dirty.insert(i / (8 * BLOCK_SIZE));
+        }
+        for (uint32_t i: dirty) {
+            Disk::write_block(i + offset, blocks[i]);
+        }
+    }
     ~Bitmap() {
         for (auto& block: blocks) {
             delete block;
@@ -284,8 +617,345 @@ struct InodesTable {
      */
     void save(uint32_t i) {
         uint32_t inodeIndex = i / INODES_PER_BLOCK;
-        Disk::write_block(i + offset, inodes_table[inodeIndex]);
+        Disk::write_block(inodeIndex + offset, inodes_table[inodeIndex]);
+    }
+
+    /**
+     * @brief 保存给定各 inode 所在的块，每块只写一次
+     *
+     * @param ids inode 编号
+     */
+    void save(const std::vector<uint32_t>& ids) {
+        std::set<uint32_t> dirty;
+        for (uint32_t i: ids) dirty.insert(i / INODES_PER_BLOCK);
+        for (uint32_t i: dirty) {
+            Disk::write_block(i + offset, inodes_table[i]);
+        }
+    }
+};
+
+/**
+ * @brief ChecksumTable 结构体
+ *
+ * 块校验和表。每个块在表中占 4 字节，保存该块最近一次写回原位置时内容的 CRC32C，
+ * 0 表示没有校验和。表常驻内存，修改过的表块在事务结束时写回；
+ * 读块时校验并统计不一致的次数。元数据块总是计算校验和，文件数据块可选。
+ * 日志区和校验和表本身不计算校验和（日志有自己的校验和）。
+ */
+struct ChecksumTable {
+    inline static uint32_t start = 0;                       // 校验和表起始块号
+    inline static uint32_t size = 0;                        // 校验和表块数，0 表示未启用
+    inline static bool data = false;                        // 文件数据块是否也计算校验和
+    inline static std::vector<uint32_t> table;              // 各块的校验和
+    inline static std::set<uint32_t> dirty;                 // 待写回的表块
+    inline static std::map<uint32_t, uint32_t> deferred;    // 事务中直接写入的数据块，落盘后才记录的校验和
+    inline static std::atomic<uint64_t> verified{0};        // 已校验的块数
+    inline static std::atomic<uint64_t> mismatches{0};      // 校验不一致的块数
+
+    // 初始化新磁盘的校验和表
+    static void format(uint32_t _start, uint32_t _size, bool _data);
+    // 载入校验和表
+    static void load(uint32_t _start, uint32_t _size, bool _data);
+    // 块写回原位置时更新其校验和
+    static void update(uint32_t block_num, const void* block, bool is_data);
+    // 事务中数据块写回原位置之前清除其校验和，新的校验和推迟到数据落盘后记录
+    static void defer(uint32_t block_num, const void* block);
+    // 记录已落盘的数据块的校验和
+    static void settle();
+    // 校验从原位置读出的块，不一致时返回 false
+    static bool verify(uint32_t block_num, const void* block);
+    // 块的内容与校验和是否一致（不计数），没有校验和时视为一致
+    static bool matches(uint32_t block_num, const void* block);
+    // 写回修改过的表块
+    static void flush();
+
+    static bool enabled() {
+        return size != 0;
+    }
+
+    // 该块是否计算校验和
+    static bool covers(uint32_t block_num) {
+        if (block_num >= start && block_num < start + size) return false;
+        if (block_num >= Journal::start && block_num < Journal::start + Journal::size) return false;
+        return block_num < table.size();
+    }
+};
+
+/**
+ * @brief Snapshot 结构体
+ *
+ * 块级增量快照。磁盘镜像的每次写入都会在变更跟踪位图中标记对应的块，
+ * save 只把上次快照之后标记过的块写入镜像之外的快照文件 <镜像>.snap.<序号>，
+ * 随后清空位图，开销与变化的块数成正比。序号 0 的快照相对于全零的镜像，
+ * 因此从全零镜像开始依次应用快照 0..n 即可还原出快照 n 时的镜像。
+ * 位图同时保存在 <镜像>.cbt 中，块第一次被标记时先写该文件再写镜像，
+ * 重启后位图仍是上次快照以来变化的块的超集；该文件丢失时下一次快照包含所有非零块。
+ */
+struct Snapshot {
+    // 快照文件头部（占一个块，其后为块号表和各块的内容，均按块对齐）
+    struct Header {
+        uint32_t magic;          // 快照文件标志
+        uint32_t sequence;       // 快照序号
+        uint32_t blocks_num;     // 镜像的块数
+        uint32_t count;          // 快照包含的块数
+        int64_t time;            // 创建时间
+    };
+
+    inline static std::vector<uint8_t> changed;     // 变更跟踪位图
+    inline static uint32_t count = 0;               // 位图中标记的块数
+    inline static uint32_t next = 0;                // 下一个快照的序号
+    inline static bool complete = true;             // 位图是否可信，否则下一次快照包含所有非零块
+    inline static int fd = -1;                      // 变更跟踪文件的文件描述符
+    static constexpr off_t TRACKING_HEADER = 3 * sizeof(uint32_t);  // 变更跟踪文件头部：标志、块数、位图是否不可信
+
+    // 新建磁盘时初始化，删除同名镜像的旧快照
+    static void format(uint32_t blocks_num);
+    // 载入磁盘时读取变更跟踪文件，找到下一个快照的序号
+    static void load(uint32_t blocks_num);
+    // 镜像扩容后扩大变更跟踪位图
+    static void grow(uint32_t blocks_num);
+    // 块即将写入镜像时标记
+    static void track(uint32_t block_num) {
+        if (block_num / 8 >= changed.size() || (changed[block_num / 8] & (1 << (block_num % 8)))) return;
+        changed[block_num / 8] |= 1 << (block_num % 8);
+        ++count;
+        if (fd >= 0) {
+            pwrite(fd, &changed[block_num / 8], 1, TRACKING_HEADER + block_num / 8);
+        }
+    }
+    // 快照文件名
+    static std::string path(uint32_t sequence) {
+        return Disk::disk_name + ".snap." + std::to_string(sequence);
+    }
+};
+
+/**
+ * @brief NamedSnapshot 结构体
+ *
+ * 命名快照（写时复制）。创建快照只分配一个新的纪元，不复制任何块；
+ * 快照之后某个块第一次被覆盖或释放之前，先把它的旧内容追加到最新快照的文件
+ * <镜像>.cow.<名字> 中。每个块记录其内容所属的纪元，纪元不小于最新快照的块
+ * （已保存过或快照之后才分配的块）直接写入，因此每个块在每个快照中最多复制一次。
+ * 从快照读块时，依次查找该快照及其之后创建的快照保存的旧内容，都没有时读取镜像。
+ */
+struct NamedSnapshot {
+    // 快照文件头部，其后为依次追加的记录：块号(4) + 块的旧内容
+    struct Header {
+        uint32_t magic;          // 快照文件标志
+        uint32_t epoch;          // 快照的纪元
+        int64_t time;            // 创建时间
+        char name[32];           // 快照名
+    };
+
+    std::string name;                               // 快照名
+    uint32_t epoch = 0;                             // 快照的纪元
+    int64_t time = 0;                               // 创建时间
+    int fd = -1;                                    // 快照文件的文件描述符
+    off_t end = sizeof(Header);                     // 下一条记录在文件中的偏移量
+    std::map<uint32_t, off_t> blocks;               // 保存的块在文件中的偏移量
+
+    inline static std::map<uint32_t, NamedSnapshot> chain;  // 按纪元排列的所有快照
+    inline static std::vector<uint32_t> epochs;             // 各块的内容所属的纪元
+    inline static uint32_t next_epoch = 1;                  // 下一个快照的纪元
+    inline static uint64_t preserved = 0;                   // 本次挂载以来复制的块数
+    inline static NamedSnapshot* view = nullptr;            // 当前命令读取的快照，为空时读取镜像
+    inline static std::map<uint32_t, Block> inodes;         // 快照视图中读取过的 inode 表块
+
+    // 新建磁盘时初始化，删除同名镜像的旧快照
+    static void format(uint32_t blocks_num);
+    // 载入磁盘时读取所有快照
+    static void load(uint32_t blocks_num);
+    // 创建快照
+    static ErrorCode create(const std::string& _name, std::ostream& response);
+    // 删除快照，其保存的块并入前一个快照
+    static ErrorCode remove(const std::string& _name, std::ostream& response);
+    // 按名字查找快照
+    static NamedSnapshot* find(const std::string& _name);
+    // 块即将被覆盖或释放时保存其旧内容
+    static void preserve(uint32_t block_num);
+    // 从当前快照视图读块
+    static void read(uint32_t block_num, void* block);
+    // 镜像扩容后扩大各块的纪元表，新增的块不属于任何快照
+    static void grow(uint32_t blocks_num) {
+        epochs.resize(blocks_num, 0);
+    }
+
+    // 块在最新快照之后分配，快照中不会引用它
+    static void born(uint32_t block_num) {
+        if (!chain.empty() && block_num < epochs.size()) {
+            epochs[block_num] = chain.rbegin()->first;
+        }
+    }
+
+    // 快照文件名
+    static std::string path(const std::string& _name) {
+        return Disk::disk_name + ".cow." + _name;
+    }
+
+    // 在作用域内切换到快照视图
+    struct View {
+        explicit View(NamedSnapshot* snapshot) {
+            view = snapshot;
+        }
+        ~View() {
+            view = nullptr;
+            inodes.clear();
+        }
+    };
+};
+
+/**
+ * @brief Scrubber 结构体
+ *
+ * 后台巡检线程。按块位图依次读出已分配的块并校验，提前发现潜在的损坏，
+ * 读取速度限制在 rate MB/s 以内；前台有待处理的请求时让出磁盘。
+ * 每次只在持有 mutex 时检查一小段块，处理请求的线程也持有同一个 mutex，
+ * 因此不会读到正在写回的块。
+ */
+struct Scrubber {
+    inline static uint32_t rate = 4;                        // 读取速度上限，单位为 MB/s，0 表示关闭
+    inline static std::mutex mutex;                         // 与请求处理互斥
+    inline static std::function<bool()> busy;               // 前台是否有待处理的请求
+    inline static std::atomic<uint32_t> position{0};        // 当前巡检到的块号
+    inline static std::atomic<uint64_t> scrubbed{0};        // 已校验的块数
+    inline static std::atomic<uint32_t> passes{0};          // 已完成的遍数
+    inline static std::atomic<uint64_t> yields{0};          // 为前台请求让出的次数
+    inline static std::set<uint32_t> bad;                   // 校验不一致的块（受 mutex 保护）
+
+    // 巡检线程的主循环
+    [[noreturn]] static void run();
+};
+
+/**
+ * @brief Reclaimer 结构体
+ *
+ * 后台回收线程。rd 删除非空目录时只把它从父目录中摘下，挂到超级块记录的孤儿链表上
+ * （链表经由目录 inode 不使用的 i_block[1] 串起），由回收线程释放其中的文件和子目录。
+ * 每批最多释放 BATCH 个 inode，释放的块和 inode 先收集起来，批末每个位图块和 inode 表块
+ * 只写一次。与巡检线程一样只在持有 Scrubber::mutex 时工作。
+ * 孤儿链表在磁盘上，中途退出后下次载入时继续回收；分配块或 inode 失败时当场回收完再分配。
+ */
+struct Reclaimer {
+    // 事务中的分配要等回收才能满足
+    struct Starved {};
+
+    static constexpr uint32_t BATCH = 256;                  // 每批最多释放的 inode 数
+    inline static std::atomic<uint32_t> pending{0};         // 等待回收的目录树数
+    inline static std::atomic<uint64_t> inodes{0};          // 已释放的 inode 数
+    inline static std::atomic<uint64_t> blocks{0};          // 已释放的块数
+    inline static std::atomic<uint64_t> batches{0};         // 已提交的批数
+
+    // 把已从父目录摘下的目录挂到孤儿链表上
+    static void orphan(uint32_t inode_id);
+    // 载入磁盘时统计孤儿链表的长度
+    static void load();
+    // 回收一批，没有待回收的目录树时返回 false；调用者须持有 Scrubber::mutex
+    static bool step();
+    // 回收全部待回收的目录树
+    static void drain();
+    // 空间不足时回收：不在事务中时立即回收，在事务中时抛出 Starved
+    static bool reclaim();
+    // 放弃的执行结束后，在事务之外回收全部目录树，并作废它写入的输出
+    static void catch_up();
+    // 回收线程的主循环
+    [[noreturn]] static void run();
+
+    /**
+     * @brief 在一个事务中执行 body，空间要等回收才够时回收后重新执行
+     *
+     * 回收的每一批单独提交，不能并入 body 的事务。事务中分配失败而孤儿链表上还有目录树时，
+     * 分配取消事务并抛出 Starved，body 已做的修改整体放弃；在事务之外回收完后，body 再执行一次。
+     * 嵌套调用时由最外层处理。
+     *
+     * @return ErrorCode body 的结果；事务超出日志区容量而被放弃时返回 EXCEEDED
+     */
+    template<typename Body>
+    static ErrorCode transact(Body&& body) {
+        if (Journal::depth > 0) return body();
+        try {
+            return Journal::transact(body);
+        } catch (const Starved&) {
+            catch_up();
+        }
+        return Journal::transact(body);
+    }
+};
+
+/**
+ * @brief 延迟直方图
+ *
+ * 按 HDR 直方图的方式分桶：小于 8 的值各占一个桶，之后每个 2 的幂区间等分为 8 个桶，
+ * 相对误差不超过 12.5%，记录一个值只需一次加法，不随样本数增长。
+ */
+struct Histogram {
+    static constexpr uint32_t SUB_BUCKETS = 8;
+    static constexpr uint32_t BUCKETS = 62 * SUB_BUCKETS;
+    uint64_t buckets[BUCKETS] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    // 值所在的桶
+    static uint32_t index(uint64_t value) {
+        if (value < SUB_BUCKETS) return value;
+        uint32_t msb = 63 - __builtin_clzll(value);
+        return (msb - 2) * SUB_BUCKETS + ((value >> (msb - 3)) & (SUB_BUCKETS - 1));
+    }
+
+    // 桶中的最小值
+    static uint64_t lower(uint32_t i) {
+        if (i < SUB_BUCKETS) return i;
+        return (uint64_t)(SUB_BUCKETS + i % SUB_BUCKETS) << (i / SUB_BUCKETS - 1);
+    }
+
+    void add(uint64_t value) {
+        ++buckets[index(value)];
+        ++count;
+        sum += value;
+        max = std::max(max, value);
+    }
+
+    // 第 p 百分位数，返回所在桶中的最大值（不超过实际的最大值）
+    uint64_t percentile(double p) const;
+};
+
+// 一种命令的统计
+struct CommandStats {
+    Histogram wait;          // 排队时间，单位为微秒
+    Histogram exec;          // 执行时间，单位为微秒
+    uint64_t reads = 0;      // 读取的块数
+    uint64_t writes = 0;     // 写入的块数
+};
+
+/**
+ * @brief 请求统计
+ *
+ * 按操作码记录每条命令的排队时间、执行时间以及读写的块数，由 stats 命令查看，stats -r 清零。
+ * 统计只在处理线程中更新和读取；块的读写计数可能来自 check 的工作线程，因此是原子的。
+ */
+struct Stats {
+    using Entry = CommandStats;
+    inline static Entry entries[(size_t)Opcode::COUNT];
+    inline static std::atomic<uint64_t> reads{0};            // 累计读取的块数
+    inline static std::atomic<uint64_t> writes{0};           // 累计写入的块数（含记入日志的块）
+    inline static uint64_t wait = 0;                        // 当前请求的排队时间，计入其第一条命令
+    inline static std::chrono::steady_clock::time_point since = std::chrono::steady_clock::now();
+
+    // 记录一条命令
+    static void record(Opcode opcode, uint64_t elapsed, uint64_t block_reads, uint64_t block_writes) {
+        Entry& entry = entries[(size_t)opcode];
+        entry.wait.add(wait);
+        entry.exec.add(elapsed);
+        entry.reads += block_reads;
+        entry.writes += block_writes;
+        wait = 0;
     }
+
+    // 输出统计表
+    static void report(std::ostream& out);
+
+    // 清零
+    static void reset();
 };
 
 extern Entry* user_log;
@@ -302,6 +972,7 @@ struct Filesystem {
     static constexpr int GET = 2;
     static constexpr int WRITE_MODE = 4;
     static constexpr int READ_MODE = 8;
+    static constexpr int DATA_MODE = 16;
 /**
  * @brief AutoBlock 结构体
  *
@@ -360,11 +1031,15 @@ struct Filesystem {
         /**
          * @brief 析构函数
          *
-         * 在析构时，如果是写入模式，将块写回磁盘，并释放块内存。
+         * 在析构时，如果是写入模式，将块写回磁盘（数据块不经过日志），并释放块内存。
          */
         ~AutoBlock() {
             if (mode & WRITE_MODE) {
-                Disk::write_block(pos, block);
+                if (mode & DATA_MODE) {
+                    Disk::write_data(pos, block);
+                } else {
+                    Disk::write_block(pos, block);
+                }
             }
             delete block;
         }
@@ -517,10 +1192,15 @@ struct Filesystem {
 
     inline static Option request_option = Option::NONE;
     inline static Option response_option = Option::NONE;
-    inline static std::stringstream response;
-    void _new(std::string name);
+    inline static ResponseStream response;
+    inline static FrameStream stream;
+    // 格式化新的磁盘镜像，镜像正被其他进程使用时返回 LOCKED
+    ErrorCode _new(std::string name);
     bool load_state = false;
-    void load(std::string name);
+    // 载入已有的磁盘镜像，镜像正被其他进程使用时返回 LOCKED
+    ErrorCode load(std::string name);
+    // 放弃事务后从磁盘重新读取超级块、位图、inode 表和根目录块
+    static void reload();
     void release();
     struct Info {
         AutoEntry last_entry;
@@ -528,6 +1208,7 @@ struct Filesystem {
         AutoEntry root_entry;
         char username[8];
         std::string data;
+        uint32_t chunk = 1024;      // data 分段传输时每段的长度
     };
     inline static pid_t current_shell_pid;
     inline static std::map<pid_t, Info> pid_map;
@@ -537,10 +1218,20 @@ struct Filesystem {
     inline static Bitmap* inodes_bitmap = nullptr;
     inline static InodesTable* inodes_table = nullptr;
     inline static Block* root = nullptr;
-    static std::pair<uint32_t, Inode*> new_inode();
+    static std::pair<uint32_t, Inode*> new_inode(uint32_t parent_id, bool directory);
+    // 块组：数据块优先从 goal_group 分配，新目录轮流放到空闲较多的块组
+    inline static uint32_t goal_group = 0;
+    inline static uint32_t last_dir_group = 0;
+    static uint32_t inode_group(uint32_t i) {
+        return i / super->superblock.group_inodes;
+    }
+    static uint32_t find_dir_group(uint32_t parent_group);
     static Inode* get_inode(uint32_t i);
     static void save_inode(uint32_t i);
     static void delete_inode(uint32_t i);
+    // 批量释放块和 inode，位图块与 inode 表块各只写一次
+    static void delete_blocks(const std::vector<uint32_t>& ids);
+    static void delete_inodes(const std::vector<uint32_t>& ids);
 /**
  * @brief 将权限码转换为文件模式
  *
@@ -606,9 +1297,10 @@ struct Filesystem {
  *
  * @param log 日志的Entry指针
  * @param contents 要写入的内容
+ * @param directory 日志所在目录的路径，日志大小变化时据此更新目录的用量
  * @return ErrorCode 操作结果的错误码
  */
-    ErrorCode write_log(Entry* log, const std::string& contents);
+    ErrorCode write_log(Entry* log, const std::string& contents, const char* directory);
 
 /**
  * @brief 读取日志内容
@@ -620,6 +1312,17 @@ struct Filesystem {
  */
     std::string cat_log(Entry* log);
 
+/**
+ * @brief 将日志内容逐块写入输出流
+ *
+ * 直接把数据块写入输出流（如绑定了数据区的响应流），不拼接中间字符串。
+ *
+ * @param log 日志的Entry指针
+ * @param out 输出流
+ * @return uint32_t 写入的字节数
+ */
+    uint32_t cat_log(Entry* log, std::ostream& out);
+
 /**
  * @brief 删除文件
  *
@@ -683,7 +1386,7 @@ struct Filesystem {
         if (inode == nullptr || !inode->is_valid) return ErrorCode::FAILURE;
         AutoBlock block(0, inode);
         if (block == nullptr) return ErrorCode::FAILURE;
-        for (auto& entry: block.elem()->entries) {
+        for (auto& entry: block.elem()->all_entries()) {
             if (entry.is_valid) {
                 names.emplace_back(entry.name);
             }
@@ -691,6 +1394,21 @@ struct Filesystem {
         return ErrorCode::SUCCESS;
     }
     ErrorCode delete_directory(Entry* entry, const char* name, Option option, const char* user = pid_map[current_shell_pid].username);
+    // 以结构化记录返回文件系统信息
+    ErrorCode info_record() {
+        if (!response.bound()) {
+            response << "info: structured records require a data arena" << std::endl;
+            return ErrorCode::FAILURE;
+        }
+        InfoRecord record{};
+        record.block_size = super->superblock.block_size;
+        record.blocks_num = super->superblock.blocks_num;
+        record.used_blocks = blocks_bitmap->counter;
+        record.inodes_num = super->superblock.inodes_num;
+        record.used_inodes = inodes_bitmap->counter;
+        response.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        return ErrorCode::SUCCESS;
+    }
     ErrorCode info(const std::string& args) {
         if (args.empty()) {
             /* TODO */
@@ -701,13 +1419,20 @@ struct Filesystem {
             response << std::left << std::setw(8) << "    Use%";
             response << std::left << "  Mounted on\n";
             response << "------------------------------------------------------------\n";
+            // 镜像的块大小可以是 1K 的整数倍，按 1K 为单位输出
+            uint64_t kilobytes = super->superblock.block_size / 1024;
             response << std::left << std::setw(10) << "simdisk";
-            response << std::right << std::setw(13) << super->superblock.blocks_num;
-            response << std::right << std::setw(8) << blocks_bitmap->counter;
-            response << std::right << std::setw(9) << super->superblock.blocks_num - blocks_bitmap->counter;
+            response << std::right << std::setw(13) << super->superblock.blocks_num * kilobytes;
+            response << std::right << std::setw(8) << blocks_bitmap->counter * kilobytes;
+            response << std::right << std::setw(9) << (super->superblock.blocks_num - blocks_bitmap->counter) * kilobytes;
             response << std::right << std::setw(7) << std::fixed << std::setprecision(2) << blocks_bitmap->counter * 100. / super->superblock.blocks_num << "%";
             response << std::left << "  /\n";
             response << "------------------------------------------------------------\n";
+            struct stat st{};
+            if (Disk::fd >= 0 && fstat(Disk::fd, &st) == 0) {
+                response << "Host usage: " << st.st_blocks / 2 << "K of a " << st.st_size / 1024 << "K image"
+                         << (Disk::punch_holes ? ", " + std::to_string(Disk::punched) + " freed blocks punched" : "") << "\n";
+            }
         }
         else if (args == "-h") {
             response << std::left << std::setw(10) << "Filesystem";
@@ -718,15 +1443,16 @@ struct Filesystem {
             response << std::left << "  Mounted on\n";
             response << "---------------------------------------------------\n";
             response << std::left << std::setw(10) << "simdisk";
-            response << std::right << std::setw(6) << "100M";
-            if (blocks_bitmap->counter < 1024) {
-                response << std::right << std::setw(7) << blocks_bitmap->counter << "K";
+            response << std::right << std::setw(5) << (uint64_t)super->superblock.blocks_num * super->superblock.block_size / (1024 * 1024) << "M";
+            uint64_t used = (uint64_t)blocks_bitmap->counter * BLOCK_SIZE, avail = (uint64_t)super->superblock.blocks_num * BLOCK_SIZE - used;
+            if (used < 1024 * 1024) {
+                response << std::right << std::setw(7) << used / 1024 << "K";
             }
             else {
-                response << std::right << std::setw(7) << std::fixed << std::setprecision(2) << blocks_bitmap->counter / 1024. << "M";
+                response << std::right << std::setw(7) << std::fixed << std::setprecision(2) << used / (1024. * 1024) << "M";
             }
-            response << std::right << std::setw(8) << std::fixed << std::setprecision(2) << 100. - blocks_bitmap->counter / 1024. << "M";
-            response << std::right << std::setw(7) << std::fixed << std::setprecision(2) << blocks_bitmap->counter / 1024. <<  "%";
+            response << std::right << std::setw(8) << std::fixed << std::setprecision(2) << avail / (1024. * 1024) << "M";
+            response << std::right << std::setw(7) << std::fixed << std::setprecision(2) << blocks_bitmap->counter * 100. / super->superblock.blocks_num <<  "%";
             response << std::left << "  /\n";
             response << "---------------------------------------------------\n";
         } else if (args == "-i") {
@@ -744,6 +1470,79 @@ struct Filesystem {
             response << std::right << std::setw(8) << std::fixed << std::setprecision(2) << inodes_bitmap->counter * 100. / super->superblock.inodes_num << "%";
             response << std::left << "  /\n";
             response << "------------------------------------------------------------\n";
+        } else if (args == "-j") {
+            if (!Journal::enabled()) {
+                response << "info: this disk has no journal" << std::endl;
+                return ErrorCode::SUCCESS;
+            }
+            response << std::left << std::setw(24) << "Journal start" << Journal::start << "\n";
+            response << std::left << std::setw(24) << "Journal blocks" << Journal::size << "\n";
+            response << std::left << std::setw(24) << "Journal head" << Journal::head << "\n";
+            response << std::left << std::setw(24) << "Next sequence" << Journal::sequence << "\n";
+            response << std::left << std::setw(24) << "Transactions committed" << Journal::committed << "\n";
+            response << std::left << std::setw(24) << "Blocks logged" << Journal::logged << "\n";
+            response << std::left << std::setw(24) << "Transactions aborted" << Journal::aborted << "\n";
+            response << std::left << std::setw(24) << "Replayed at load" << Journal::replayed << "\n";
+            response << std::left << std::setw(24) << "Durable mode" << (Journal::durable ? "on" : "off") << "\n";
+            if (Journal::durable) {
+                response << std::left << std::setw(24) << "Commit window" << Journal::window << "us\n";
+                response << std::left << std::setw(24) << "Commit batch" << Journal::batch << "\n";
+                response << std::left << std::setw(24) << "fdatasync calls" << Journal::syncs << "\n";
+                response << std::left << std::setw(24) << "Transactions synced" << Journal::synced << "\n";
+                response << std::left << std::setw(24) << "Commands acknowledged" << Journal::acknowledged << "\n";
+                response << std::left << std::setw(24) << "Largest group" << Journal::largest << "\n";
+                response << std::left << std::setw(24) << "Commands per sync" << std::fixed << std::setprecision(2)
+                         << (Journal::syncs ? Journal::acknowledged * 1. / Journal::syncs : 0.) << "\n";
+            }
+        } else if (args == "-s") {
+            if (Scrubber::rate == 0 || !ChecksumTable::enabled()) {
+                response << "info: scrubber is not running" << (ChecksumTable::enabled() ? "" : " (this disk has no block checksums)") << std::endl;
+                return ErrorCode::SUCCESS;
+            }
+            uint32_t position = Scrubber::position;
+            response << std::left << std::setw(24) << "Scrub rate" << Scrubber::rate << " MB/s\n";
+            response << std::left << std::setw(24) << "Current pass" << Scrubber::passes + 1 << ", "
+                     << std::fixed << std::setprecision(1) << position * 100. / super->superblock.blocks_num << "% (block " << position << ")\n";
+            response << std::left << std::setw(24) << "Passes completed" << Scrubber::passes << "\n";
+            response << std::left << std::setw(24) << "Blocks scrubbed" << Scrubber::scrubbed << "\n";
+            response << std::left << std::setw(24) << "Yields to requests" << Scrubber::yields << "\n";
+            response << std::left << std::setw(24) << "Bad blocks" << Scrubber::bad.size();
+            uint32_t shown = 0;
+            for (uint32_t block: Scrubber::bad) {
+                if (shown++ == 16) {
+                    response << " ...";
+                    break;
+                }
+                response << (shown == 1 ? ": " : " ") << block;
+            }
+            response << "\n";
+        } else if (args == "-r") {
+            response << std::left << std::setw(24) << "Pending trees" << Reclaimer::pending << "\n";
+            response << std::left << std::setw(24) << "Inodes reclaimed" << Reclaimer::inodes << "\n";
+            response << std::left << std::setw(24) << "Blocks reclaimed" << Reclaimer::blocks << "\n";
+            response << std::left << std::setw(24) << "Batches committed" << Reclaimer::batches << "\n";
+        } else if (args == "-g") {
+            response << std::left << std::setw(7) << "Group" << std::setw(18) << "Blocks"
+                     << std::right << std::setw(12) << "Free blocks" << std::setw(13) << "Free inodes" << "\n";
+            const Superblock& sb = super->superblock;
+            for (uint32_t g = 0; g < blocks_bitmap->groups(); ++g) {
+                uint32_t begin = g * sb.group_blocks;
+                uint32_t inodes = g < inodes_bitmap->groups() ? inodes_bitmap->group_capacity(g) - inodes_bitmap->group_used[g] : 0;
+                response << std::left << std::setw(7) << g
+                         << std::setw(18) << std::to_string(begin) + "-" + std::to_string(begin + blocks_bitmap->group_capacity(g) - 1)
+                         << std::right << std::setw(12) << blocks_bitmap->group_capacity(g) - blocks_bitmap->group_used[g]
+                         << std::setw(13) << inodes << "\n";
+            }
+        } else if (args == "-c") {
+            if (!ChecksumTable::enabled()) {
+                response << "info: this disk has no block checksums" << std::endl;
+                return ErrorCode::SUCCESS;
+            }
+            response << std::left << std::setw(24) << "Checksum table start" << ChecksumTable::start << "\n";
+            response << std::left << std::setw(24) << "Checksum table blocks" << ChecksumTable::size << "\n";
+            response << std::left << std::setw(24) << "Data blocks covered" << (ChecksumTable::data ? "yes" : "no") << "\n";
+            response << std::left << std::setw(24) << "Blocks verified" << ChecksumTable::verified << "\n";
+            response << std::left << std::setw(24) << "Mismatches" << ChecksumTable::mismatches << "\n";
         } else {
             response << "info: invalid option" << std::endl;
             return ErrorCode::FAILURE;
@@ -865,7 +1664,7 @@ struct Filesystem {
         ErrorCode err = check_entry(entry.elem(), user, Option::READ);
         if (err == ErrorCode::FAILURE) return ErrorCode::FAILURE;
         AutoBlock block(0, inode);
-        for (const auto& file: block.elem()->entries) {
+        for (const auto& file: block.elem()->all_entries()) {
             if (file.is_valid) {
                 if (is_prefix(file.name, name)) {
                     if (get_inode(file.inode_id)->type == 'd') {
@@ -880,7 +1679,10 @@ struct Filesystem {
     }
     ErrorCode ls(const std::string& path, bool with_args = false, const char *user = pid_map[current_shell_pid].username);
     ErrorCode ll(const std::string& path, bool with_args = false, const char *user = pid_map[current_shell_pid].username);
-    ErrorCode cat_data(Entry *parent, const char *name, std::string& data, const char *user = pid_map[current_shell_pid].username);
+    ErrorCode records(const char* command, const std::string& path, bool with_args = false, const char *user = pid_map[current_shell_pid].username);
+    // 由目录项和 Inode 生成结构化记录
+    static EntryRecord entry_record(const Entry& file, const Inode* inode);
+    ErrorCode cat_data(Entry *parent, const char *name, std::ostream& out, const char *user = pid_map[current_shell_pid].username);
     ErrorCode su(const std::string &username, const std::string &password) {
         if (users.find(username) == users.end()) {
             response << "su: user `" << username << "` does not exist or the user entry does not contain all the required fields" << std::endl;
@@ -921,8 +1723,12 @@ struct Filesystem {
             return ErrorCode::SUCCESS;
         }
         if (request_option == Option::CAT) {
-            std::string data;
-            err = cat_data(entry.elem(), filename.c_str(), data);
+            // 数据区容纳得下整个文件时直接写入数据区，一次往返即可完成
+            AutoEntry file(get_path_entry(path).second);
+            bool direct = file != nullptr && response.bound() && get_inode(file.elem()->inode_id)->size + 1 < response.room();
+            std::ostringstream buffer;
+            std::ostream& out = direct ? static_cast<std::ostream&>(response) : buffer;
+            err = cat_data(entry.elem(), filename.c_str(), out);
             if (err == ErrorCode::FAILURE || err == ErrorCode::FILE_NOT_FOUND || err == ErrorCode::EXCEEDED) {
                 response << "cat: cannot catch file '" << path << "': No such file or directory" << std::endl;
                 return ErrorCode::FAILURE;
@@ -933,20 +1739,52 @@ struct Filesystem {
                 response << "cat: Permission denied" << std::endl;
                 return ErrorCode::FAILURE;
             }
-            // TODO:
-            if (!data.empty()) {
-                if (data.back() != '\n') data.push_back('\n');
-            }
-            if (data.size() > 1024) {
-                response_option = Option::PATCH;
-                pid_map[current_shell_pid].data = data;
-                response << data.size();
+            if (direct) {
+                std::string_view data = response.view();
+                if (!data.empty() && data.back() != '\n') response << '\n';
             } else {
-                response << data;
+                // 超出数据区容量（或请求方没有数据区），分段传输
+                std::string data = buffer.str();
+                if (!data.empty()) {
+                    if (data.back() != '\n') data.push_back('\n');
+                }
+                uint32_t chunk = response.bound() ? response.room() - 1 : 1024;
+                if (data.size() > chunk) {
+                    response_option = Option::PATCH;
+                    pid_map[current_shell_pid].data = data;
+                    pid_map[current_shell_pid].chunk = chunk;
+                    response << data.size() << ' ' << chunk;
+                } else {
+                    response << data;
+                }
             }
             release_file(entry.elem(), filename.c_str());
             return ErrorCode::SUCCESS;
         }
+        if (request_option == Option::STREAM) {
+            // 按帧写入Shell数据区中的环形队列，Shell边收边输出
+            err = cat_data(entry.elem(), filename.c_str(), stream);
+            if (err == ErrorCode::FAILURE || err == ErrorCode::FILE_NOT_FOUND || err == ErrorCode::EXCEEDED) {
+                response << "cat: cannot catch file '" << path << "': No such file or directory" << std::endl;
+                return ErrorCode::FAILURE;
+            } else if (err == ErrorCode::FILE_NOT_MATCH) {
+                response << "cat: '" << path << "': Is a directory" << std::endl;
+                return ErrorCode::FAILURE;
+            } else if (err == ErrorCode::PERMISSION_DENIED) {
+                response << "cat: Permission denied" << std::endl;
+                return ErrorCode::FAILURE;
+            } else if (err == ErrorCode::LOCKED) {
+                response << "cat: cannot get the read lock of file '" << path << "'" << std::endl;
+                return ErrorCode::FAILURE;
+            }
+            release_file(entry.elem(), filename.c_str());
+            if (!stream) {
+                response << "cat: '" << path << "': Stream aborted" << std::endl;
+                return ErrorCode::FAILURE;
+            }
+            if (stream.last() != '\0' && stream.last() != '\n') stream << '\n';
+            return ErrorCode::SUCCESS;
+        }
         if (request_option == Option::READ) {
             err = cat_file(entry.elem(), filename.c_str(), Option::READ);
             if (err == ErrorCode::FAILURE || err == ErrorCode::FILE_NOT_FOUND || err == ErrorCode::EXCEEDED) {
@@ -1234,7 +2072,7 @@ struct Filesystem {
         std::ostringstream pwd_oss;
         pwd_oss << "    " << std::setw(8) << password << std::setfill(' ');
         std::string data = cat_log(user_log) + '\n' + user_oss.str() + pwd_oss.str();
-        write_log(user_log, data.c_str());
+        write_log(user_log, data.c_str(), "/usr");
         return ErrorCode::SUCCESS;
     }
     inline static std::map<std::string, std::string> users;
@@ -1303,34 +2141,36 @@ struct Filesystem {
         WRITE_LOCK,
         READ_LOCK,
     };
-    ErrorCode check() {
-//        std::string lock_log_data = cat_log(lock_log);
-//        std::stringstream ss(lock_log_data);
-//        std::vector<std::string> check_logs;
-//        std::string temp;
-//        while (ss >> temp) {
-//            check_logs.push_back(temp);
-//        }
-//        uint32_t cnt = lock_cnt;
-//        for (const auto& check_log: check_logs) {
-//            if (check_log.find("unlock") != std::string::npos) {
-//                --cnt;
-//                continue;
-//            }
-//            if (check_log.find("lock") != std::string::npos) {
-//                ++cnt;
-//            }
-//        }
-//        if (cnt == lock_cnt) {
-          response << "Simple OS is functioning properly.\n";
-//        } else {
-//            response << "Simple OS appears to be malfunctioning.\n";
-//            response << "Initiating repair process...\n";
-//        }
-        return ErrorCode::SUCCESS;
+    ErrorCode check(const std::string& args, const char* user = pid_map[current_shell_pid].username);
+
+    // 遍历到的目录
+    struct WalkDirectory {
+        uint32_t inode_id;       // 目录的 inode
+        uint32_t parent_id;      // 上级目录的 inode，起始目录为其自身
+        uint32_t depth;          // 相对于起始目录的深度
+        std::string path;        // 显示的路径
+    };
+    // 处理一个目录中除 . 和 .. 外的有效目录项，目录项只在调用期间有效
+    using WalkVisitor = std::function<void(const WalkDirectory& directory, const std::vector<const Entry*>& entries)>;
+    uint32_t walk(uint32_t root_id, const std::string& root_path, const WalkVisitor& visit, uint32_t& denied,
+                  const char* user = pid_map[current_shell_pid].username);
+    // 把子树用量的变化累加到目录及其所有上级目录
+    void account(uint32_t directory_id, int64_t bytes, int64_t blocks);
+    // 从根目录重新统计每个目录的子树用量，apply 为 false 时只比较，返回缓存不一致的目录数
+    uint32_t rebuild_usage(bool apply);
+    // 输出流式请求的结果时写入数据区中的环形队列，否则写入响应
+    static std::ostream& output() {
+        return request_option == Option::STREAM ? static_cast<std::ostream&>(stream) : response;
     }
+    ErrorCode dir_tree(const std::string& path, const char* user = pid_map[current_shell_pid].username);
+    ErrorCode du(const std::string& path, bool summary, const char* user = pid_map[current_shell_pid].username);
+    ErrorCode find(const std::vector<std::string>& args, const char* user = pid_map[current_shell_pid].username);
+    ErrorCode save(const std::vector<std::string>& args);
+    ErrorCode resize(const std::string& args, const char* user = pid_map[current_shell_pid].username);
     uint32_t lock_cnt = 0;
     ErrorCode lock(uint32_t i, Inode* inode, Lock lock) {
+        // 快照是只读的，读取时不需要加锁
+        if (NamedSnapshot::view) return ErrorCode::SUCCESS;
         switch(lock) {
             case Lock::WRITE_LOCK: {
                 auto [err, entry] = get_path_entry("/usr/lock/" + std::to_string(i) + ".rlock");
@@ -1350,7 +2190,7 @@ struct Filesystem {
                 if (err == ErrorCode::SUCCESS) {
                     uint32_t cnt = std::stol(cat_log(entry));
                     ++cnt;
-                    write_log(entry, std::to_string(cnt));
+                    write_log(entry, std::to_string(cnt), "/usr/lock");
                     return ErrorCode::SUCCESS;
                 }
                 std::tie(err, entry) = get_path_entry("/usr/lock/" + std::to_string(i) + ".wlock");
@@ -1389,7 +2229,7 @@ struct Filesystem {
                 auto [err, entry] = get_path_entry("/usr/lock/" + std::to_string(i) + ".rlock");
                 AutoEntry autoEntry(entry);
                 if (err == ErrorCode::SUCCESS) {
-                    write_log(entry, "1");
+                    write_log(entry, "1", "/usr/lock");
                     return ErrorCode::SUCCESS;
                 }
             } break;
@@ -1397,6 +2237,7 @@ struct Filesystem {
         return ErrorCode::SUCCESS;
     }
     ErrorCode unlock(uint32_t i, Inode* inode, Lock lock) {
+        if (NamedSnapshot::view) return ErrorCode::SUCCESS;
         switch (lock) {
             case Lock::WRITE_LOCK:{
                 del("/usr/lock/" + std::to_string(i) + ".wlock");
@@ -1416,7 +2257,7 @@ struct Filesystem {
                 if (err == ErrorCode::SUCCESS) {
                     uint32_t cnt = std::stol(cat_log(entry));
                     --cnt;
-                    if (cnt > 0) write_log(entry, std::to_string(cnt));
+                    if (cnt > 0) write_log(entry, std::to_string(cnt), "/usr/lock");
                     else {
                         del("/usr/lock/" + std::to_string(i) + ".rlock");
                         --lock_cnt;
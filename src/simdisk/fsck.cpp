@@ -0,0 +1,383 @@
+//
+// Created by eric on 12/02/23.
+//
+#include "filesystem.h"
+#include <algorithm>
+#include <chrono>
+#include <queue>
+#include <thread>
+
+namespace {
+// 一次检查最多输出的问题条数，其余只计数
+constexpr uint32_t MAX_REPORTS = 64;
+
+// inode 对块的占用
+struct Claim {
+    uint32_t block;          // 块号
+    uint32_t inode_id;       // 占用该块的 inode
+};
+
+// 一个扫描线程的结果
+struct ScanResult {
+    std::vector<Claim> claims;               // 块的占用
+    std::vector<std::string> problems;       // 发现的问题
+    uint32_t used_inodes = 0;                // 有效的 inode 数
+};
+
+/**
+ * @brief 检查一个 inode 的块映射
+ *
+ * 按 get_blocks 的规则遍历直接块、一级间接块和二级间接块，记录每个被占用的块（含间接块），
+ * 越界的指针只报告、不跟随。目录的 i_block[6..8] 存放子树用量，不是指针。
+ *
+ * @param id         inode 编号
+ * @param inode      inode
+ * @param data_start 数据区起始块号
+ * @param blocks_num 块的数量
+ * @param result     扫描结果
+ */
+void scan_mapping(uint32_t id, const Inode* inode, uint32_t data_start, uint32_t blocks_num, ScanResult& result) {
+    auto valid = [&](uint32_t block) {
+        return block >= data_start && block < blocks_num;
+    };
+    auto bad = [&](uint32_t block) {
+        result.problems.push_back("inode " + std::to_string(id) + ": bad block pointer " + std::to_string(block));
+    };
+    uint32_t data_blocks = 0;
+    // 读取一个指针块，返回其中的指针（遇到空指针结束）
+    auto pointers = [&](uint32_t block) {
+        std::vector<uint32_t> res;
+        Filesystem::AutoBlock pointer_block(block);
+        for (uint32_t pointer: pointer_block.elem()->all_pointers()) {
+            if (pointer == null) break;
+            res.push_back(pointer);
+        }
+        return res;
+    };
+    auto claim_data = [&](uint32_t block) {
+        if (!valid(block)) {
+            bad(block);
+            return;
+        }
+        result.claims.push_back({block, id});
+        ++data_blocks;
+    };
+
+    bool ended = false;
+    for (uint32_t i = 0; i <= 5 && !ended; ++i) {
+        if (inode->i_block[i] == null) {
+            ended = true;
+        } else {
+            claim_data(inode->i_block[i]);
+        }
+    }
+    std::vector<uint32_t> indirect;
+    if (inode->type != 'd' && inode->i_block[6] != null) {
+        if (valid(inode->i_block[6])) {
+            result.claims.push_back({inode->i_block[6], id});
+            indirect.push_back(inode->i_block[6]);
+        } else {
+            bad(inode->i_block[6]);
+        }
+    }
+    if (inode->type != 'd' && inode->i_block[7] != null) {
+        if (valid(inode->i_block[7])) {
+            result.claims.push_back({inode->i_block[7], id});
+            for (uint32_t block: pointers(inode->i_block[7])) {
+                if (valid(block)) {
+                    result.claims.push_back({block, id});
+                    indirect.push_back(block);
+                } else {
+                    bad(block);
+                }
+            }
+        } else {
+            bad(inode->i_block[7]);
+        }
+    }
+    if (!ended && !indirect.empty()) {
+        for (uint32_t block: indirect) {
+            for (uint32_t pointer: pointers(block)) {
+                claim_data(pointer);
+            }
+        }
+    }
+
+    if (inode->type == 'd') {
+        if (data_blocks != 1 || inode->capacity != BLOCK_SIZE) {
+            result.problems.push_back("inode " + std::to_string(id) + ": directory maps " + std::to_string(data_blocks) + " blocks");
+        }
+    } else if (inode->capacity != data_blocks * BLOCK_SIZE || inode->size > inode->capacity) {
+        result.problems.push_back("inode " + std::to_string(id) + ": size " + std::to_string(inode->size)
+            + " / capacity " + std::to_string(inode->capacity) + " does not match " + std::to_string(data_blocks) + " mapped blocks");
+    }
+}
+}
+
+/**
+ * @brief 检查文件系统的一致性
+ *
+ * 先由多个线程分段扫描 inode 表，校验每个有效 inode 的块映射；再从根目录遍历目录树，
+ * 校验 . 与 ..、目录大小和链接数，找出不可达的 inode，并核对目录缓存的子树用量；最后用扫描结果重建块位图和
+ * inode 位图，与磁盘上的位图比较。带 -r 参数时修复目录项、大小、链接数、子树用量和位图，
+ * 并把不可达的 inode 以 #<编号> 的名字挂到 /lost+found 下。
+ * 越界或重复占用的块只报告，不修复。检查前先回收完 rd 留下的目录树。
+ *
+ * @param args 参数，-r 表示修复
+ * @param user 用户名
+ * @return ErrorCode 没有问题或问题全部修复返回 SUCCESS，否则返回 FAILURE
+ */
+ErrorCode Filesystem::check(const std::string& args, const char* user) {
+    if (!args.empty() && args != "-r") {
+        response << "check: invalid option -- '" << args << "'" << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    bool repair = args == "-r";
+    if (repair && strcmp(user, "root") != 0) {
+        response << "check: Permission denied" << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    // 孤儿链表上的目录树不可达，先回收，以免被当作丢失的 inode；在事务中时由 Reclaimer::transact 回收后重新检查
+    Reclaimer::reclaim();
+
+    auto begin = std::chrono::steady_clock::now();
+    const Superblock& sb = super->superblock;
+    uint32_t data_start = sb.data_start;
+    uint32_t inodes_num = sb.inodes_num;
+    uint32_t blocks_num = sb.blocks_num;
+
+    std::vector<std::string> problems;
+    uint32_t repaired = 0;
+    auto report = [&](const std::string& problem) {
+        problems.push_back(problem);
+    };
+
+    // 第一步：多线程扫描 inode 表，校验块映射
+    uint32_t threads_num = std::clamp(std::thread::hardware_concurrency(), 1u, 8u);
+    std::vector<ScanResult> results(threads_num);
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < threads_num; ++t) {
+        threads.emplace_back([&, t] {
+            uint32_t first = (uint64_t)inodes_num * t / threads_num;
+            uint32_t last = (uint64_t)inodes_num * (t + 1) / threads_num;
+            for (uint32_t i = first; i < last; ++i) {
+                Inode* inode = get_inode(i);
+                if (!inode->is_valid) continue;
+                ++results[t].used_inodes;
+                scan_mapping(i, inode, data_start, blocks_num, results[t]);
+            }
+        });
+    }
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    std::vector<uint32_t> owner(blocks_num, null);
+    uint32_t used_inodes = 0;
+    for (auto& result: results) {
+        used_inodes += result.used_inodes;
+        for (auto& problem: result.problems) {
+            report(problem);
+        }
+        for (auto& claim: result.claims) {
+            if (owner[claim.block] != null && owner[claim.block] != claim.inode_id) {
+                report("block " + std::to_string(claim.block) + " is claimed by inodes " + std::to_string(owner[claim.block])
+                    + " and " + std::to_string(claim.inode_id));
+                continue;
+            }
+            owner[claim.block] = claim.inode_id;
+        }
+    }
+
+    // 第二步：遍历目录树，校验 . 与 ..、目录大小，统计每个 inode 被引用的次数
+    std::vector<uint32_t> refs(inodes_num, 0);
+    std::vector<bool> visited(inodes_num, false);
+    auto walk = [&](uint32_t start, uint32_t start_parent) {
+        std::queue<std::pair<uint32_t, uint32_t>> directories;
+        directories.emplace(start, start_parent);
+        visited[start] = true;
+        while (!directories.empty()) {
+            auto [id, parent] = directories.front();
+            directories.pop();
+            Inode* inode = get_inode(id);
+            // 目录的数据块无效时无法继续，问题已在扫描块映射时报告
+            if (inode->i_block[0] >= blocks_num || owner[inode->i_block[0]] != id) continue;
+            AutoBlock block(0, inode);
+            Entry* entries = block.elem()->entries;
+            if (!entries[0].is_valid || entries[0].inode_id != id || strcmp(entries[0].name, ".") != 0) {
+                report("directory inode " + std::to_string(id) + ": bad '.' entry");
+                if (repair) {
+                    entries[0].is_valid = true;
+                    entries[0].inode_id = id;
+                    strcpy(entries[0].name, ".");
+                    block.mask(WRITE_MODE);
+                    ++repaired;
+                }
+            }
+            if (!entries[1].is_valid || entries[1].inode_id != parent || strcmp(entries[1].name, "..") != 0) {
+                report("directory inode " + std::to_string(id) + ": '..' does not point to parent inode " + std::to_string(parent));
+                if (repair) {
+                    entries[1].is_valid = true;
+                    entries[1].inode_id = parent;
+                    strcpy(entries[1].name, "..");
+                    block.mask(WRITE_MODE);
+                    ++repaired;
+                }
+            }
+            uint32_t entries_num = 0;
+            for (uint32_t i = 0; i < ENTRY_PER_BLOCK; ++i) {
+                Entry& entry = entries[i];
+                if (!entry.is_valid) continue;
+                if (i >= 2) {
+                    uint32_t child = entry.inode_id;
+                    bool dangling = child >= inodes_num || !get_inode(child)->is_valid;
+                    bool cycle = !dangling && get_inode(child)->type == 'd' && visited[child];
+                    if (dangling || cycle) {
+                        report("directory inode " + std::to_string(id) + ": entry '" + entry.name + "' "
+                            + (dangling ? "points to a free inode" : "links a directory twice"));
+                        if (repair) {
+                            entry.is_valid = false;
+                            block.mask(WRITE_MODE);
+                            ++repaired;
+                            continue;
+                        }
+                    }
+                    if (!dangling) {
+                        ++refs[child];
+                        if (!cycle && get_inode(child)->type == 'd') {
+                            visited[child] = true;
+                            directories.emplace(child, id);
+                        }
+                    }
+                }
+                ++entries_num;
+            }
+            if (inode->size != entries_num * sizeof(Entry)) {
+                report("directory inode " + std::to_string(id) + ": size " + std::to_string(inode->size) + " but "
+                    + std::to_string(entries_num) + " entries");
+                if (repair) {
+                    inode->size = entries_num * sizeof(Entry);
+                    save_inode(id);
+                    ++repaired;
+                }
+            }
+        }
+    };
+    uint32_t root_id = sb.root_inode_id;
+    walk(root_id, root_id);
+
+    // 不可达的 inode：修复时挂到 /lost+found 下，并继续遍历其中的目录
+    uint32_t lost_id = null;
+    {
+        AutoBlock block(0, get_inode(root_id));
+        for (auto& entry: block.elem()->all_entries()) {
+            if (entry.is_valid && strcmp(entry.name, "lost+found") == 0 && visited[entry.inode_id]) lost_id = entry.inode_id;
+        }
+    }
+    for (uint32_t i = 0; i < inodes_num; ++i) {
+        Inode* inode = get_inode(i);
+        if (!inode->is_valid || i == root_id || refs[i] > 0 || visited[i]) continue;
+        report("inode " + std::to_string(i) + ": unreachable " + (inode->type == 'd' ? "directory" : "file"));
+        uint32_t parent = null;
+        if (repair && lost_id != null) {
+            Inode* lost = get_inode(lost_id);
+            AutoBlock block(0, lost);
+            for (auto& entry: block.elem()->all_entries()) {
+                if (entry.is_valid) continue;
+                entry.is_valid = true;
+                entry.inode_id = i;
+                snprintf(entry.name, MAX_LENGTH, "#%u", i);
+                lost->size += sizeof(Entry);
+                block.mask(WRITE_MODE);
+                save_inode(lost_id);
+                parent = lost_id;
+                ++refs[i];
+                ++repaired;
+                break;
+            }
+            if (parent == null) report("/lost+found is full, inode " + std::to_string(i) + " is not reconnected");
+        }
+        if (inode->type == 'd') {
+            // 未修复时沿用原来的 ..，只为避免把其中的内容重复报告为不可达
+            if (parent == null) {
+                AutoBlock block(0, inode);
+                parent = inode->i_block[0] == null ? i : block.elem()->entries[1].inode_id;
+            }
+            walk(i, parent);
+        }
+    }
+
+    // 链接数：目录固定为 2（根目录为 3），文件等于引用它的目录项数
+    for (uint32_t i = 0; i < inodes_num; ++i) {
+        Inode* inode = get_inode(i);
+        if (!inode->is_valid || (refs[i] == 0 && !visited[i])) continue;
+        uint32_t expected = inode->type == 'd' ? (i == root_id ? 3 : 2) : refs[i];
+        if (inode->link_cnt != expected) {
+            report("inode " + std::to_string(i) + ": link count " + std::to_string(inode->link_cnt) + ", expected " + std::to_string(expected));
+            if (repair) {
+                inode->link_cnt = expected;
+                save_inode(i);
+                ++repaired;
+            }
+        }
+    }
+
+    // 目录缓存的子树用量
+    uint32_t stale = rebuild_usage(repair);
+    if (stale > 0) {
+        report(std::to_string(stale) + " directories have stale usage totals");
+        if (repair) ++repaired;
+    }
+
+    // 第三步：用扫描结果重建位图并与磁盘上的位图比较
+    owner[sb.root_block_id] = root_id;
+    for (uint32_t i = 0; i < data_start; ++i) {
+        owner[i] = root_id;
+    }
+    auto compare = [&](Bitmap* bitmap, uint32_t size, auto&& used, const char* name) {
+        uint32_t leaked = 0, missing = 0;
+        std::set<uint32_t> dirty;
+        for (uint32_t i = 0; i < size; ++i) {
+            bool marked = bitmap->bitmap[i / 8] & (1 << (i % 8));
+            bool expected = used(i);
+            if (marked == expected) continue;
+            marked ? ++leaked : ++missing;
+            if (repair) {
+                expected ? bitmap->set(i) : bitmap->reset(i);
+                dirty.insert(i / (8 * BLOCK_SIZE));
+            }
+        }
+        // 每个被修改的位图块只写一次
+        for (uint32_t block: dirty) {
+            bitmap->save(block * 8 * BLOCK_SIZE);
+        }
+        if (leaked > 0) report(std::string(name) + " bitmap: " + std::to_string(leaked) + " marked used but not in use");
+        if (missing > 0) report(std::string(name) + " bitmap: " + std::to_string(missing) + " in use but marked free");
+        if (repair) repaired += (leaked > 0) + (missing > 0);
+    };
+    compare(blocks_bitmap, blocks_num, [&](uint32_t i) { return owner[i] != null; }, "block");
+    compare(inodes_bitmap, inodes_num, [&](uint32_t i) { return get_inode(i)->is_valid; }, "inode");
+
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    for (uint32_t i = 0; i < problems.size() && i < MAX_REPORTS; ++i) {
+        response << "check: " << problems[i] << '\n';
+    }
+    if (problems.size() > MAX_REPORTS) {
+        response << "check: ... " << problems.size() - MAX_REPORTS << " more problems\n";
+    }
+    if (ChecksumTable::mismatches > 0) {
+        response << "check: " << ChecksumTable::mismatches << " checksum mismatches detected by block reads since mount\n";
+    }
+    uint32_t used_blocks = std::count_if(owner.begin(), owner.end(), [](uint32_t id) { return id != null; });
+    response << "check: " << used_inodes << " inodes, " << used_blocks << " blocks in use; checked in "
+             << std::fixed << std::setprecision(1) << elapsed << " ms on " << threads_num << " threads\n";
+    if (problems.empty()) {
+        response << "Simple OS is functioning properly.\n";
+        return ErrorCode::SUCCESS;
+    }
+    if (repair) {
+        response << "check: " << problems.size() << " problems found, " << repaired << " repaired\n";
+        return repaired >= problems.size() ? ErrorCode::SUCCESS : ErrorCode::FAILURE;
+    }
+    response << "check: " << problems.size() << " problems found, run 'check -r' to repair\n";
+    return ErrorCode::FAILURE;
+}
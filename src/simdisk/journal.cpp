@@ -0,0 +1,311 @@
+//
+// Created by eric on 12/02/23.
+//
+#include "filesystem.h"
+#include "checksum.h"
+
+// 初始化新磁盘的日志区
+void Journal::format(uint32_t _start, uint32_t _size) {
+    start = _start;
+    size = _size;
+    head = 1;
+    sequence = 1;
+    blocks.clear();
+    freed.clear();
+    journaled.clear();
+    write_header();
+}
+
+// 写入日志头，日志头之前的事务不再重放
+void Journal::write_header() {
+    Block block{};
+    block.journal_header.magic = JOURNAL_MAGIC;
+    block.journal_header.sequence = sequence;
+    block.journal_header.start = head;
+    Disk::write_raw(start, &block);
+}
+
+/**
+ * @brief 重放日志
+ *
+ * 从日志头记录的起点开始，依次读取序号连续的事务。事务的提交块存在且校验和正确时
+ * 才将其中的块写回原位置，遇到第一个不完整的事务即停止（该事务在崩溃前未提交）。
+ * 事务不会跨越日志区末尾，因此最多读取一遍日志区。
+ *
+ * @param _start 日志区起始块号
+ * @param _size  日志区块数
+ * @return uint32_t 重放的事务数
+ */
+uint32_t Journal::recover(uint32_t _start, uint32_t _size) {
+    start = _start;
+    size = _size;
+    blocks.clear();
+    freed.clear();
+    journaled.clear();
+    replayed = 0;
+
+    Block* header = Disk::read_block(start);
+    if (header->journal_header.magic != JOURNAL_MAGIC || header->journal_header.start == 0 || header->journal_header.start >= size) {
+        delete header;
+        format(start, size);
+        return 0;
+    }
+    uint32_t pos = header->journal_header.start;
+    uint32_t seq = header->journal_header.sequence;
+    delete header;
+
+    while (true) {
+        std::vector<uint32_t> tags;
+        std::vector<Block> images;
+        uint32_t checksum = crc32c(0, &seq, sizeof(seq));
+        uint32_t p = pos;
+        bool complete = false;
+        while (p < size) {
+            Block* block = Disk::read_block(start + p);
+            if (block->descriptor.magic == JOURNAL_DESCRIPTOR && block->descriptor.sequence == seq
+                && block->descriptor.count <= JOURNAL_TAGS && p + 1 + block->descriptor.count < size) {
+                ++p;
+                for (uint32_t i = 0; i < block->descriptor.count; ++i) {
+                    Block* image = Disk::read_block(start + p++);
+                    tags.push_back(block->descriptor.blocks[i]);
+                    memcpy(&images.emplace_back(), image, BLOCK_SIZE);
+                    checksum = crc32c(checksum, &tags.back(), sizeof(uint32_t));
+                    checksum = crc32c(checksum, image->data, BLOCK_SIZE);
+                    delete image;
+                }
+                delete block;
+                continue;
+            }
+            complete = block->commit.magic == JOURNAL_COMMIT && block->commit.sequence == seq
+                && block->commit.count == tags.size() && block->commit.checksum == checksum && !tags.empty();
+            delete block;
+            ++p;
+            break;
+        }
+        if (!complete) break;
+        for (size_t i = 0; i < tags.size(); ++i) {
+            ChecksumTable::update(tags[i], &images[i], false);
+            Disk::write_raw(tags[i], &images[i]);
+        }
+        ++replayed;
+        pos = p;
+        ++seq;
+    }
+
+    ChecksumTable::flush();
+
+    // 重放的内容已写回原位置，日志从这里重新开始
+    head = pos;
+    sequence = seq;
+    write_header();
+    return replayed;
+}
+
+// 开始事务
+void Journal::begin() {
+    if (depth++ == 0) overflowed = cancelled = false;
+}
+
+// 结束事务，最外层的事务结束时提交；已取消或超出日志区容量的事务整体放弃
+void Journal::commit() {
+    if (depth == 0) return;
+    if (--depth == 0 && enabled()) {
+        if (cancelled) {
+            abort();
+        } else if (blocks.size() > capacity()) {
+            overflowed = true;
+            ++aborted;
+            abort();
+        } else {
+            flush();
+        }
+    }
+}
+
+/**
+ * @brief 放弃当前事务
+ *
+ * 事务中的元数据块和对已有数据块的改写都还没有写入磁盘，丢弃后磁盘保持上一个事务提交后的状态；
+ * 命令已改动的内存中的元数据从磁盘重新读取。直接写入的数据块只会是事务中新分配的块，
+ * 放弃后它们仍是空闲块。
+ */
+void Journal::abort() {
+    blocks.clear();
+    freed.clear();
+    allocated.clear();
+    overwrites.clear();
+    ChecksumTable::flush();
+    Filesystem::reload();
+}
+
+// 取消当前事务，最外层结束时放弃；不在事务中时没有作用
+void Journal::cancel() {
+    if (active()) cancelled = true;
+}
+
+// 一个事务最多记录的块数：描述块、块内容与提交块都要放进日志头之后的区域
+uint32_t Journal::capacity() {
+    return (size - 2) * JOURNAL_TAGS / (JOURNAL_TAGS + 1);
+}
+
+// 记录事务中修改的块，同一块只保留最新的内容
+void Journal::record(uint32_t block_num, const Block* block) {
+    memcpy(&blocks[block_num], block, BLOCK_SIZE);
+}
+
+// 读取事务中修改、暂存或等待写回的块
+bool Journal::lookup(uint32_t block_num, Block* block) {
+    for (auto* source: {&blocks, &overwrites, &checkpoints}) {
+        auto it = source->find(block_num);
+        if (it != source->end()) {
+            memcpy(block, &it->second, BLOCK_SIZE);
+            return true;
+        }
+    }
+    return false;
+}
+
+// 记录事务中释放的块
+void Journal::release(uint32_t block_num) {
+    if (active()) freed.insert(block_num);
+}
+
+// 记录事务中新分配的块，放弃事务后它们仍是空闲块，作为数据块可以立即写入
+void Journal::allocate(uint32_t block_num) {
+    if (active()) allocated.insert(block_num);
+}
+
+/**
+ * @brief 暂存事务中对已有数据块的改写
+ *
+ * 事务可能因超出日志区容量或被取消而整体放弃，已有的块在那之前写入就无法撤销，
+ * 因此先保存在内存中，提交时在元数据之前写入原位置。
+ */
+void Journal::overwrite(uint32_t block_num, const Block* block) {
+    memcpy(&overwrites[block_num], block, BLOCK_SIZE);
+}
+
+/**
+ * @brief 数据块能否不经过日志直接写入
+ *
+ * 当前事务释放的块在提交前仍属于原文件，日志中记录过的块在重放时会被旧内容覆盖；
+ * 持久化模式下已提交但尚未同步的事务释放的块，在同步之前崩溃时仍属于原文件。
+ * 这些块作为数据块写入时都必须经过日志。
+ */
+bool Journal::ordered(uint32_t block_num) {
+    return !blocks.count(block_num) && !freed.count(block_num) && !journaled.count(block_num) && !Disk::holes.count(block_num);
+}
+
+/**
+ * @brief 持久化已写入日志的事务
+ *
+ * 一次 fdatasync 同时持久化日志和此前直接写入的数据块，之后才把事务中的块写回原位置；
+ * 写回的内容在日志中已有持久的副本，因此不需要再次同步。
+ */
+void Journal::sync() {
+    if (Disk::fd >= 0) fdatasync(Disk::fd);
+    ++syncs;
+    synced += unsynced;
+    unsynced = 0;
+    ChecksumTable::settle();
+    for (auto& [block_num, content]: checkpoints) {
+        ChecksumTable::update(block_num, &content, false);
+        Disk::write_raw(block_num, &content);
+    }
+    checkpoints.clear();
+    ChecksumTable::flush();
+    Disk::punch(Disk::holes);
+    Disk::holes.clear();
+}
+
+/**
+ * @brief 提交当前事务
+ *
+ * 日志区剩余空间不足时回到日志区开头，此前的事务都必须已写回原位置，然后更新日志头。
+ * 持久化模式下写回的内容和新的日志头都要先落盘，否则崩溃后会从旧的起点重放，
+ * 用旧事务覆盖较新的内容。
+ */
+void Journal::flush() {
+    // 改写的数据块先于元数据写入原位置，与新分配的数据块一样在落盘后记录校验和
+    for (auto& [block_num, content]: overwrites) {
+        ChecksumTable::defer(block_num, &content);
+        Disk::write_raw(block_num, &content);
+    }
+    overwrites.clear();
+    allocated.clear();
+    // 非持久化模式不等待落盘，直接写入的数据块的校验和在提交时记录
+    if (!durable) ChecksumTable::settle();
+    if (blocks.empty()) {
+        if (durable) {
+            Disk::holes.insert(freed.begin(), freed.end());
+        } else {
+            Disk::punch(freed);
+        }
+        freed.clear();
+        ChecksumTable::flush();
+        return;
+    }
+    auto n = static_cast<uint32_t>(blocks.size());
+    uint32_t needed = (n + JOURNAL_TAGS - 1) / JOURNAL_TAGS + n + 1;
+    if (head + needed > size) {
+        if (durable) {
+            sync();
+            fdatasync(Disk::fd);
+        }
+        head = 1;
+        journaled.clear();
+        write_header();
+        if (durable) fdatasync(Disk::fd);
+    }
+
+    uint32_t pos = head;
+    uint32_t checksum = crc32c(0, &sequence, sizeof(sequence));
+    auto it = blocks.begin();
+    while (it != blocks.end()) {
+        Block block{};
+        block.descriptor.magic = JOURNAL_DESCRIPTOR;
+        block.descriptor.sequence = sequence;
+        auto first = it;
+        while (it != blocks.end() && block.descriptor.count < JOURNAL_TAGS) {
+            block.descriptor.blocks[block.descriptor.count++] = it->first;
+            ++it;
+        }
+        Disk::write_raw(start + pos++, &block);
+        for (auto i = first; i != it; ++i) {
+            Disk::write_raw(start + pos++, &i->second);
+            checksum = crc32c(checksum, &i->first, sizeof(uint32_t));
+            checksum = crc32c(checksum, i->second.data, BLOCK_SIZE);
+        }
+    }
+    Block commit{};
+    commit.commit.magic = JOURNAL_COMMIT;
+    commit.commit.sequence = sequence;
+    commit.commit.count = n;
+    commit.commit.checksum = checksum;
+    Disk::write_raw(start + pos++, &commit);
+
+    // 事务已完整写入日志，再写回原位置；持久化模式下等组提交同步之后再写回
+    for (auto& [block_num, content]: blocks) {
+        if (durable) {
+            checkpoints.insert_or_assign(block_num, content);
+        } else {
+            ChecksumTable::update(block_num, &content, false);
+            Disk::write_raw(block_num, &content);
+        }
+        journaled.insert(block_num);
+    }
+    if (durable) ++unsynced;
+    ChecksumTable::flush();
+    head = pos;
+    ++sequence;
+    ++committed;
+    logged += n;
+    blocks.clear();
+    // 释放的块在事务写回之后才能打洞，持久化模式下还要等到同步之后
+    if (durable) {
+        Disk::holes.insert(freed.begin(), freed.end());
+    } else {
+        Disk::punch(freed);
+    }
+    freed.clear();
+}
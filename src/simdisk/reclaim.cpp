@@ -0,0 +1,185 @@
+//
+// Created by eric on 12/16/23.
+//
+#include "filesystem.h"
+#include <chrono>
+#include <thread>
+
+using AutoBlock = Filesystem::AutoBlock;
+
+// 前台一直繁忙时最多连续让出的次数，之后仍回收一批，避免空间迟迟不能归还
+static constexpr uint32_t MAX_YIELDS = 100;
+
+namespace {
+// 一批中收集的块和 inode
+struct Batch {
+    std::vector<uint32_t> blocks;
+    std::vector<uint32_t> inodes;
+    uint32_t directories = 0;    // 改写目录项的目录数
+
+    // 一批作为一个事务提交，按最坏情况估计改写的块数：每个 inode 一个 inode 表块，每个目录一个目录块，
+    // 位图块不超过释放的块和 inode 的个数，另加超级块
+    bool full() const {
+        if (inodes.size() >= Reclaimer::BATCH) return true;
+        if (!Journal::enabled()) return false;
+        size_t bitmaps = Filesystem::blocks_bitmap->blocks.size() + Filesystem::inodes_bitmap->blocks.size();
+        return inodes.size() + directories + std::min(bitmaps, blocks.size() + inodes.size()) + 1 >= Journal::capacity();
+    }
+};
+
+/**
+ * @brief 把目录中的文件和子目录放入批中，并把对应的目录项标记为无效
+ *
+ * 批满时返回 false，目录中剩下的内容留到下一批。标记过的目录项在返回前写回，
+ * 并且总是先于位图写入，因此孤儿树中有效的目录项始终指向尚未释放的 inode。
+ *
+ * @param directory_id 目录的 inode
+ * @param batch 当前批
+ * @return bool 目录已清空时返回 true
+ */
+bool clear(uint32_t directory_id, Batch& batch) {
+    ++batch.directories;
+    Inode* inode = Filesystem::get_inode(directory_id);
+    AutoBlock block(0, inode);
+    bool done = true, dirty = false;
+    for (auto& entry: block.elem()->all_entries()) {
+        if (!entry.is_valid || strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) continue;
+        if (batch.full()) {
+            done = false;
+            break;
+        }
+        Inode* child = Filesystem::get_inode(entry.inode_id);
+        if (child->type == 'd') {
+            if (!clear(entry.inode_id, batch)) {
+                done = false;
+                break;
+            }
+            batch.blocks.push_back(child->i_block[0]);
+        } else {
+            std::vector<uint32_t> data = get_blocks(child);
+            batch.blocks.insert(batch.blocks.end(), data.begin(), data.end());
+            for (uint32_t i = 6; i < 9; ++i) batch.blocks.push_back(child->i_block[i]);
+        }
+        batch.inodes.push_back(entry.inode_id);
+        entry.is_valid = false;
+        dirty = true;
+    }
+    if (dirty) block.save();
+    return done;
+}
+}
+
+/**
+ * @brief 把已从父目录摘下的目录挂到孤儿链表的头部
+ *
+ * 与摘下目录项在同一个事务中写入，崩溃后目录树要么仍在原处，要么在孤儿链表上。
+ *
+ * @param inode_id 目录的 inode
+ */
+void Reclaimer::orphan(uint32_t inode_id) {
+    Superblock& sb = Filesystem::super->superblock;
+    Inode* inode = Filesystem::get_inode(inode_id);
+    inode->i_block[1] = sb.orphan_inode;
+    Filesystem::save_inode(inode_id);
+    sb.orphan_inode = inode_id;
+    Filesystem::save_block(0, Filesystem::super);
+    ++pending;
+}
+
+// 载入磁盘时统计孤儿链表的长度，最多走 inode 数量那么多步，防止损坏的链表中出现环
+void Reclaimer::load() {
+    const Superblock& sb = Filesystem::super->superblock;
+    uint32_t n = 0;
+    for (uint32_t id = sb.orphan_inode; id != 0 && id < sb.inodes_num && n < sb.inodes_num; ++n) {
+        id = Filesystem::get_inode(id)->i_block[1];
+    }
+    pending = n;
+}
+
+/**
+ * @brief 回收一批
+ *
+ * 从孤儿链表头部的目录树中收集最多 BATCH 个 inode 及其数据块，一次性清除位图；
+ * 目录树清空后释放根目录并把它从链表中取下。一批作为一个事务提交，批的大小同时受日志区容量限制。
+ *
+ * @return bool 没有待回收的目录树，或这一批仍超出日志区容量而被放弃时返回 false
+ */
+bool Reclaimer::step() {
+    Superblock& sb = Filesystem::super->superblock;
+    if (sb.orphan_inode == 0) {
+        pending = 0;
+        return false;
+    }
+    Batch batch;
+    ErrorCode code = Journal::transact([&] {
+        uint32_t root_id = sb.orphan_inode;
+        Inode* root = Filesystem::get_inode(root_id);
+        if (clear(root_id, batch)) {
+            batch.blocks.push_back(root->i_block[0]);
+            batch.inodes.push_back(root_id);
+            sb.orphan_inode = root->i_block[1];
+            Filesystem::save_block(0, Filesystem::super);
+            if (pending > 0) --pending;
+        }
+        Filesystem::delete_blocks(batch.blocks);
+        Filesystem::delete_inodes(batch.inodes);
+        return ErrorCode::SUCCESS;
+    });
+    if (code != ErrorCode::SUCCESS) return false;
+    inodes += batch.inodes.size();
+    blocks += std::count_if(batch.blocks.begin(), batch.blocks.end(), [](uint32_t i) { return i != null; });
+    ++batches;
+    return true;
+}
+
+// 回收全部待回收的目录树，调用者须持有 Scrubber::mutex；一批超出日志区容量时不再重试，剩下的目录树留在孤儿链表上
+void Reclaimer::drain() {
+    while (step()) {}
+    pending = 0;
+}
+
+/**
+ * @brief 空间不足时回收孤儿链表上的目录树
+ *
+ * 每一批都要单独提交，因此只在事务之外立即回收；在事务中时取消事务并抛出 Starved，
+ * 由 Reclaimer::transact 在事务之外回收后重新执行。
+ *
+ * @return bool 已回收、可以重新分配时返回 true
+ */
+bool Reclaimer::reclaim() {
+    if (pending == 0) return false;
+    if (Journal::active()) {
+        Journal::cancel();
+        throw Starved{};
+    }
+    drain();
+    return true;
+}
+
+// 放弃的执行写入的输出作废，在事务之外回收完再重新执行
+void Reclaimer::catch_up() {
+    drain();
+    Filesystem::response.str("");
+    Filesystem::response_option = Option::NONE;
+}
+
+/**
+ * @brief 回收线程的主循环
+ *
+ * 没有待回收的目录树时休眠；有时先等前台请求处理完（最多让出 MAX_YIELDS 次），
+ * 再在锁内回收一批。
+ */
+void Reclaimer::run() {
+    while (true) {
+        if (pending == 0 || Filesystem::super == nullptr) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        for (uint32_t i = 0; i < MAX_YIELDS && Scrubber::busy && Scrubber::busy(); ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::lock_guard<std::mutex> lock(Scrubber::mutex);
+        // 一批超出日志区容量时不再重试，剩下的目录树留在孤儿链表上
+        if (!step()) pending = 0;
+    }
+}
@@ -0,0 +1,341 @@
+//
+// Created by eric on 12/02/23.
+//
+
+#ifndef SIMPLE_OS_RESPONSE_H
+#define SIMPLE_OS_RESPONSE_H
+#include "../common/common.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+
+/**
+ * @brief ResponseBuffer 类
+ *
+ * 响应数据的输出缓冲区。绑定数据区后，输出直接写入请求方的共享内存，
+ * 避免在服务端拼接中间字符串；未绑定时写入内部字符串。
+ */
+class ResponseBuffer : public std::streambuf {
+public:
+    /**
+     * @brief 绑定数据区
+     *
+     * 末尾保留一个字节用于写入结束符，便于请求方按C字符串读取。
+     *
+     * @param base     数据区起始地址
+     * @param capacity 数据区容量
+     */
+    void bind(char* base, size_t capacity) {
+        arena = base;
+        setp(base, base + capacity - 1);
+        spill.clear();
+    }
+
+    /**
+     * @brief 解除数据区绑定，之后的输出写入内部字符串
+     */
+    void unbind() {
+        arena = nullptr;
+        setp(nullptr, nullptr);
+        spill.clear();
+    }
+
+    bool bound() const {
+        return arena != nullptr;
+    }
+
+    // 已写入的数据长度
+    size_t size() const {
+        return bound() ? pptr() - pbase() : spill.size();
+    }
+
+    // 数据区剩余可写入的长度，未绑定时不受限制
+    size_t room() const {
+        return bound() ? epptr() - pptr() : std::string::npos;
+    }
+
+    // 已写入数据的只读视图
+    std::string_view view() const {
+        return bound() ? std::string_view(pbase(), pptr() - pbase()) : std::string_view(spill);
+    }
+
+    // 清空已写入的数据，保持绑定状态不变
+    void reset() {
+        if (bound()) {
+            setp(pbase(), epptr());
+            *pbase() = '\0';
+        } else {
+            spill.clear();
+        }
+    }
+
+    // 在数据末尾写入结束符（结束符不计入长度）
+    void terminate() {
+        if (bound()) *pptr() = '\0';
+    }
+
+    // 将调用方已直接写入数据区的 n 字节计入已写入的数据
+    void commit(size_t n) {
+        if (bound()) pbump(static_cast<int>(std::min<size_t>(n, epptr() - pptr())));
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        // 数据区已满
+        if (bound()) return traits_type::eof();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            spill.push_back(traits_type::to_char_type(ch));
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        if (!bound()) {
+            spill.append(s, n);
+            return n;
+        }
+        std::streamsize length = std::min<std::streamsize>(n, epptr() - pptr());
+        memcpy(pptr(), s, length);
+        pbump(static_cast<int>(length));
+        return length;
+    }
+
+private:
+    char* arena = nullptr;     // 绑定的数据区
+    std::string spill;         // 未绑定数据区时的输出
+};
+
+/**
+ * @brief ResponseStream 类
+ *
+ * 服务端响应输出流，保留 stringstream 的 str()/str("") 用法。
+ * 数据区写满后流进入失败状态，由调用方检查 fail() 处理。
+ */
+class ResponseStream : public std::ostream {
+public:
+    ResponseStream() : std::ostream(nullptr) {
+        rdbuf(&buffer);
+    }
+
+    void bind(char* base, size_t capacity) {
+        buffer.bind(base, capacity);
+        std::ostream::clear();
+    }
+
+    void unbind() {
+        buffer.unbind();
+        std::ostream::clear();
+    }
+
+    bool bound() const {
+        return buffer.bound();
+    }
+
+    size_t size() const {
+        return buffer.size();
+    }
+
+    size_t room() const {
+        return buffer.room();
+    }
+
+    std::string_view view() const {
+        return buffer.view();
+    }
+
+    void terminate() {
+        buffer.terminate();
+    }
+
+    void commit(size_t n) {
+        buffer.commit(n);
+    }
+
+    std::string str() const {
+        return std::string(buffer.view());
+    }
+
+    // 清空并写入新的内容
+    void str(const std::string& s) {
+        buffer.reset();
+        std::ostream::clear();
+        write(s.data(), static_cast<std::streamsize>(s.size()));
+    }
+
+private:
+    ResponseBuffer buffer;
+};
+
+/**
+ * @brief FrameBuffer 类
+ *
+ * 流式响应的输出缓冲区。数据按 FRAME_SIZE 分帧写入数据区中的环形队列，
+ * 帧写满即发布给Shell；队列中未取走的帧达到 FRAME_NUM 时等待Shell归还信用，
+ * 因此无论文件多大，服务端占用的内存都是有界的。
+ */
+class FrameBuffer : public std::streambuf {
+public:
+    // Shell长时间不取帧时中止传输的超时时间
+    static constexpr std::chrono::seconds timeout{5};
+    // 一个流累计等待信用的上限；Shell一直只取走少量帧时，服务端也不会被无限期占用
+    static constexpr std::chrono::seconds stall_limit{30};
+    // 等待信用时两次检查之间的最长间隔，单位为微秒
+    static constexpr useconds_t max_pause = 10000;
+
+    /**
+     * @brief 打开流，从数据区当前的帧位置开始写入
+     *
+     * @param _arena Shell的数据区
+     * @return true  成功取得第一帧
+     * @return false Shell超时未归还信用，流已中止
+     */
+    bool open(Arena* _arena) {
+        arena = _arena;
+        head = arena->head.load(std::memory_order_acquire);
+        last_char = '\0';
+        stalled = std::chrono::steady_clock::duration::zero();
+        return begin_frame();
+    }
+
+    bool opened() const {
+        return arena != nullptr;
+    }
+
+    // 最后写入的字符
+    char last() const {
+        return last_char;
+    }
+
+    /**
+     * @brief 关闭流
+     *
+     * 发布最后一个未满的帧，再标记流已结束，Shell据此判断不再有新的帧。
+     */
+    void close() {
+        if (arena == nullptr) return;
+        if (pptr() > pbase()) publish();
+        arena->state.store(StreamState::CLOSED, std::memory_order_release);
+        arena = nullptr;
+        setp(nullptr, nullptr);
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (arena == nullptr) return traits_type::eof();
+        publish();
+        if (!begin_frame()) return traits_type::eof();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+            last_char = traits_type::to_char_type(ch);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        std::streamsize written = 0;
+        while (written < n) {
+            if (arena == nullptr) break;
+            if (pptr() == epptr()) {
+                publish();
+                if (!begin_frame()) break;
+            }
+            std::streamsize length = std::min<std::streamsize>(n - written, epptr() - pptr());
+            memcpy(pptr(), s + written, length);
+            pbump(static_cast<int>(length));
+            written += length;
+        }
+        if (written > 0) last_char = s[written - 1];
+        return written;
+    }
+
+private:
+    // 发布当前帧
+    void publish() {
+        arena->frame_length[head % FRAME_NUM] = pptr() - pbase();
+        ++head;
+        arena->head.store(head, std::memory_order_release);
+        setp(nullptr, nullptr);
+    }
+
+    /**
+     * @brief 等待Shell归还信用后取得下一帧
+     *
+     * 等待间隔从 100 微秒起逐次加倍，Shell取走帧后恢复。Shell超过 timeout 没有取帧，
+     * 或者这个流累计等待超过 stall_limit 时中止流。
+     */
+    bool begin_frame() {
+        uint32_t tail = arena->tail.load(std::memory_order_acquire);
+        if (head - tail >= FRAME_NUM) {
+            auto start = std::chrono::steady_clock::now();
+            auto deadline = start + timeout;
+            useconds_t pause = 100;
+            while (head - tail >= FRAME_NUM) {
+                usleep(pause);
+                auto now = std::chrono::steady_clock::now();
+                uint32_t current = arena->tail.load(std::memory_order_acquire);
+                if (current != tail) {
+                    tail = current;
+                    deadline = now + timeout;
+                    pause = 100;
+                } else {
+                    pause = std::min<useconds_t>(pause * 2, max_pause);
+                }
+                if (now > deadline || stalled + (now - start) > stall_limit) {
+                    arena->state.store(StreamState::ABORTED, std::memory_order_release);
+                    arena = nullptr;
+                    setp(nullptr, nullptr);
+                    return false;
+                }
+            }
+            stalled += std::chrono::steady_clock::now() - start;
+        }
+        char* frame = arena->frame(head);
+        setp(frame, frame + FRAME_SIZE);
+        return true;
+    }
+
+    Arena* arena = nullptr;     // 当前写入的数据区
+    uint32_t head = 0;          // 已发布的帧数
+    char last_char = '\0';      // 最后写入的字符
+    std::chrono::steady_clock::duration stalled{}; // 这个流已经等待信用的时间
+};
+
+/**
+ * @brief FrameStream 类
+ *
+ * 服务端流式响应的输出流，写入失败（流被中止）时进入失败状态。
+ */
+class FrameStream : public std::ostream {
+public:
+    FrameStream() : std::ostream(nullptr) {
+        rdbuf(&buffer);
+    }
+
+    void open(Arena* arena) {
+        std::ostream::clear();
+        if (!buffer.open(arena)) setstate(std::ios::badbit);
+    }
+
+    bool opened() const {
+        return buffer.opened();
+    }
+
+    char last() const {
+        return buffer.last();
+    }
+
+    void close() {
+        buffer.close();
+    }
+
+private:
+    FrameBuffer buffer;
+};
+
+#endif //SIMPLE_OS_RESPONSE_H
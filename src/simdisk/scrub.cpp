@@ -0,0 +1,64 @@
+//
+// Created by eric on 12/02/23.
+//
+#include "filesystem.h"
+#include <chrono>
+#include <thread>
+
+// 每次持有锁时最多校验的块数与最多扫描的位图位数
+static constexpr uint32_t SCRUB_BLOCKS = 64;
+#define SCRUB_BITS (8 * BLOCK_SIZE)
+
+/**
+ * @brief 巡检线程的主循环
+ *
+ * 每轮先等前台请求处理完，再在锁内从当前位置开始校验最多 SCRUB_BLOCKS 个已分配的块，
+ * 最后按读取的字节数休眠，使平均速度不超过 rate MB/s。块直接从磁盘读出，
+ * 不经过事务缓存，也不计入块读取路径的校验统计。
+ */
+void Scrubber::run() {
+    Block block;
+    while (true) {
+        if (rate == 0 || !ChecksumTable::enabled() || Filesystem::blocks_bitmap == nullptr) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            continue;
+        }
+        while (busy && busy()) {
+            ++yields;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        uint32_t checked = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            const Bitmap* bitmap = Filesystem::blocks_bitmap;
+            uint32_t blocks_num = Filesystem::super->superblock.blocks_num;
+            uint32_t i = position;
+            for (uint32_t scanned = 0; scanned < SCRUB_BITS && checked < SCRUB_BLOCKS && i < blocks_num; ++scanned, ++i) {
+                if (!(bitmap->bitmap[i / 8] & (1 << (i % 8))) || !ChecksumTable::covers(i) || ChecksumTable::table[i] == 0) continue;
+                if (pread(Disk::fd, &block, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) != BLOCK_SIZE) continue;
+                ++checked;
+                if (ChecksumTable::matches(i, &block)) {
+                    // 块已被重写，之前记录的损坏不再存在
+                    bad.erase(i);
+                } else if (bad.insert(i).second) {
+                    printf("Simdisk: scrubber found a checksum mismatch in block %u\n", i);
+                }
+            }
+            if (i >= blocks_num) {
+                i = 0;
+                ++passes;
+            }
+            position = i;
+        }
+        scrubbed += checked;
+
+        // 按速度上限休眠
+        auto budget = std::chrono::duration<double>((double)checked * BLOCK_SIZE / ((double)rate * 1024 * 1024));
+        auto elapsed = std::chrono::steady_clock::now() - begin;
+        if (budget > elapsed) {
+            std::this_thread::sleep_for(budget - elapsed);
+        }
+    }
+}
@@ -2,21 +2,40 @@
 // Created by eric on 10/19/23.
 //
 #include "filesystem.h"
+#include "audit.h"
+#include "trace.h"
+#include <charconv>
 sem_t semaphore;
 struct Message {
     pid_t pid;
     uint32_t id;
     std::string command;
     Option option;
+    bool binary;             // command 是否为二进制编码的命令
+    std::chrono::steady_clock::time_point queued{};         // 进入消息队列的时间
+
+    // 用于日志输出的命令文本
+    std::string text() const {
+        if (!binary) return command;
+        Command decoded;
+        if (!Command::decode(command.data(), command.size(), decoded)) return "<malformed>";
+        return decoded.text();
+    }
 };
-bool state = false;
 std::queue<Message> message_queue;
 std::mutex mtx;
 Filesystem fs;
 int shmId, semId, parSemId;
 SharedMemory* sharedMemory;
+// Shell的数据区在服务端的映射。容量按共享内存段的实际大小算出，段中的 capacity 可被Shell改写，服务端不使用
+struct ArenaMapping {
+    Arena* arena;
+    uint32_t capacity;
+};
+// 各Shell的数据区（由Shell创建，注册时附加到服务端）
+std::map<pid_t, ArenaMapping> arenas;
 
-static std::string to_string(Option option) {
+[[maybe_unused]] static std::string to_string(Option option) {
     switch(option) {
         case Option::NONE: return "NONE";
         case Option::NEW: return "NEW";
@@ -32,6 +51,8 @@ static std::string to_string(Option option) {
         case Option::SWITCH: return "SWITCH";
         case Option::PATCH: return "PATCH";
         case Option::TAB: return "TAB";
+        case Option::STREAM: return "STREAM";
+        case Option::BATCH: return "BATCH";
         default: return "Unknown Option";
     }
 };
@@ -42,142 +63,518 @@ bool is_prefix(const std::string& str, const std::string& prefix) {
     std::string substring = str.substr(0, prefix.length());
     return substring == prefix;
 }
+/**
+ * @brief 分离Shell的数据区
+ *
+ * @param pid Shell进程ID
+ */
+void detach_arena(pid_t pid) {
+    auto it = arenas.find(pid);
+    if (it == arenas.end()) return;
+    Filesystem::response.unbind();
+    shmdt(it->second.arena);
+    arenas.erase(it);
+}
+
+/**
+ * @brief 附加Shell的数据区
+ *
+ * Shell注册时在请求中携带其数据区的共享内存ID，旧版本Shell不携带，此时退回到定长响应。
+ * 同一Shell再次注册时先分离原来的数据区。ID 不是合法的数字或共享内存段小于数据区头部时不附加。
+ *
+ * @param pid     Shell进程ID
+ * @param arenaId 数据区共享内存ID的字符串
+ */
+void attach_arena(pid_t pid, const std::string& arenaId) {
+    detach_arena(pid);
+    if (arenaId.empty()) return;
+    int id = -1;
+    const char* end = arenaId.data() + arenaId.size();
+    auto [last, error] = std::from_chars(arenaId.data(), end, id);
+    if (error != std::errc() || last != end || id < 0) return;
+    shmid_ds info{};
+    if (shmctl(id, IPC_STAT, &info) != 0 || info.shm_segsz <= Arena::segment_size(0)) return;
+    void* address = shmat(id, nullptr, 0);
+    if (address == (void*)-1) return;
+    size_t capacity = std::min<size_t>(info.shm_segsz - Arena::segment_size(0), UINT32_MAX);
+    arenas[pid] = {static_cast<Arena*>(address), static_cast<uint32_t>(capacity)};
+}
 #include <chrono>
 #include <ctime>
+#include <deque>
 #include <iomanip>
-ErrorCode simdisk(const Message& msg) {
-    fs.current_shell_pid = msg.pid;
-    if (msg.option == Option::NEW) {
-        fs.new_shell();
+/**
+ * @brief 进入路径指定的快照
+ *
+ * 路径以 @快照名 开头时切换到该快照的只读视图，并把路径改写为快照中的绝对路径。
+ *
+ * @param command 命令名（用于错误信息）
+ * @param path    路径
+ * @param view    快照视图，命令结束时随之销毁
+ * @return 快照不存在时返回 false
+ */
+static bool enter_snapshot(const char* command, std::string& path, std::unique_ptr<NamedSnapshot::View>& view) {
+    if (path.empty() || path[0] != '@') return true;
+    auto slash = path.find('/');
+    std::string name = path.substr(1, slash == std::string::npos ? std::string::npos : slash - 1);
+    NamedSnapshot* snapshot = NamedSnapshot::find(name);
+    if (snapshot == nullptr) {
+        fs.response << command << ": snapshot '" << name << "' does not exist" << std::endl;
+        return false;
+    }
+    path = slash == std::string::npos ? "/" : path.substr(slash);
+    view = std::make_unique<NamedSnapshot::View>(snapshot);
+    return true;
+}
+// 各命令的处理函数
+static ErrorCode do_none(const Command&) {
+    return ErrorCode::SUCCESS;
+}
+static ErrorCode do_cat(const Command& command) {
+    if (command.args.empty()) {
+        fs.response << "cat: missing operand" << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    std::string path = command.args[0];
+    std::unique_ptr<NamedSnapshot::View> view;
+    if (!enter_snapshot("cat", path, view)) return ErrorCode::FAILURE;
+    return fs.cat(path);
+}
+static ErrorCode do_cd(const Command& command) {
+    return fs.cd(command.args.empty() ? "" : command.args[0]);
+}
+static ErrorCode do_check(const Command& command) {
+    return fs.check(command.args.empty() ? "" : command.args[0]);
+}
+static ErrorCode do_copy(const Command& command) {
+    if (command.args.size() != 2) return ErrorCode::SUCCESS;
+    const std::string& src = command.args[0];
+    const std::string& dst = command.args[1];
+    std::string prefix = "<host>";
+    if (is_prefix(dst, "@")) {
+        fs.response << "copy: snapshots are read-only" << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    if (is_prefix(src, prefix)) {
+        return fs.copy_host(src.substr(prefix.length()), dst);
+    } else if (is_prefix(dst, prefix)) {
+        std::string path = src;
+        std::unique_ptr<NamedSnapshot::View> view;
+        if (!enter_snapshot("copy", path, view)) return ErrorCode::FAILURE;
+        return fs.copy_to_host(path, dst.substr(prefix.length()));
+    } else if (is_prefix(src, "@")) {
+        fs.response << "copy: files in a snapshot can only be copied to <host>" << std::endl;
+        return ErrorCode::FAILURE;
+    } else {
+        return fs.copy(src, dst);
+    }
+}
+static ErrorCode do_del(const Command& command) {
+    for (const auto& path: command.args) {
+        ErrorCode err = fs.del(path);
+        if (err == ErrorCode::FAILURE) return ErrorCode::FAILURE;
+    }
+    return ErrorCode::SUCCESS;
+}
+static ErrorCode do_dir(const Command& command) {
+    std::string path = command.args.empty() ? "" : command.args[0];
+    std::unique_ptr<NamedSnapshot::View> view;
+    if (!enter_snapshot("dir", path, view)) return ErrorCode::FAILURE;
+    if (command.flags & FLAG_RECURSIVE) return fs.dir_tree(path);
+    if (command.flags & FLAG_RECORD) return fs.records("dir", path);
+    return fs.dir(path);
+}
+static ErrorCode do_du(const Command& command) {
+    std::string path = command.args.empty() ? "" : command.args[0];
+    std::unique_ptr<NamedSnapshot::View> view;
+    if (!enter_snapshot("du", path, view)) return ErrorCode::FAILURE;
+    return fs.du(path, command.flags & FLAG_RECURSIVE);
+}
+static ErrorCode do_find(const Command& command) {
+    std::vector<std::string> args = command.args;
+    std::unique_ptr<NamedSnapshot::View> view;
+    if (!args.empty() && !enter_snapshot("find", args[0], view)) return ErrorCode::FAILURE;
+    return fs.find(args);
+}
+static ErrorCode do_info(const Command& command) {
+    if (command.flags & FLAG_RECORD) return fs.info_record();
+    return fs.info(command.args.empty() ? "" : command.args[0]);
+}
+static ErrorCode do_ls(const Command& command) {
+    std::string path = command.args.empty() ? "" : command.args[0];
+    std::unique_ptr<NamedSnapshot::View> view;
+    if (!enter_snapshot("ls", path, view)) return ErrorCode::FAILURE;
+    return fs.ls(path, command.flags & FLAG_RECURSIVE);
+}
+static ErrorCode do_ll(const Command& command) {
+    std::string path = command.args.empty() ? "" : command.args[0];
+    std::unique_ptr<NamedSnapshot::View> view;
+    if (!enter_snapshot("ll", path, view)) return ErrorCode::FAILURE;
+    if (command.flags & FLAG_RECORD) return fs.records("ll", path, false);
+    return fs.ll(path, command.flags & FLAG_RECURSIVE);
+}
+static ErrorCode do_log(const Command& command) {
+    if (command.args.empty()) {
+        fs.response << std::left << std::setw(24) << "Audit log" << AuditLog::path << "\n";
+        fs.response << std::left << std::setw(24) << "Level" << AuditLog::name((AuditLog::Level)AuditLog::level.load()) << "\n";
+        fs.response << std::left << std::setw(24) << "Records written" << AuditLog::written << "\n";
+        fs.response << std::left << std::setw(24) << "Records dropped" << AuditLog::dropped << "\n";
         return ErrorCode::SUCCESS;
     }
-    std::vector<std::string> args = split_command(msg.command);
-    if (msg.option == Option::PATCH) {
-        uint32_t i = std::stoul(args[1]);
-        fs.response << fs.pid_map[fs.current_shell_pid].data.substr(i * 1024, 1024);
+    AuditLog::Level level;
+    if (command.args.size() != 1 || !AuditLog::parse(command.args[0], level)) {
+        fs.response << "usage: log [off | audit | trace]" << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    if (strcmp(fs.pid_map[fs.current_shell_pid].username, "root") != 0) {
+        fs.response << "log: Permission denied" << std::endl;
+        return ErrorCode::PERMISSION_DENIED;
+    }
+    AuditLog::level = level;
+    return ErrorCode::SUCCESS;
+}
+static ErrorCode do_md(const Command& command) {
+    for (const auto& path: command.args) {
+        ErrorCode err = fs.md(path);
+        if (err == ErrorCode::FAILURE) return ErrorCode::FAILURE;
+    }
+    return ErrorCode::SUCCESS;
+}
+static ErrorCode do_newfile(const Command& command) {
+    for (const auto& path: command.args) {
+        ErrorCode err = fs.newfile(path);
+        if (err == ErrorCode::FAILURE) return ErrorCode::FAILURE;
+    }
+    return ErrorCode::SUCCESS;
+}
+static ErrorCode do_rd(const Command& command) {
+    for (const auto& path: command.args) {
+        ErrorCode err = fs.rd(path);
+        if (err == ErrorCode::FAILURE) return ErrorCode::FAILURE;
+    }
+    return ErrorCode::SUCCESS;
+}
+static ErrorCode do_resize(const Command& command) {
+    if (command.args.size() != 1) {
+        fs.response << "usage: resize <size>[K|M|G]" << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    return fs.resize(command.args[0]);
+}
+static ErrorCode do_save(const Command& command) {
+    return fs.save(command.args);
+}
+static ErrorCode do_stats(const Command& command) {
+    if (command.args.empty()) {
+        Stats::report(fs.response);
         return ErrorCode::SUCCESS;
     }
-    if (msg.option == Option::TAB) {
-        return fs.tab(args.back());
+    if (command.args.size() == 1 && command.args[0] == "-r") {
+        Stats::reset();
+        fs.response << "stats: counters reset" << std::endl;
+        return ErrorCode::SUCCESS;
     }
-    fs.request_option = msg.option;
-    if (args[0] == "cat") {
-        return fs.cat(args[1]);
-    } else if (args[0] == "cd") {
-        if (args.size() == 1) {
-            return fs.cd("");
-        } else {
-            return fs.cd(args[1]);
-        }
-    } else if (args[0] == "check") {
-        return fs.check();
-    } else if (args[0] == "copy") {
-        if (args.size() == 3) {
-            std::string prefix = "<host>";
-            if (is_prefix(args[1], prefix)) {
-                return fs.copy_host(args[1].substr(prefix.length()), args[2]);
-            } else if (is_prefix(args[2], prefix)) {
-                return fs.copy_to_host(args[1], args[2].substr(prefix.length()));
-            } else {
-                return fs.copy(args[1], args[2]);
-            }
-        }
-    } else if (args[0] == "del") {
-        for (int i = 1; i < args.size(); ++i) {
-            ErrorCode err = fs.del(args[i]);
-            if (err == ErrorCode::FAILURE) return ErrorCode::FAILURE;
+    fs.response << "usage: stats [-r]" << std::endl;
+    return ErrorCode::FAILURE;
+}
+static ErrorCode do_su(const Command& command) {
+    if (command.args.size() < 2) {
+        fs.response << "su: missing operand" << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    return fs.su(command.args[0], command.args[1]);
+}
+static ErrorCode do_sudo(const Command& command) {
+    if (command.args.size() == 3) {
+        if (command.args[0] == "useradd") {
+            return fs.useradd(command.args[1], command.args[2]);
+        } else if (command.args[0] == "chmod") {
+            return fs.chmod(command.args[1], command.args[2]);
         }
+    }
+    return ErrorCode::SUCCESS;
+}
+static ErrorCode do_exit(const Command&) {
+    fs.pid_map.erase(fs.current_shell_pid);
+    detach_arena(fs.current_shell_pid);
+    return ErrorCode::SUCCESS;
+}
+
+// 命令分发表（下标为操作码）
+static ErrorCode (*const handlers[])(const Command&) = {
+    do_none, do_cat, do_cd, do_check, do_copy, do_del, do_dir, do_info, do_ls, do_ll,
+    do_log, do_md, do_newfile, do_rd, do_resize, do_save, do_stats, do_su, do_sudo, do_exit, do_du, do_find
+};
+static_assert(sizeof(handlers) / sizeof(handlers[0]) == (size_t)Opcode::COUNT);
+
+ErrorCode simdisk(const Message& msg) {
+    fs.current_shell_pid = msg.pid;
+    if (msg.option == Option::NEW) {
+        fs.new_shell();
+        attach_arena(msg.pid, msg.command);
         return ErrorCode::SUCCESS;
-    } else if (args[0] == "dir") {
-        if (args.size() == 1) {
-            return fs.dir("");
-        } else if (args.size() == 2) {
-            if (args[1] == "-s") {
-                return fs.dir("", true);
-            } else {
-                return fs.dir(args[1]);
-            }
-        } else {
-            if (args[1] == "-s") {
-                return fs.dir(args[2], true);
-            } else {
-                return fs.dir(args[1], true);
-            }
+    }
+    Command command;
+    if (msg.binary) {
+        // 二进制请求直接解码，无需解析文本
+        if (!Command::decode(msg.command.data(), msg.command.size(), command)) {
+            fs.response << "simdisk: malformed request" << std::endl;
+            return ErrorCode::FAILURE;
         }
-    } else if (args[0] == "info") {
-        if (args.size() == 1) {
-            return fs.info("");
-        } else {
-            return fs.info(args[1]);
+    } else {
+        std::vector<std::string> args = split_command(msg.command);
+        if (msg.option == Option::PATCH) {
+            uint32_t i = std::stoul(args[1]);
+            uint32_t chunk = fs.pid_map[fs.current_shell_pid].chunk;
+            std::string& data = fs.pid_map[fs.current_shell_pid].data;
+            fs.response << data.substr(i * chunk, chunk);
+            // 最后一段取走后释放缓存的数据
+            if ((uint64_t)(i + 1) * chunk >= data.size()) std::string().swap(data);
+            return ErrorCode::SUCCESS;
         }
-    } else if (args[0] == "ls"){
-        if (args.size() == 1) {
-            return fs.ls("");
-        } else if (args.size() == 2) {
-            if (args[1] == "-s") {
-                return fs.ls("", true);
-            } else {
-                return fs.ls(args[1]);
-            }
-        } else {
-            if (args[1] == "-s") {
-                return fs.ls(args[2], true);
-            } else {
-                return fs.ls(args[1], true);
-            }
+        if (msg.option == Option::TAB) {
+            return fs.tab(args.back());
         }
-    } else if (args[0] == "ll") {
-        if (args.size() == 1) {
-            return fs.ll("");
-        } else if (args.size() == 2) {
-            if (args[1] == "-s") {
-                return fs.ll("", true);
-            } else {
-                return fs.ll(args[1]);
-            }
-        } else {
-            if (args[1] == "-s") {
-                return fs.ll(args[2], true);
-            } else {
-                return fs.ll(args[1], true);
-            }
+        command = Command::parse(msg.command);
+    }
+    fs.request_option = msg.option;
+    uint64_t reads = Stats::reads, writes = Stats::writes;
+    auto begin = std::chrono::steady_clock::now();
+    // 命令对元数据的修改作为一个事务提交；超出日志区容量时被整体放弃，已写入的输出和响应选项都作废
+    auto handler = handlers[(size_t)command.opcode];
+    ErrorCode code = Reclaimer::transact([&] { return handler(command); });
+    if (Journal::overflowed) {
+        fs.response.str("simdisk: '" + msg.text() + "' modifies more than " + std::to_string(Journal::capacity())
+                        + " metadata blocks and does not fit in the journal, nothing was changed\n");
+        Filesystem::response_option = Option::NONE;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+    AuditRecord record{};
+    record.time = AuditLog::now();
+    record.pid = (uint32_t)msg.pid;
+    record.id = msg.id;
+    record.wait = (uint32_t)Stats::wait;
+    record.elapsed = (uint32_t)elapsed;
+    record.reads = (uint32_t)(Stats::reads - reads);
+    record.writes = (uint32_t)(Stats::writes - writes);
+    Stats::record(command.opcode, elapsed, record.reads, record.writes);
+    // 定长字段不要求以 '\0' 结尾，超长时截断，其余字节保持为 0
+    auto info = fs.pid_map.find(msg.pid);
+    if (info != fs.pid_map.end()) {
+        const char* user = info->second.username;
+        memcpy(record.user, user, strnlen(user, sizeof(record.user)));
+    }
+    record.event = AuditLog::COMMAND;
+    record.opcode = (uint8_t)command.opcode;
+    record.option = (uint8_t)msg.option;
+    record.code = (uint8_t)code;
+    if (!command.args.empty()) {
+        const std::string& arg = command.args[0];
+        memcpy(record.detail, arg.data(), std::min(arg.size(), sizeof(record.detail)));
+    }
+    AuditLog::push(AuditLog::cooker_ring, AuditLog::AUDIT, record);
+    return code;
+}
+/**
+ * @brief 处理批量请求
+ *
+ * 请求项以 BatchItem 的格式依次写在Shell的数据区中。逐项执行后，
+ * 将每一项的错误码、响应选项、耗时和输出按同样的格式写回数据区，整批只需一次往返。
+ * 某一项需要Shell后续交互（确认或分段传输）或输出写满数据区时，停止执行剩余的项，
+ * 由Shell处理完后重新发送。
+ *
+ * @param msg 批量请求消息
+ * @return ErrorCode 全部项都已执行返回 SUCCESS，否则返回 FAILURE
+ */
+ErrorCode batch(const Message& msg) {
+    fs.current_shell_pid = msg.pid;
+    auto it = arenas.find(msg.pid);
+    if (it == arenas.end()) {
+        fs.response << "batch: data arena is not available" << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    Arena* arena = it->second.arena;
+    uint32_t capacity = it->second.capacity;
+    char* base = arena->payload();
+    // 先取出全部请求项，结果会覆盖同一块数据区；长度由Shell写入，不超过服务端记录的容量
+    std::vector<Message> items;
+    size_t length = std::min(arena->length, capacity);
+    size_t offset = 0;
+    while (offset + sizeof(BatchItem) <= length) {
+        auto* item = reinterpret_cast<BatchItem*>(base + offset);
+        if (item->length >= length - offset - sizeof(BatchItem) || offset + BatchItem::space(item->length) > length) break;
+        items.push_back(Message{msg.pid, msg.id, std::string(item->data(), item->length), item->option, item->binary});
+        offset += BatchItem::space(item->length);
+    }
+    ErrorCode code = ErrorCode::SUCCESS;
+    offset = 0;
+    for (auto& item: items) {
+        if (capacity - offset <= BatchItem::space(0)) {
+            code = ErrorCode::FAILURE;
+            break;
         }
-    } else if (args[0] == "md") {
-        for (int i = 1; i < args.size(); ++i) {
-            ErrorCode err = fs.md(args[i]);
-            if (err == ErrorCode::FAILURE) return ErrorCode::FAILURE;
+        auto* result = reinterpret_cast<BatchItem*>(base + offset);
+        // 每一项的输出直接写在其头部之后，保留结尾的'\0'并保持4字节对齐
+        fs.response.bind(result->data(), (capacity - offset - sizeof(BatchItem) - 1) & ~3u);
+        Filesystem::response_option = Option::NONE;
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<std::string> args = split_command(item.text());
+        if (args.empty() || args[0] == "exit" || item.option == Option::NEW || item.option == Option::BATCH) {
+            fs.response << "batch: '" << item.text() << "' is not allowed in a batch" << std::endl;
+            result->code = ErrorCode::FAILURE;
+        } else {
+            // 批量请求中不支持流式传输
+            if (item.option == Option::STREAM) item.option = Option::CAT;
+            // 每一项单独作为一个事务提交
+            result->code = simdisk(item);
         }
-        return ErrorCode::SUCCESS;
-    } else if (args[0] == "newfile") {
-        for (int i = 1; i < args.size(); ++i) {
-            ErrorCode err = fs.newfile(args[i]);
-            if (err == ErrorCode::FAILURE) return ErrorCode::FAILURE;
+        result->option = Filesystem::response_option;
+        result->elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+        result->binary = false;
+        if (fs.response.fail()) {
+            result->code = ErrorCode::FAILURE;
+            code = ErrorCode::FAILURE;
         }
-        return ErrorCode::SUCCESS;
-    } else if (args[0] == "rd") {
-        for (int i = 1; i < args.size(); ++i) {
-            ErrorCode err = fs.rd(args[i]);
-            if (err == ErrorCode::FAILURE) return ErrorCode::FAILURE;
+        fs.response.terminate();
+        result->length = fs.response.size();
+        offset += BatchItem::space(result->length);
+        if (code == ErrorCode::FAILURE) break;
+        if (result->option == Option::REQUEST || result->option == Option::PATCH) break;
+    }
+    fs.response.bind(base, capacity);
+    fs.response.commit(offset);
+    Filesystem::response_option = Option::BATCH;
+    return code;
+}
+/**
+ * @brief 执行一条请求
+ *
+ * 有数据区时响应直接写入该Shell的数据区，流式请求打开流；普通请求作为一个事务提交。
+ * 调用方负责取走并清空响应。
+ *
+ * @param request 请求消息
+ * @return ErrorCode 执行结果
+ */
+ErrorCode execute(Message& request) {
+    Filesystem::response_option = Option::NONE;
+    // 响应直接写入该Shell的数据区
+    auto arena = arenas.find(request.pid);
+    if (arena != arenas.end()) {
+        Filesystem::response.bind(arena->second.arena->payload(), arena->second.capacity);
+        if (request.option == Option::STREAM) Filesystem::stream.open(arena->second.arena);
+    } else if (request.option == Option::STREAM) {
+        // 没有数据区的Shell无法流式传输，退回分段传输
+        request.option = Option::CAT;
+    }
+    ErrorCode code;
+    if (request.option == Option::BATCH) {
+        code = batch(request);
+    } else {
+        code = simdisk(request);
+    }
+    // 关闭流，通知Shell不再有新的帧
+    Filesystem::stream.close();
+    return code;
+}
+
+/**
+ * @brief 记录一条请求
+ *
+ * 到达时间由入队时的单调时钟换算为系统时间。批量请求的各项位于Shell的数据区中，一并记录。
+ *
+ * @param request 请求消息
+ */
+void record_request(const Message& request) {
+    auto age = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - request.queued).count();
+    TraceRecord record{};
+    record.time = AuditLog::now() - age;
+    record.pid = request.pid;
+    record.id = request.id;
+    record.length = request.command.size();
+    record.option = (uint8_t)request.option;
+    record.binary = request.binary;
+    std::string_view payload;
+    auto arena = arenas.find(request.pid);
+    if (request.option == Option::BATCH && arena != arenas.end()) {
+        payload = std::string_view(arena->second.arena->payload(), std::min(arena->second.arena->length, arena->second.capacity));
+        record.payload = payload.size();
+    }
+    Trace::record(record, request.command, payload);
+}
+
+/**
+ * @brief 重放请求记录
+ *
+ * 在进程内依次执行记录中的请求，不经过共享内存。original 为 true 时按记录中的时间间隔执行，
+ * 落后于原有时间的部分计入排队时间；否则一条接一条尽快执行。
+ * 注册请求为该Shell分配一块进程内的数据区，使响应与原来一样写入数据区；流式请求改为一次性写入数据区。
+ * 结束后输出各命令的延迟统计。
+ *
+ * @param file 记录文件
+ * @param original 是否按原有的时间间隔执行
+ * @return int 进程退出码
+ */
+int replay(const std::string& file, bool original) {
+    std::string error;
+    int in = Trace::open_read(file, error);
+    if (in < 0) {
+        std::cerr << "simdisk: '" << file << "' " << error << std::endl;
+        return 1;
+    }
+    for (const std::string& name: Trace::unknown) {
+        std::cerr << "simdisk: '" << name << "' is not a command of this build and is replayed as an unknown command" << std::endl;
+    }
+    std::map<pid_t, std::unique_ptr<char[]>> buffers;
+    TraceRecord record{};
+    std::string data, payload;
+    uint64_t count = 0;
+    int64_t first = 0;
+    Stats::reset();
+    auto begin = std::chrono::steady_clock::now();
+    while (Trace::next(in, record, data, payload)) {
+        if (count++ == 0) first = record.time;
+        auto due = begin + std::chrono::nanoseconds(record.time - first);
+        if (original) std::this_thread::sleep_until(due);
+        Message request{(pid_t)record.pid, record.id, data, (Option)record.option, record.binary != 0};
+        request.queued = original ? due : std::chrono::steady_clock::now();
+        Stats::wait = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - request.queued).count();
+        bool attach = request.option == Option::NEW && !request.command.empty();
+        // 原来的数据区已不存在，注册时不附加
+        if (request.option == Option::NEW) request.command.clear();
+        if (request.option == Option::STREAM) request.option = Option::CAT;
+        auto arena = arenas.find(request.pid);
+        if (request.option == Option::BATCH && arena != arenas.end()) {
+            size_t length = std::min<size_t>(payload.size(), arena->second.capacity);
+            memcpy(arena->second.arena->payload(), payload.data(), length);
+            arena->second.arena->length = length;
         }
-        return ErrorCode::SUCCESS;
-    } else if (args[0] == "save") {
-        system(("zip backup.zip " + Disk::disk_name).c_str());
-        fs.copy_host("backup.zip", "/lost+found/backup.img");
-        system("rm backup.zip");
-    } else if (args[0] == "su") {
-        return fs.su(args[1], args[2]);
-    } else if (args[0] == "sudo") {
-        if (args.size() == 4) {
-            if (args[1] == "useradd") {
-                return fs.useradd(args[2], args[3]);
-            } else if (args[1] == "chmod") {
-                return fs.chmod(args[2], args[3]);
-            }
+        std::lock_guard<std::mutex> guard(Scrubber::mutex);
+        execute(request);
+        if (attach) {
+            auto& buffer = buffers[request.pid];
+            if (!buffer) buffer = std::make_unique<char[]>(Arena::segment_size(ARENA_SIZE));
+            arenas[request.pid] = {reinterpret_cast<Arena*>(buffer.get()), ARENA_SIZE};
+        } else if (arenas.find(request.pid) == arenas.end()) {
+            // exit 已从 arenas 中移除该Shell的数据区（对进程内的地址调用 shmdt 不会生效）
+            buffers.erase(request.pid);
         }
-    } else if (args[0] == "exit") {
-        fs.pid_map.erase(fs.current_shell_pid);
+        if (Filesystem::response.bound()) Filesystem::response.unbind();
+        Filesystem::response.clear();
+        Filesystem::response.str("");
+        if (Journal::durable && Journal::unsynced > 0) Journal::sync();
     }
-    return ErrorCode::SUCCESS;
+    ::close(in);
+    // 重放时没有回收线程，rd 留下的目录树在结束前回收
+    {
+        std::lock_guard<std::mutex> guard(Scrubber::mutex);
+        Reclaimer::drain();
+        if (Journal::durable && Journal::unsynced > 0) Journal::sync();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << "replayed " << count << " requests from '" << file << "' in " << std::fixed << std::setprecision(3)
+              << elapsed / 1e6 << " s (" << (original ? "original timing" : "as fast as possible") << ")" << std::endl;
+    Stats::report(std::cout);
+    return 0;
 }
 /**
  * @brief Server 类
@@ -210,22 +607,27 @@ public:
 };
 
 int Server::get_request() {
-    printf("Simdisk: server is waiting for a request\n");
     Semaphore::P(parSemId);
-    printf("Simdisk: server receives request\n");
     pid_t pid = sharedMemory->request.pid;
     uint32_t id = sharedMemory->request.id;
-    std::string request(sharedMemory->request.data);
+    bool binary = sharedMemory->request.binary;
+    // 长度由Shell写入，不超过请求区的大小
+    uint32_t length = std::min<uint32_t>(sharedMemory->request.length, sizeof(sharedMemory->request.data));
+    std::string request(sharedMemory->request.data, length);
     Option option = sharedMemory->request.option;
+    Message message{pid, id, request, option, binary};
+    message.queued = std::chrono::steady_clock::now();
     mtx.lock();
-    message_queue.emplace(pid, id, request, option);
+    message_queue.push(message);
     mtx.unlock();
     sharedMemory->request.type = 'y';
-    if (request.empty()) {
-        printf("Simdisk: server records request %u\n", id);
-    } else {
-        printf("Simdisk: server records request %u `%s`\n", id, request.c_str());
-    }
+    AuditRecord record{};
+    record.time = AuditLog::now();
+    record.pid = (uint32_t)pid;
+    record.id = id;
+    record.event = AuditLog::RECEIVED;
+    record.option = (uint8_t)option;
+    AuditLog::push(AuditLog::server_ring, AuditLog::TRACE, record);
     sem_post(&semaphore);
     return 0;
 }
@@ -245,6 +647,13 @@ public:
      */
     int get_request();
 
+    /**
+     * @brief 组提交
+     *
+     * 一次 fdatasync 持久化窗口内全部已完成的事务，再按顺序发送被推迟的响应。
+     */
+    void sync();
+
     /**
      * @brief 启动 Cooker
      *
@@ -257,53 +666,124 @@ public:
             get_request();
         }
     }
+
+private:
+    // 等待持久化后才能发送的响应
+    struct Pending {
+        pid_t pid;               // 请求方的进程ID
+        std::chrono::steady_clock::time_point queued;   // 请求进入消息队列的时间
+        uint32_t id;             // 请求ID
+        ErrorCode code;          // 错误码
+        Option option;           // 选项
+        bool in_arena;           // 数据是否已写入请求方的数据区
+        uint32_t length;         // 数据区中的数据长度
+        std::string data;        // 未使用数据区时的数据
+    };
+
+    // 发送响应
+    void respond(const Pending& pending);
+
+    // 共享的响应区空闲时发送下一个等待中的响应
+    void deliver();
+
+    // 记录已发送的响应
+    static void responded(const Pending& pending);
+
+    std::vector<Pending> pending;                           // 当前组中被推迟的响应
+    std::chrono::steady_clock::time_point group_begin;      // 当前组中第一条命令完成的时间
+    std::deque<Pending> waiting;                            // 等待共享的响应区空闲的响应
 };
 
+// 共享的响应区被占用时重新检查的间隔
+static constexpr auto RESPOND_RETRY = std::chrono::milliseconds(1);
+
+/**
+ * @brief 发送响应
+ *
+ * 数据已在请求方数据区中的响应，响应头也写入该数据区，每个Shell各用一份，不必等待；
+ * 其余的响应经由共享的响应区发送，响应区中的上一个响应还没有被取走时按顺序排队，
+ * 由 deliver 稍后发送，处理线程不会因此阻塞。
+ */
+void Cooker::respond(const Pending& pending) {
+    auto arena = arenas.find(pending.pid);
+    if (pending.in_arena && arena != arenas.end()) {
+        arena->second.arena->reply_code = pending.code;
+        arena->second.arena->reply_option = pending.option;
+        arena->second.arena->reply_id.store(pending.id, std::memory_order_release);
+        responded(pending);
+        return;
+    }
+    waiting.push_back(pending);
+    deliver();
+}
+
+void Cooker::deliver() {
+    if (waiting.empty() || sharedMemory->response.type == 'n') return;
+    const Pending& next = waiting.front();
+    if (next.in_arena) {
+        sharedMemory->response.send_arena(next.length, next.id, next.code, next.option);
+    } else {
+        sharedMemory->response.send(next.data.c_str(), next.id, next.code, next.option);
+    }
+    responded(next);
+    waiting.pop_front();
+}
+
+void Cooker::responded(const Pending& pending) {
+    AuditRecord record{};
+    record.time = AuditLog::now();
+    record.pid = (uint32_t)pending.pid;
+    record.id = pending.id;
+    record.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - pending.queued).count();
+    record.event = AuditLog::RESPONDED;
+    record.option = (uint8_t)pending.option;
+    record.code = (uint8_t)pending.code;
+    AuditLog::push(AuditLog::cooker_ring, AuditLog::TRACE, record);
+}
+
+void Cooker::sync() {
+    Journal::sync();
+    Journal::acknowledged += pending.size();
+    Journal::largest = std::max(Journal::largest, static_cast<uint32_t>(pending.size()));
+    for (auto& item: pending) {
+        respond(item);
+    }
+    pending.clear();
+}
+
 int Cooker::get_request() {
-    printf("Simdisk: cooker is waiting for a request\n");
-    sem_wait(&semaphore);
+    deliver();
+    if (pending.empty() && waiting.empty()) {
+        sem_wait(&semaphore);
+    } else {
+        // 组中已有命令时最多等到窗口结束，之后不再等待新的命令；有等待发送的响应时隔一段时间再检查响应区
+        auto now = std::chrono::steady_clock::now();
+        auto group_end = group_begin + std::chrono::microseconds(Journal::window);
+        auto until = pending.empty() ? now + RESPOND_RETRY : group_end;
+        if (!waiting.empty()) until = std::min(until, now + RESPOND_RETRY);
+        timespec deadline{};
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        auto ns = std::max<long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(until - now).count(), 0);
+        deadline.tv_sec += (deadline.tv_nsec + ns) / 1000000000;
+        deadline.tv_nsec = (deadline.tv_nsec + ns) % 1000000000;
+        if (sem_timedwait(&semaphore, &deadline) != 0) {
+            if (!pending.empty() && std::chrono::steady_clock::now() >= group_end) {
+                std::lock_guard<std::mutex> guard(Scrubber::mutex);
+                sync();
+            }
+            return 0;
+        }
+    }
+    // 处理请求期间暂停后台巡检
+    std::lock_guard<std::mutex> guard(Scrubber::mutex);
     mtx.lock();
     Message request = message_queue.front();
     message_queue.pop();
     mtx.unlock();
+    Stats::wait = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - request.queued).count();
 
-    if (request.command.empty()) {
-        printf("Simdisk: cooker is processing request %u\n", request.id);
-    } else {
-        printf("Simdisk: cooker is processing request %u `%s`\n", request.id, request.command.c_str());
-    }
-    // 使用系统时钟获取当前时间点
-    {
-        auto now = std::chrono::system_clock::now();
-        // 将时间点转换为time_t以便输出
-        std::time_t now_time = std::chrono::system_clock::to_time_t(now);
-//        std::string data = fs.cat_log(system_log);
-        std::stringstream ss;
-        if (request.command.empty()) {
-            ss << std::put_time(std::localtime(&now_time), "%Y-%m-%d %H:%M:%S");
-            ss << ": Simdisk is processing command `<NULL>` with option `";
-            ss << to_string(request.option);
-            ss << "` from Shell `";
-            ss << std::to_string(request.pid);
-            ss << "` User `";
-            ss << fs.pid_map[request.pid].username;
-            ss << "`";
-        } else {
-            ss << std::put_time(std::localtime(&now_time), "%Y-%m-%d %H:%M:%S");
-            ss << ": Simdisk is processing command `" + request.command + "` with option `";
-            ss << to_string(request.option);
-            ss << "` from Shell `";
-            ss << std::to_string(request.pid);
-            ss << "` User `";
-            ss << fs.pid_map[request.pid].username;
-            ss << "`";
-        }
-//        if (data.empty())
-//            fs.write_log(system_log, ss.str());
-//        else
-//            fs.write_log(system_log, data + "\n" + ss.str());
-    }
-    ErrorCode code = simdisk(request);
+    if (Trace::fd >= 0) record_request(request);
+    ErrorCode code = execute(request);
     {
 //        auto now = std::chrono::system_clock::now();
 //        // 将时间点转换为time_t以便输出
@@ -334,25 +814,33 @@ int Cooker::get_request() {
 //        else
 //            fs.write_log(system_log, data + "\n" + ss.str());
     }
-    Option option = Filesystem::response_option;
-    int time = 100000;
-    int cnt = 0;
-    while (sharedMemory->response.type == 'n') {
-        if (cnt >= 5) {
-            break;
+    Pending result{request.pid, request.queued, request.id, code, Filesystem::response_option, false, 0, ""};
+    if (Filesystem::response.bound()) {
+        if (Filesystem::response.fail()) {
+            result.code = ErrorCode::FAILURE;
+            Filesystem::response.str("simdisk: response exceeds the capacity of the data arena\n");
         }
-        usleep(time);
-        ++cnt;
+        Filesystem::response.terminate();
+        arenas[request.pid].arena->length = Filesystem::response.size();
+        result.in_arena = true;
+        result.length = Filesystem::response.size();
+        Filesystem::response.unbind();
+    } else {
+        result.data = Filesystem::response.str();
     }
-    std::string response;
-    response = Filesystem::response.str();
-    sharedMemory->response.send(response.c_str(), request.id, code, option);
     Filesystem::response.clear();
     Filesystem::response.str("");
-    if (request.command.empty()) {
-        printf("Simdisk: cooker completes processing request %u\n", request.id);
+    // 持久化模式下，修改了磁盘的命令在组提交之后才确认；组中已有命令时后续命令也排在其后，
+    // 避免先确认的命令读到尚未持久化的内容
+    if (Journal::durable && (Journal::unsynced > 0 || !pending.empty())) {
+        if (pending.empty()) group_begin = std::chrono::steady_clock::now();
+        pending.push_back(std::move(result));
+        if (pending.size() >= Journal::batch
+            || std::chrono::steady_clock::now() - group_begin >= std::chrono::microseconds(Journal::window)) {
+            sync();
+        }
     } else {
-        printf("Simdisk: cooker completes processing request %u `%s`\n", request.id, request.command.c_str());
+        respond(result);
     }
     return 0;
 }
@@ -392,10 +880,6 @@ void init() {
     output << shmId << ' ' << semId << ' ' << parSemId;
     output.close();
 }
-// 初始化日志信息
-Entry* user_log = nullptr;
-//Entry* system_log = nullptr;
-//Entry* lock_log = nullptr;
 /*
  *                        _oo0oo_
  *                       o8888888o
@@ -428,15 +912,79 @@ Entry* user_log = nullptr;
  *
  * @return 返回程序执行状态，通常为 0 表示正常退出
  */
-int main() {
-    // 确保块大小为 1024 字节
-    static_assert(sizeof(Block) == 1024);
+int main(int argc, char* argv[]) {
+    // Block 按最大的块大小声明
+    static_assert(sizeof(Block) == MAX_BLOCK_SIZE);
+
+    // 重放的请求记录及是否按原有的时间间隔执行
+    std::string replay_file;
+    bool replay_original = true;
+    uint64_t block_size = 0;
+
+    // 解析命令行参数
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--sync") {
+            Journal::durable = true;
+        } else if (arg == "--data-checksums") {
+            ChecksumTable::data = true;
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            AuditLog::Level level;
+            if (!AuditLog::parse(argv[++i], level)) {
+                std::cerr << "simdisk: unknown log level '" << argv[i] << "' (off, audit or trace)" << std::endl;
+                return 2;
+            }
+            AuditLog::level = level;
+        } else if (arg == "--quiet") {
+            // 等同于 --log-level off
+            AuditLog::level = AuditLog::OFF;
+        } else if (arg == "--decode-log" && i + 1 < argc) {
+            // 离线转换审计日志，不启动服务
+            return AuditLog::decode(argv[i + 1], std::cout);
+        } else if (arg == "--record" && i + 1 < argc) {
+            Trace::path = argv[++i];
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replay_file = argv[++i];
+        } else if (arg == "--replay-fast") {
+            replay_original = false;
+        } else if (arg == "--punch-holes") {
+            Disk::punch_holes = true;
+        } else if (arg == "--scrub-rate" && i + 1 < argc) {
+            Scrubber::rate = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--size" && i + 1 < argc && parse_size(argv[i + 1], Geometry::size)) {
+            ++i;
+        } else if (arg == "--max-size" && i + 1 < argc && parse_size(argv[i + 1], Geometry::max_size)) {
+            ++i;
+        } else if (arg == "--block-size" && i + 1 < argc && parse_size(argv[i + 1], block_size) && BlockSize::valid(block_size)) {
+            Geometry::block_size = block_size;
+            ++i;
+        } else if (arg == "--inode-ratio" && i + 1 < argc) {
+            Geometry::inode_ratio = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--commit-window" && i + 1 < argc) {
+            Journal::window = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--commit-batch" && i + 1 < argc) {
+            Journal::batch = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+        } else {
+            std::cerr << "usage: simdisk [--sync] [--commit-window <微秒>] [--commit-batch <命令数>] [--data-checksums] [--scrub-rate <MB/s>] [--punch-holes]"
+                      << " [--size <大小>] [--max-size <大小>] [--block-size <1K|4K|8K>] [--inode-ratio <字节数>]"
+                      << " [--log-level <off|audit|trace>] [--quiet] [--decode-log <文件>] [--record <文件>] [--replay <文件> [--replay-fast]]" << std::endl;
+            return 2;
+        }
+    }
+    // 几何参数只在格式化新磁盘时使用，先检查是否合理
+    if (Geometry::size > Geometry::MAX_SIZE || Geometry::max_size > Geometry::MAX_SIZE
+        || (Geometry::max_size != 0 && Geometry::max_size < Geometry::size) || !Superblock().layout(Geometry::size, Geometry::block_size, Geometry::inode_ratio, Geometry::max_size)) {
+        std::cerr << "simdisk: invalid geometry, the image must be at most " << (Geometry::MAX_SIZE >> 30)
+                  << "G, no larger than --max-size, and leave room for data" << std::endl;
+        return 2;
+    }
 
     begin:
     std::cout << "请输入Simdisk要管理的磁盘镜像文件: ";
     std::string name;
     std::getline(std::cin, name);
     std::fstream img(name);
+    ErrorCode err = ErrorCode::SUCCESS;
 
     if (!img.is_open()) {
         // 磁盘镜像文件不存在，询问是否创建新的磁盘文件
@@ -445,7 +993,7 @@ int main() {
         std::getline(std::cin, option);
 
         if (option == "Y" || option == "y") {
-            fs._new(name);
+            err = fs._new(name);
         } else {
             goto begin;
         }
@@ -457,14 +1005,43 @@ int main() {
 
         if (option == "Y" || option == "y") {
             state = true;
-            fs.load(name);
+            err = fs.load(name);
         } else if (option == "N" || option == "n") {
-            fs._new(name);
+            err = fs._new(name);
         } else {
             goto begin;
         }
     }
 
+    if (err == ErrorCode::LOCKED) {
+        std::cerr << "simdisk: the disk image '" << name << "' is in use by another process" << std::endl;
+        return 1;
+    } else if (err != ErrorCode::SUCCESS) {
+        std::cerr << "simdisk: cannot open the disk image '" << name << "': " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    if (Journal::durable && !Journal::enabled()) {
+        printf("Simdisk: --sync requires a disk with a journal, durable mode is off\n");
+        Journal::durable = false;
+    }
+
+    if (!replay_file.empty()) {
+        // 在进程内重放，不启动服务
+        AuditLog::level = AuditLog::OFF;
+        int code = replay(replay_file, replay_original);
+        fs.release();
+        return code;
+    }
+
+    if (!Trace::path.empty() && !Trace::open(Trace::path)) {
+        printf("Simdisk: cannot open the request trace '%s', requests are not recorded\n", Trace::path.c_str());
+    }
+
+    if (!AuditLog::open(Disk::disk_name + ".audit")) {
+        printf("Simdisk: cannot open the audit log, requests are not logged\n");
+    }
+
     // 初始化共享内存和信号量
     init();
 
@@ -476,10 +1053,21 @@ int main() {
     Cooker cooker;
     std::thread t1(&Server::run, &server);
     std::thread t2(&Cooker::run, &cooker);
+    // 前台有待处理的请求时巡检线程让出磁盘
+    Scrubber::busy = [] {
+        std::lock_guard<std::mutex> lock(mtx);
+        return !message_queue.empty();
+    };
+    std::thread t3(&Scrubber::run);
+    std::thread t4(&AuditLog::run);
+    std::thread t5(&Reclaimer::run);
 
     // 等待线程结束
     t1.join();
     t2.join();
+    t3.join();
+    t4.join();
+    t5.join();
 
     // 释放资源
     fs.release();
@@ -0,0 +1,449 @@
+//
+// Created by eric on 12/03/23.
+//
+#include "filesystem.h"
+#include <chrono>
+#include <ctime>
+#include <iomanip>
+#include <dirent.h>
+
+// 重写变更跟踪文件（头部和整个位图）
+static void write_tracking(uint32_t blocks_num) {
+    uint32_t header[3] = {TRACKING_MAGIC, blocks_num, Snapshot::complete ? 0u : 1u};
+    pwrite(Snapshot::fd, header, sizeof(header), 0);
+    pwrite(Snapshot::fd, Snapshot::changed.data(), Snapshot::changed.size(), Snapshot::TRACKING_HEADER);
+    fdatasync(Snapshot::fd);
+}
+
+// 新建磁盘时初始化，删除同名镜像的旧快照
+void Snapshot::format(uint32_t blocks_num) {
+    for (uint32_t i = 0; access(path(i).c_str(), F_OK) == 0; ++i) {
+        unlink(path(i).c_str());
+    }
+    changed.assign(blocks_num / 8 + 1, 0);
+    count = 0;
+    next = 0;
+    complete = true;
+    if (fd >= 0) ::close(fd);
+    fd = ::open((Disk::disk_name + ".cbt").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_tracking(blocks_num);
+}
+
+/**
+ * @brief 载入磁盘时读取变更跟踪文件
+ *
+ * 快照序号从 0 开始连续编号，下一个快照的序号为第一个不存在的快照文件的序号。
+ * 变更跟踪文件不存在或与镜像不符时，位图不可信，下一次快照包含所有非零块。
+ *
+ * @param blocks_num 镜像的块数
+ */
+void Snapshot::load(uint32_t blocks_num) {
+    next = 0;
+    while (access(path(next).c_str(), F_OK) == 0) {
+        ++next;
+    }
+    changed.assign(blocks_num / 8 + 1, 0);
+    count = 0;
+    complete = false;
+    if (fd >= 0) ::close(fd);
+    fd = ::open((Disk::disk_name + ".cbt").c_str(), O_RDWR | O_CREAT, 0644);
+    uint32_t header[3] = {};
+    if (pread(fd, header, sizeof(header), 0) == sizeof(header) && header[0] == TRACKING_MAGIC && header[1] == blocks_num
+        && pread(fd, changed.data(), changed.size(), TRACKING_HEADER) == (ssize_t)changed.size()) {
+        complete = header[2] == 0;
+        for (uint8_t byte: changed) {
+            count += __builtin_popcount(byte);
+        }
+        return;
+    }
+    changed.assign(changed.size(), 0);
+    write_tracking(blocks_num);
+}
+
+// 镜像扩容后扩大变更跟踪位图，新增的块都是零块，不需要标记
+void Snapshot::grow(uint32_t blocks_num) {
+    changed.resize(blocks_num / 8 + 1, 0);
+    write_tracking(blocks_num);
+}
+
+// 创建快照：写入上次快照之后变化的块，成功后清空变更跟踪位图
+static ErrorCode take(std::ostream& response, uint32_t blocks_num) {
+    auto begin = std::chrono::steady_clock::now();
+    uint32_t sequence = Snapshot::next;
+    std::string path = Snapshot::path(sequence);
+    std::string temp = path + ".tmp";
+    int out = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        response << "save: cannot create '" << temp << "': " << strerror(errno) << std::endl;
+        return ErrorCode::FAILURE;
+    }
+
+    // 块的内容依次写在头部之后，块号表写在最后
+    static const Block zero{};
+    Block block;
+    std::vector<uint32_t> table;
+    table.reserve(Snapshot::complete ? Snapshot::count : blocks_num);
+    for (uint32_t i = 0; i < blocks_num; ++i) {
+        if (Snapshot::complete) {
+            if (Snapshot::changed[i / 8] == 0) {
+                i |= 7;
+                continue;
+            }
+            if (!(Snapshot::changed[i / 8] & (1 << (i % 8)))) continue;
+        }
+        ssize_t n = pread(Disk::fd, &block, BLOCK_SIZE, (off_t)i * BLOCK_SIZE);
+        if (n < BLOCK_SIZE) memset(reinterpret_cast<char*>(&block) + std::max<ssize_t>(n, 0), 0, BLOCK_SIZE - std::max<ssize_t>(n, 0));
+        // 位图不可信时逐块比较，只保存非零块
+        if (!Snapshot::complete && memcmp(&block, &zero, BLOCK_SIZE) == 0) continue;
+        pwrite(out, &block, BLOCK_SIZE, (off_t)(1 + table.size()) * BLOCK_SIZE);
+        table.push_back(i);
+    }
+    pwrite(out, table.data(), table.size() * sizeof(uint32_t), (off_t)(1 + table.size()) * BLOCK_SIZE);
+    Block head{};
+    auto* header = reinterpret_cast<Snapshot::Header*>(&head);
+    *header = {SNAPSHOT_MAGIC, sequence, blocks_num, static_cast<uint32_t>(table.size()), static_cast<int64_t>(std::time(nullptr))};
+    pwrite(out, &head, BLOCK_SIZE, 0);
+
+    // 快照文件落盘后才能清空位图
+    if (fdatasync(out) != 0 || ::close(out) != 0 || rename(temp.c_str(), path.c_str()) != 0) {
+        response << "save: cannot write '" << path << "': " << strerror(errno) << std::endl;
+        unlink(temp.c_str());
+        return ErrorCode::FAILURE;
+    }
+    Snapshot::changed.assign(Snapshot::changed.size(), 0);
+    Snapshot::count = 0;
+    Snapshot::complete = true;
+    Snapshot::next = sequence + 1;
+    write_tracking(blocks_num);
+
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    response << "save: snapshot " << sequence << " written to '" << path << "': " << table.size() << " blocks ("
+             << table.size() * BLOCK_SIZE / 1024 << " KiB) in " << std::fixed << std::setprecision(1) << elapsed << " ms" << std::endl;
+    return ErrorCode::SUCCESS;
+}
+
+// 读取快照文件的头部
+static bool read_header(int in, Snapshot::Header& header) {
+    return pread(in, &header, sizeof(header), 0) == sizeof(header) && header.magic == SNAPSHOT_MAGIC;
+}
+
+/**
+ * @brief 读取快照文件的块号表
+ *
+ * 块号表位于各块的内容之后，头部记录的块数与文件大小不符时快照已损坏，不按它分配内存。
+ *
+ * @return bool 块号表完整时返回 true
+ */
+static bool read_table(int in, const Snapshot::Header& header, std::vector<uint32_t>& table) {
+    struct stat st{};
+    off_t offset = (off_t)(1 + (uint64_t)header.count) * BLOCK_SIZE;
+    if (fstat(in, &st) != 0 || st.st_size < offset + (off_t)header.count * (off_t)sizeof(uint32_t)) return false;
+    table.resize(header.count);
+    auto size = static_cast<ssize_t>(table.size() * sizeof(uint32_t));
+    return pread(in, table.data(), size, offset) == size;
+}
+
+// 列出所有快照
+static ErrorCode list(std::ostream& response) {
+    for (auto& [epoch, snapshot]: NamedSnapshot::chain) {
+        std::time_t time = snapshot.time;
+        response << std::left << std::setw(6) << ("@" + snapshot.name) << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S")
+                 << std::right << std::setw(10) << snapshot.blocks.size() << " blocks copied on write\n";
+    }
+    if (Snapshot::next == 0) {
+        response << "save: no incremental snapshots of '" << Disk::disk_name << "'" << std::endl;
+        return ErrorCode::SUCCESS;
+    }
+    for (uint32_t i = 0; i < Snapshot::next; ++i) {
+        int in = ::open(Snapshot::path(i).c_str(), O_RDONLY);
+        Snapshot::Header header{};
+        if (in < 0 || !read_header(in, header)) {
+            response << std::left << std::setw(6) << i << "<unreadable>\n";
+        } else {
+            std::time_t time = header.time;
+            response << std::left << std::setw(6) << i << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S")
+                     << std::right << std::setw(10) << header.count << " blocks" << std::setw(10) << header.count * BLOCK_SIZE / 1024 << " KiB\n";
+        }
+        if (in >= 0) ::close(in);
+    }
+    response << Snapshot::count << " block(s) changed since the last snapshot"
+             << (Snapshot::complete ? "" : " (change tracking was lost, the next snapshot is full)") << "\n";
+    return ErrorCode::SUCCESS;
+}
+
+/**
+ * @brief 把快照 sequence 时的镜像还原到宿主机文件
+ *
+ * 从全零的镜像开始，按从新到旧的顺序应用快照 sequence..0，每个块只写入最新的一份。
+ * 还原出的镜像大小取快照 sequence 时的大小，扩容之前的快照只包含较小的块号。
+ * 正在使用的镜像不会被修改，还原出的镜像可以由 Simdisk 重新载入。
+ */
+static ErrorCode restore(std::ostream& response, uint32_t sequence, const std::string& dst) {
+    if (sequence >= Snapshot::next) {
+        response << "save: snapshot " << sequence << " does not exist" << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    if (dst == Disk::disk_name) {
+        response << "save: cannot restore over the disk image in use" << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    auto begin = std::chrono::steady_clock::now();
+    Snapshot::Header target{};
+    int newest = ::open(Snapshot::path(sequence).c_str(), O_RDONLY);
+    bool readable = newest >= 0 && read_header(newest, target) && target.blocks_num > 0
+                    && (uint64_t)target.blocks_num * BLOCK_SIZE <= Geometry::MAX_SIZE;
+    if (newest >= 0) ::close(newest);
+    if (!readable) {
+        response << "save: snapshot " << sequence << " is missing or damaged, cannot restore" << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    uint32_t blocks_num = target.blocks_num;
+    int out = ::open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0 || ftruncate(out, (off_t)blocks_num * BLOCK_SIZE) != 0) {
+        response << "save: cannot create '" << dst << "': " << strerror(errno) << std::endl;
+        if (out >= 0) ::close(out);
+        return ErrorCode::FAILURE;
+    }
+    std::vector<uint8_t> written(blocks_num / 8 + 1, 0);
+    uint32_t restored = 0;
+    Block block;
+    std::vector<uint32_t> table;
+    for (uint32_t s = sequence + 1; s-- > 0;) {
+        int in = ::open(Snapshot::path(s).c_str(), O_RDONLY);
+        Snapshot::Header header{};
+        bool intact = in >= 0 && read_header(in, header) && header.blocks_num <= blocks_num && read_table(in, header, table);
+        bool saved = true;
+        for (uint32_t k = 0; intact && saved && k < header.count; ++k) {
+            uint32_t i = table[k];
+            if (i >= blocks_num || (written[i / 8] & (1 << (i % 8)))) continue;
+            written[i / 8] |= 1 << (i % 8);
+            intact = pread(in, &block, BLOCK_SIZE, (off_t)(1 + k) * BLOCK_SIZE) == BLOCK_SIZE;
+            saved = !intact || pwrite(out, &block, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) == BLOCK_SIZE;
+            ++restored;
+        }
+        if (in >= 0) ::close(in);
+        if (!intact || !saved) {
+            if (!intact) {
+                response << "save: snapshot " << s << " is missing or damaged, cannot restore" << std::endl;
+            } else {
+                response << "save: cannot write '" << dst << "': " << strerror(errno) << std::endl;
+            }
+            ::close(out);
+            return ErrorCode::FAILURE;
+        }
+    }
+    fdatasync(out);
+    ::close(out);
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    response << "save: snapshot " << sequence << " restored to '" << dst << "': " << restored << " blocks from "
+             << sequence + 1 << " snapshot file(s) in " << std::fixed << std::setprecision(1) << elapsed << " ms" << std::endl;
+    return ErrorCode::SUCCESS;
+}
+
+// 新建磁盘时初始化，删除同名镜像的旧快照
+void NamedSnapshot::format(uint32_t blocks_num) {
+    load(blocks_num);
+    for (auto& [epoch, snapshot]: chain) {
+        ::close(snapshot.fd);
+        unlink(path(snapshot.name).c_str());
+    }
+    chain.clear();
+    epochs.assign(blocks_num, 0);
+    next_epoch = 1;
+}
+
+/**
+ * @brief 载入磁盘时读取所有快照
+ *
+ * 扫描镜像所在目录中的快照文件，按纪元排列并重建各快照保存的块的索引。
+ * 最新快照保存过的块的纪元设为该快照的纪元，其余块再次被覆盖时都会复制。
+ *
+ * @param blocks_num 镜像的块数
+ */
+void NamedSnapshot::load(uint32_t blocks_num) {
+    for (auto& [epoch, snapshot]: chain) {
+        ::close(snapshot.fd);
+    }
+    chain.clear();
+    epochs.assign(blocks_num, 0);
+    next_epoch = 1;
+
+    auto slash = Disk::disk_name.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "." : Disk::disk_name.substr(0, slash + 1);
+    std::string prefix = (slash == std::string::npos ? Disk::disk_name : Disk::disk_name.substr(slash + 1)) + ".cow.";
+    DIR* dir = opendir(directory.c_str());
+    if (dir == nullptr) return;
+    while (dirent* item = readdir(dir)) {
+        std::string file = item->d_name;
+        if (file.compare(0, prefix.size(), prefix) != 0) continue;
+        int fd = ::open(path(file.substr(prefix.size())).c_str(), O_RDWR);
+        Header header{};
+        if (fd < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != COW_MAGIC) {
+            if (fd >= 0) ::close(fd);
+            printf("Simdisk: ignoring damaged snapshot file '%s'\n", file.c_str());
+            continue;
+        }
+        NamedSnapshot& snapshot = chain[header.epoch];
+        snapshot.name = file.substr(prefix.size());
+        snapshot.epoch = header.epoch;
+        snapshot.time = header.time;
+        snapshot.fd = fd;
+        // 只保留完整的记录，末尾写了一半的记录被之后的记录覆盖
+        uint32_t block_num;
+        while (pread(fd, &block_num, sizeof(block_num), snapshot.end) == sizeof(block_num)) {
+            Block block;
+            if (pread(fd, &block, BLOCK_SIZE, snapshot.end + (off_t)sizeof(block_num)) != BLOCK_SIZE) break;
+            snapshot.blocks.emplace(block_num, snapshot.end + (off_t)sizeof(block_num));
+            snapshot.end += sizeof(block_num) + BLOCK_SIZE;
+        }
+        next_epoch = std::max(next_epoch, header.epoch + 1);
+    }
+    closedir(dir);
+    if (chain.empty()) return;
+    auto& latest = chain.rbegin()->second;
+    for (auto& [block_num, offset]: latest.blocks) {
+        if (block_num < epochs.size()) epochs[block_num] = latest.epoch;
+    }
+}
+
+// 按名字查找快照
+NamedSnapshot* NamedSnapshot::find(const std::string& _name) {
+    for (auto& [epoch, snapshot]: chain) {
+        if (snapshot.name == _name) return &snapshot;
+    }
+    return nullptr;
+}
+
+// 创建快照：只分配新的纪元，之后的覆盖由 preserve 保存旧内容
+ErrorCode NamedSnapshot::create(const std::string& _name, std::ostream& response) {
+    if (_name.empty() || _name.size() > MAX_LENGTH
+        || !std::all_of(_name.begin(), _name.end(), [](char c) { return isalnum(c) || c == '-' || c == '_' || c == '.'; })) {
+        response << "save: invalid snapshot name '" << _name << "'" << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    if (find(_name) != nullptr) {
+        response << "save: snapshot '" << _name << "' already exists" << std::endl;
+        return ErrorCode::EXISTS;
+    }
+    // 已提交但尚未写回原位置的事务属于快照，先写回
+    if (Journal::durable) {
+        Journal::sync();
+    }
+    int fd = ::open(path(_name).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    Header header{COW_MAGIC, next_epoch, static_cast<int64_t>(std::time(nullptr)), {}};
+    strncpy(header.name, _name.c_str(), sizeof(header.name) - 1);
+    if (fd < 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fdatasync(fd) != 0) {
+        response << "save: cannot create '" << path(_name) << "': " << strerror(errno) << std::endl;
+        if (fd >= 0) ::close(fd);
+        return ErrorCode::FAILURE;
+    }
+    NamedSnapshot& snapshot = chain[next_epoch];
+    snapshot.name = _name;
+    snapshot.epoch = next_epoch++;
+    snapshot.time = header.time;
+    snapshot.fd = fd;
+    response << "save: snapshot '" << _name << "' created" << std::endl;
+    return ErrorCode::SUCCESS;
+}
+
+/**
+ * @brief 删除快照
+ *
+ * 更早的快照读块时会查找这个快照保存的内容，因此把前一个快照没有保存的块复制过去；
+ * 删除最早的快照不需要复制。
+ */
+ErrorCode NamedSnapshot::remove(const std::string& _name, std::ostream& response) {
+    NamedSnapshot* snapshot = find(_name);
+    if (snapshot == nullptr) {
+        response << "save: snapshot '" << _name << "' does not exist" << std::endl;
+        return ErrorCode::FAILURE;
+    }
+    auto it = chain.find(snapshot->epoch);
+    uint32_t merged = 0;
+    if (it != chain.begin()) {
+        NamedSnapshot& previous = std::prev(it)->second;
+        Block block;
+        for (auto& [block_num, offset]: snapshot->blocks) {
+            if (previous.blocks.count(block_num)) continue;
+            pread(snapshot->fd, &block, BLOCK_SIZE, offset);
+            pwrite(previous.fd, &block_num, sizeof(block_num), previous.end);
+            pwrite(previous.fd, &block, BLOCK_SIZE, previous.end + (off_t)sizeof(block_num));
+            previous.blocks.emplace(block_num, previous.end + (off_t)sizeof(block_num));
+            previous.end += sizeof(block_num) + BLOCK_SIZE;
+            ++merged;
+        }
+        fdatasync(previous.fd);
+    }
+    ::close(snapshot->fd);
+    unlink(path(_name).c_str());
+    chain.erase(it);
+    if (chain.empty()) {
+        epochs.assign(epochs.size(), 0);
+    }
+    response << "save: snapshot '" << _name << "' deleted";
+    if (merged) response << ", " << merged << " block(s) moved to an older snapshot";
+    response << std::endl;
+    return ErrorCode::SUCCESS;
+}
+
+// 块即将被覆盖或释放时把旧内容追加到最新的快照
+void NamedSnapshot::preserve(uint32_t block_num) {
+    if (chain.empty() || block_num >= epochs.size()) return;
+    NamedSnapshot& latest = chain.rbegin()->second;
+    if (epochs[block_num] >= latest.epoch) return;
+    epochs[block_num] = latest.epoch;
+    // 日志区和校验和表不会从快照中读取
+    if (block_num >= Journal::start && block_num < Journal::start + Journal::size) return;
+    if (block_num >= ChecksumTable::start && block_num < ChecksumTable::start + ChecksumTable::size) return;
+    Block block;
+    ssize_t n = pread(Disk::fd, &block, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+    if (n < BLOCK_SIZE) memset(reinterpret_cast<char*>(&block) + std::max<ssize_t>(n, 0), 0, BLOCK_SIZE - std::max<ssize_t>(n, 0));
+    pwrite(latest.fd, &block_num, sizeof(block_num), latest.end);
+    pwrite(latest.fd, &block, BLOCK_SIZE, latest.end + (off_t)sizeof(block_num));
+    latest.blocks.emplace(block_num, latest.end + (off_t)sizeof(block_num));
+    latest.end += sizeof(block_num) + BLOCK_SIZE;
+    ++preserved;
+}
+
+// 从当前快照视图读块：该快照及之后的快照都没有保存时，镜像中的内容就是快照创建时的内容
+void NamedSnapshot::read(uint32_t block_num, void* block) {
+    for (auto it = chain.find(view->epoch); it != chain.end(); ++it) {
+        auto found = it->second.blocks.find(block_num);
+        if (found != it->second.blocks.end()) {
+            pread(it->second.fd, block, BLOCK_SIZE, found->second);
+            return;
+        }
+    }
+    ssize_t n = pread(Disk::fd, block, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+    if (n < BLOCK_SIZE) memset(static_cast<char*>(block) + std::max<ssize_t>(n, 0), 0, BLOCK_SIZE - std::max<ssize_t>(n, 0));
+}
+
+/**
+ * @brief save 命令
+ *
+ * save 创建增量快照，save -l 列出快照，save -r <序号> <宿主机路径> 把快照还原为新的镜像文件；
+ * save @<名字> 创建命名快照，save -d @<名字> 删除命名快照。
+ *
+ * @param args 命令参数
+ * @return ErrorCode 操作结果
+ */
+ErrorCode Filesystem::save(const std::vector<std::string>& args) {
+    uint32_t blocks_num = super->superblock.blocks_num;
+    if (args.empty()) {
+        return take(response, blocks_num);
+    }
+    if (args[0] == "-l" && args.size() == 1) {
+        return list(response);
+    }
+    if (args.size() == 1 && args[0].size() > 1 && args[0][0] == '@') {
+        return NamedSnapshot::create(args[0].substr(1), response);
+    }
+    if (args[0] == "-d" && args.size() == 2 && args[1].size() > 1 && args[1][0] == '@') {
+        return NamedSnapshot::remove(args[1].substr(1), response);
+    }
+    if (args[0] == "-r" && args.size() == 3 && !args[1].empty() && args[1].size() < 10 && std::all_of(args[1].begin(), args[1].end(), ::isdigit)) {
+        return restore(response, std::stoul(args[1]), args[2]);
+    }
+    response << "usage: save [-l | -r <snapshot> <host path> | @<name> | -d @<name>]" << std::endl;
+    return ErrorCode::FAILURE;
+}
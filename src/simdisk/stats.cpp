@@ -0,0 +1,69 @@
+//
+// Created by eric on 12/05/23.
+//
+#include "filesystem.h"
+#include <chrono>
+#include <iomanip>
+
+uint64_t Histogram::percentile(double p) const {
+    if (count == 0) return 0;
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t)(p / 100. * count + 0.5));
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) return std::min(lower(i + 1) - 1, max);
+    }
+    return max;
+}
+
+// 以易读的单位输出微秒数
+static std::string duration(uint64_t us) {
+    std::ostringstream out;
+    if (us < 1000) out << us << "us";
+    else if (us < 1000000) out << std::fixed << std::setprecision(1) << us / 1000. << "ms";
+    else out << std::fixed << std::setprecision(2) << us / 1000000. << "s";
+    return out.str();
+}
+
+/**
+ * @brief 输出统计表
+ *
+ * 每个执行过的命令一行：次数、排队时间的中位数与 p99、执行时间的 p50/p90/p99/最大值、
+ * 总执行时间及每条命令平均读写的块数，按总执行时间从大到小排列。
+ */
+void Stats::report(std::ostream& out) {
+    auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - since).count();
+    std::vector<size_t> order;
+    for (size_t i = 0; i < (size_t)Opcode::COUNT; ++i) {
+        if (entries[i].exec.count > 0) order.push_back(i);
+    }
+    if (order.empty()) {
+        out << "stats: no commands recorded in the last " << elapsed << " s" << std::endl;
+        return;
+    }
+    std::sort(order.begin(), order.end(), [](size_t a, size_t b) { return entries[a].exec.sum > entries[b].exec.sum; });
+    out << std::left << std::setw(9) << "Command" << std::right << std::setw(8) << "Count"
+        << std::setw(10) << "Wait p50" << std::setw(10) << "Wait p99"
+        << std::setw(10) << "p50" << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "Max"
+        << std::setw(10) << "Total" << std::setw(10) << "Reads" << std::setw(10) << "Writes" << "\n";
+    for (size_t i: order) {
+        const Entry& entry = entries[i];
+        uint64_t count = entry.exec.count;
+        const char* name = Command::name((Opcode)i);
+        out << std::left << std::setw(9) << (*name ? name : "<none>") << std::right << std::setw(8) << count
+            << std::setw(10) << duration(entry.wait.percentile(50)) << std::setw(10) << duration(entry.wait.percentile(99))
+            << std::setw(10) << duration(entry.exec.percentile(50)) << std::setw(10) << duration(entry.exec.percentile(90))
+            << std::setw(10) << duration(entry.exec.percentile(99)) << std::setw(10) << duration(entry.exec.max)
+            << std::setw(10) << duration(entry.exec.sum)
+            << std::setw(10) << std::fixed << std::setprecision(1) << (double)entry.reads / count
+            << std::setw(10) << (double)entry.writes / count << "\n";
+    }
+    out << "Over the last " << elapsed << " s; reads and writes are blocks per command, percentiles are within 12.5%\n";
+}
+
+void Stats::reset() {
+    for (auto& entry: entries) {
+        entry = Entry();
+    }
+    since = std::chrono::steady_clock::now();
+}
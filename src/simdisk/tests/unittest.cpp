@@ -1,3 +1,530 @@
 //
 // Created by eric on 10/20/23.
 //
+#include "../volume.h"
+#include "../checksum.h"
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <string>
+#include <sys/file.h>
+#include <unistd.h>
+
+// 每个用例使用一个新格式化的小镜像
+class VolumeTest : public ::testing::Test {
+protected:
+    std::string image = "unittest-" + std::to_string(getpid()) + ".img";
+
+    void SetUp() override {
+        Geometry::size = 16 << 20;
+        Geometry::block_size = MIN_BLOCK_SIZE;
+        Journal::durable = false;
+        ASSERT_EQ(Volume::open(image, true), ErrorCode::SUCCESS);
+        ASSERT_EQ(Volume::mkdir("/home/t"), ErrorCode::SUCCESS);
+    }
+
+    void TearDown() override {
+        Volume::close();
+        Journal::durable = false;
+        ChecksumTable::data = false;
+        // 镜像、变更跟踪文件、快照文件和还原出的镜像都以镜像名开头
+        for (auto& file: std::filesystem::directory_iterator(".")) {
+            if (file.path().filename().string().rfind(image, 0) == 0) std::filesystem::remove(file.path());
+        }
+    }
+
+    // 生成与位置有关的数据，错位时能被发现
+    static std::string pattern(size_t size) {
+        std::string data(size, 0);
+        for (size_t i = 0; i < size; ++i) data[i] = (char)(i * 131 + i / 1024);
+        return data;
+    }
+
+    // 在一个事务中改动元数据来制造损坏；不经过日志写入的块在重新载入时会被日志中的旧内容覆盖
+    template<typename Body>
+    static void corrupt(Body&& body) {
+        Journal::transact([&] {
+            body();
+            return ErrorCode::SUCCESS;
+        });
+    }
+
+    // 以 root 身份运行 check，返回其输出
+    static ErrorCode check(const std::string& args, std::string& output) {
+        Filesystem fs;
+        Filesystem::response.str("");
+        ErrorCode code = Reclaimer::transact([&] { return fs.check(args, "root"); });
+        output = Filesystem::response.str();
+        Filesystem::response.str("");
+        return code;
+    }
+
+    // check 报告了 problem，check -r 修复后重新载入镜像，再次检查没有问题
+    void expect_repaired(const std::string& problem) {
+        std::string output;
+        EXPECT_EQ(check("", output), ErrorCode::FAILURE);
+        EXPECT_NE(output.find(problem), std::string::npos) << output;
+        EXPECT_EQ(check("-r", output), ErrorCode::SUCCESS) << output;
+        Volume::close();
+        ASSERT_EQ(Volume::open(image), ErrorCode::SUCCESS);
+        EXPECT_EQ(check("", output), ErrorCode::SUCCESS) << output;
+        EXPECT_NE(output.find("functioning properly"), std::string::npos) << output;
+    }
+
+    // 建一棵含子目录和文件的目录树
+    static void make_tree(const std::string& root) {
+        std::string data = pattern(3 * BLOCK_SIZE);
+        ASSERT_EQ(Volume::mkdir(root), ErrorCode::SUCCESS);
+        for (const char* directory: {"/a", "/b", "/a/c"}) {
+            ASSERT_EQ(Volume::mkdir(root + directory), ErrorCode::SUCCESS);
+            for (const char* file: {"/x", "/y"}) {
+                ASSERT_EQ(Volume::write_at(root + directory + file, 0, data.data(), data.size()), ErrorCode::SUCCESS);
+            }
+        }
+    }
+
+    // 以 rd 确认删除非空目录：只从父目录摘下，挂到孤儿链表上
+    static ErrorCode remove_tree(const std::string& root) {
+        Filesystem fs;
+        Filesystem::request_option = Option::RESPONSE;
+        ErrorCode code = Reclaimer::transact([&] { return fs.rd(root, "root"); });
+        Filesystem::request_option = Option::NONE;
+        Filesystem::response.str("");
+        return code;
+    }
+
+    // 执行 save 命令
+    static ErrorCode save(const std::vector<std::string>& args) {
+        Filesystem fs;
+        ErrorCode code = fs.save(args);
+        Filesystem::response.str("");
+        return code;
+    }
+
+    // 从命名快照中读取文件
+    static std::string read_snapshot(const std::string& name, const std::string& path) {
+        NamedSnapshot* snapshot = NamedSnapshot::find(name);
+        if (snapshot == nullptr) return "";
+        NamedSnapshot::View view(snapshot);
+        return read_all(path);
+    }
+
+    static std::string read_all(const std::string& path) {
+        EntryRecord record{};
+        if (Volume::stat(path, record) != ErrorCode::SUCCESS) return "";
+        std::string data(record.size, 0);
+        size_t n = 0;
+        Volume::read_at(path, 0, data.data(), data.size(), n);
+        data.resize(n);
+        return data;
+    }
+};
+
+// 文件从直接块增长到一级间接块，跨越边界的写入读回一致
+TEST_F(VolumeTest, WriteAcrossIndirectBoundary) {
+    const uint32_t block_size = BLOCK_SIZE;
+    std::string head = pattern(5 * block_size + 100);
+    ASSERT_EQ(Volume::write_at("/home/t/f", 0, head.data(), head.size()), ErrorCode::SUCCESS);
+
+    // 从第 6 个直接块中间写到第 2 个间接块中间
+    std::string middle(2 * block_size, 'x');
+    uint64_t offset = 5 * block_size + block_size / 2;
+    ASSERT_EQ(Volume::write_at("/home/t/f", offset, middle.data(), middle.size()), ErrorCode::SUCCESS);
+
+    std::string expected = head;
+    expected.resize(offset + middle.size());
+    expected.replace(offset, middle.size(), middle);
+    EXPECT_EQ(read_all("/home/t/f"), expected);
+
+    // 重新载入后仍然一致
+    Volume::close();
+    ASSERT_EQ(Volume::open(image), ErrorCode::SUCCESS);
+    EXPECT_EQ(read_all("/home/t/f"), expected);
+}
+
+// 写入位置超出文件末尾时，中间部分以 0 填充
+TEST_F(VolumeTest, SparseExtensionIsZeroFilled) {
+    const uint32_t block_size = BLOCK_SIZE;
+    ASSERT_EQ(Volume::write_at("/home/t/f", 0, "abc", 3), ErrorCode::SUCCESS);
+    uint64_t offset = 8 * block_size + 7;
+    ASSERT_EQ(Volume::write_at("/home/t/f", offset, "xyz", 3), ErrorCode::SUCCESS);
+
+    std::string expected(offset + 3, '\0');
+    expected.replace(0, 3, "abc");
+    expected.replace(offset, 3, "xyz");
+    EXPECT_EQ(read_all("/home/t/f"), expected);
+
+    EntryRecord record{};
+    ASSERT_EQ(Volume::stat("/home/t/f", record), ErrorCode::SUCCESS);
+    EXPECT_EQ(record.size, offset + 3);
+}
+
+// 持久化模式下，已提交但未同步的事务释放的块在同步之前不能直接覆盖
+TEST_F(VolumeTest, FreedBlocksWaitForSync) {
+    Journal::durable = true;
+    std::string data = pattern(4 * BLOCK_SIZE);
+    ASSERT_EQ(Volume::write_at("/home/t/f", 0, data.data(), data.size()), ErrorCode::SUCCESS);
+    Journal::sync();
+    EntryRecord record{};
+    ASSERT_EQ(Volume::stat("/home/t/f", record), ErrorCode::SUCCESS);
+    // 首个数据块随文件创建写入日志，取最后一个直接写入的数据块
+    uint32_t block_num = get_blocks(Filesystem::get_inode(record.inode_id)).back();
+    EXPECT_TRUE(Journal::ordered(block_num));
+
+    ASSERT_EQ(Volume::unlink("/home/t/f"), ErrorCode::SUCCESS);
+    EXPECT_FALSE(Journal::ordered(block_num));
+    Journal::sync();
+    EXPECT_TRUE(Journal::ordered(block_num));
+}
+
+// 已提交但还没有写回原位置的事务在载入时重放
+TEST_F(VolumeTest, RecoverReplaysCommittedTransactions) {
+    std::string data = pattern(3 * BLOCK_SIZE);
+    Journal::durable = true;
+    ASSERT_EQ(Volume::write_at("/home/t/f", 0, data.data(), data.size()), ErrorCode::SUCCESS);
+    ASSERT_FALSE(Journal::checkpoints.empty());
+
+    // 模拟崩溃：事务只在日志中，等待写回的块全部丢失
+    Journal::checkpoints.clear();
+    Journal::unsynced = 0;
+    Volume::close();
+    Journal::durable = false;
+
+    ASSERT_EQ(Volume::open(image), ErrorCode::SUCCESS);
+    EXPECT_GT(Journal::replayed, 0u);
+    EXPECT_EQ(read_all("/home/t/f"), data);
+}
+
+// 被放弃的事务不能留下对已有数据块的改写
+TEST_F(VolumeTest, AbortedOverwriteLeavesDataUnchanged) {
+    std::string data = pattern(3 * BLOCK_SIZE);
+    ASSERT_EQ(Volume::write_at("/home/t/f", 0, data.data(), data.size()), ErrorCode::SUCCESS);
+
+    std::string other(data.size(), 'y');
+    Journal::transact([&] {
+        ErrorCode code = Volume::write_at("/home/t/f", 0, other.data(), other.size());
+        Journal::cancel();
+        return code;
+    });
+    EXPECT_EQ(read_all("/home/t/f"), data);
+
+    Volume::close();
+    ASSERT_EQ(Volume::open(image), ErrorCode::SUCCESS);
+    EXPECT_EQ(read_all("/home/t/f"), data);
+}
+
+// 镜像被其他进程锁定时不能打开，也不能被重新格式化
+TEST_F(VolumeTest, OpenFailsWhileImageIsLocked) {
+    Volume::close();
+    int fd = ::open(image.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(flock(fd, LOCK_EX | LOCK_NB), 0);
+    EXPECT_EQ(Volume::open(image), ErrorCode::LOCKED);
+    EXPECT_EQ(Volume::open(image, true), ErrorCode::LOCKED);
+    ::close(fd);
+
+    ASSERT_EQ(Volume::open(image), ErrorCode::SUCCESS);
+    EntryRecord record{};
+    EXPECT_EQ(Volume::stat("/home/t", record), ErrorCode::SUCCESS);
+    EXPECT_TRUE(Filesystem::response.str().empty());
+}
+
+// 文件数据块的内容在镜像中被改动后，读取时校验不一致并计数（三种块大小）
+TEST_F(VolumeTest, CorruptedBlockIsReported) {
+    for (uint32_t block_size: {1024u, 4096u, 8192u}) {
+        SCOPED_TRACE("block size " + std::to_string(block_size));
+        Volume::close();
+        Geometry::block_size = block_size;
+        ChecksumTable::data = true;
+        ASSERT_EQ(Volume::open(image, true), ErrorCode::SUCCESS);
+        ASSERT_EQ(Volume::mkdir("/home/t"), ErrorCode::SUCCESS);
+        std::string data = pattern(3 * BLOCK_SIZE);
+        ASSERT_EQ(Volume::write_at("/home/t/f", 0, data.data(), data.size()), ErrorCode::SUCCESS);
+        EntryRecord record{};
+        ASSERT_EQ(Volume::stat("/home/t/f", record), ErrorCode::SUCCESS);
+        uint32_t block_num = get_blocks(Filesystem::get_inode(record.inode_id)).back();
+        ASSERT_NE(ChecksumTable::table[block_num], 0u);
+
+        // 未改动时校验通过
+        uint64_t verified = ChecksumTable::verified, mismatches = ChecksumTable::mismatches;
+        EXPECT_EQ(read_all("/home/t/f"), data);
+        EXPECT_GT(ChecksumTable::verified, verified);
+        EXPECT_EQ(ChecksumTable::mismatches, mismatches);
+
+        // 绕过文件系统改动镜像中的一个字节
+        int fd = ::open(image.c_str(), O_RDWR);
+        ASSERT_GE(fd, 0);
+        off_t offset = (off_t)block_num * BLOCK_SIZE + 17;
+        char byte = 0;
+        ASSERT_EQ(pread(fd, &byte, 1, offset), 1);
+        byte ^= 0x40;
+        ASSERT_EQ(pwrite(fd, &byte, 1, offset), 1);
+        ::close(fd);
+
+        verified = ChecksumTable::verified;
+        read_all("/home/t/f");
+        EXPECT_GT(ChecksumTable::verified, verified);
+        EXPECT_EQ(ChecksumTable::mismatches, mismatches + 1);
+
+        std::string block = data.substr(data.size() - BLOCK_SIZE);
+        EXPECT_TRUE(ChecksumTable::verify(block_num, block.data()));
+        block[17] ^= 0x40;
+        EXPECT_FALSE(ChecksumTable::verify(block_num, block.data()));
+        EXPECT_EQ(ChecksumTable::mismatches, mismatches + 2);
+    }
+}
+
+#if defined(__x86_64__)
+// 硬件指令与查表法的结果一致：覆盖三路交错的分界、非对齐的起始地址和三种块大小
+TEST(Crc32cTest, HardwareMatchesTable) {
+    if (!__builtin_cpu_supports("sse4.2")) GTEST_SKIP() << "the CPU does not support SSE4.2";
+    std::string buffer(MAX_BLOCK_SIZE + 64, 0);
+    for (size_t i = 0; i < buffer.size(); ++i) buffer[i] = (char)(i * 2654435761u >> 13);
+
+    std::vector<size_t> lengths = {0, 1, 7, 8, 9, 15, 16, 23, 24, 25, 100, 255, 256};
+    for (size_t length = 740; length <= 800; ++length) lengths.push_back(length);
+    for (uint32_t block_size: {1024u, 4096u, 8192u}) {
+        for (size_t length: {block_size - 25, block_size - 1, block_size, block_size + 1, block_size + 31}) {
+            lengths.push_back(length);
+        }
+    }
+    for (size_t length: lengths) {
+        for (size_t offset = 0; offset < 8; ++offset) {
+            const char* p = buffer.data() + offset;
+            ASSERT_EQ(crc32c_sse42(0, p, length), crc32c_table(0, p, length)) << "length " << length << ", offset " << offset;
+            ASSERT_EQ(crc32c_sse42(0x12345678, p, length), crc32c_table(0x12345678, p, length)) << "length " << length << ", offset " << offset;
+        }
+    }
+}
+
+// 分段计算的结果与整体计算相同，分段跨过交错计算的长度阈值
+TEST(Crc32cTest, SegmentsChain) {
+    if (!__builtin_cpu_supports("sse4.2")) GTEST_SKIP() << "the CPU does not support SSE4.2";
+    std::string buffer(3 * MAX_BLOCK_SIZE, 0);
+    for (size_t i = 0; i < buffer.size(); ++i) buffer[i] = (char)(i * 131 + 7);
+    for (uint32_t block_size: {1024u, 4096u, 8192u}) {
+        uint32_t whole = crc32c_table(0, buffer.data() + 3, block_size);
+        for (size_t split: {1u, 767u, 768u, 769u, block_size / 2, block_size - 1}) {
+            uint32_t crc = crc32c_sse42(0, buffer.data() + 3, split);
+            EXPECT_EQ(crc32c_sse42(crc, buffer.data() + 3 + split, block_size - split), whole) << "block size " << block_size << ", split " << split;
+        }
+    }
+}
+#endif
+
+// 目录项指向空闲的 inode
+TEST_F(VolumeTest, CheckRepairsDanglingEntry) {
+    EntryRecord directory{};
+    ASSERT_EQ(Volume::stat("/home/t", directory), ErrorCode::SUCCESS);
+    uint32_t free_id = Filesystem::super->superblock.inodes_num - 1;
+    ASSERT_FALSE(Filesystem::get_inode(free_id)->is_valid);
+    corrupt([&] {
+        Inode* inode = Filesystem::get_inode(directory.inode_id);
+        Filesystem::AutoBlock block(0, inode);
+        Entry& entry = block.elem()->entries[2];
+        entry.is_valid = true;
+        entry.inode_id = free_id;
+        strcpy(entry.name, "ghost");
+        block.mask(Filesystem::WRITE_MODE);
+        inode->size += sizeof(Entry);
+        Filesystem::save_inode(directory.inode_id);
+    });
+    expect_repaired("entry 'ghost' points to a free inode");
+    EntryRecord record{};
+    EXPECT_EQ(Volume::stat("/home/t/ghost", record), ErrorCode::FILE_NOT_FOUND);
+}
+
+// 文件的链接数与引用它的目录项数不一致
+TEST_F(VolumeTest, CheckRepairsLinkCount) {
+    ASSERT_EQ(Volume::write_at("/home/t/f", 0, "abc", 3), ErrorCode::SUCCESS);
+    EntryRecord record{};
+    ASSERT_EQ(Volume::stat("/home/t/f", record), ErrorCode::SUCCESS);
+    corrupt([&] {
+        Filesystem::get_inode(record.inode_id)->link_cnt = 5;
+        Filesystem::save_inode(record.inode_id);
+    });
+    expect_repaired("link count 5, expected 1");
+    EXPECT_EQ(Filesystem::get_inode(record.inode_id)->link_cnt, 1u);
+}
+
+// 位图中标记为已使用、但不属于任何文件的块
+TEST_F(VolumeTest, CheckRepairsLeakedBlock) {
+    uint32_t block_num = null;
+    corrupt([&] {
+        Block* block;
+        std::tie(block_num, block) = Filesystem::new_block();
+        Filesystem::release_block(block);
+    });
+    ASSERT_NE(block_num, null);
+    expect_repaired("block bitmap: 1 marked used but not in use");
+    EXPECT_FALSE(Filesystem::blocks_bitmap->bitmap[block_num / 8] & (1 << (block_num % 8)));
+}
+
+// 不被任何目录项引用的文件，修复后挂到 /lost+found 下
+TEST_F(VolumeTest, CheckReconnectsUnreachableInode) {
+    std::string data = pattern(BLOCK_SIZE + 10);
+    ASSERT_EQ(Volume::write_at("/home/t/f", 0, data.data(), data.size()), ErrorCode::SUCCESS);
+    EntryRecord directory{}, record{};
+    ASSERT_EQ(Volume::stat("/home/t", directory), ErrorCode::SUCCESS);
+    ASSERT_EQ(Volume::stat("/home/t/f", record), ErrorCode::SUCCESS);
+    corrupt([&] {
+        Inode* inode = Filesystem::get_inode(directory.inode_id);
+        Filesystem::AutoBlock block(0, inode);
+        for (auto& entry: block.elem()->all_entries()) {
+            if (entry.is_valid && strcmp(entry.name, "f") == 0) entry.is_valid = false;
+        }
+        block.mask(Filesystem::WRITE_MODE);
+        inode->size -= sizeof(Entry);
+        Filesystem::save_inode(directory.inode_id);
+    });
+    expect_repaired("inode " + std::to_string(record.inode_id) + ": unreachable file");
+    EXPECT_EQ(read_all("/lost+found/#" + std::to_string(record.inode_id)), data);
+}
+
+// 增量快照只包含变化的块，重启后仍可继续编号，并能分别还原出每个快照时的镜像
+TEST_F(VolumeTest, SnapshotRestoresEachVersion) {
+    std::string first = pattern(4 * BLOCK_SIZE), second(BLOCK_SIZE, 'b');
+    ASSERT_EQ(Volume::write_at("/home/t/f", 0, first.data(), first.size()), ErrorCode::SUCCESS);
+    ASSERT_EQ(save({}), ErrorCode::SUCCESS);
+    ASSERT_EQ(Volume::write_at("/home/t/f", 0, second.data(), second.size()), ErrorCode::SUCCESS);
+    ASSERT_EQ(Volume::write_at("/home/t/g", 0, "g", 1), ErrorCode::SUCCESS);
+    ASSERT_EQ(save({}), ErrorCode::SUCCESS);
+    EXPECT_LT(std::filesystem::file_size(Snapshot::path(1)), std::filesystem::file_size(Snapshot::path(0)));
+    ASSERT_EQ(Volume::write_at("/home/t/f", 0, "c", 1), ErrorCode::SUCCESS);
+
+    // 重启后快照序号和变更跟踪位图都保留；重放日志的写入也会被标记，位图是变化的块的超集
+    uint32_t changed = Snapshot::count;
+    Volume::close();
+    ASSERT_EQ(Volume::open(image), ErrorCode::SUCCESS);
+    EXPECT_EQ(Snapshot::next, 2u);
+    EXPECT_TRUE(Snapshot::complete);
+    EXPECT_GE(Snapshot::count, changed);
+    ASSERT_EQ(save({"-r", "0", image + ".r0"}), ErrorCode::SUCCESS);
+    ASSERT_EQ(save({"-r", "1", image + ".r1"}), ErrorCode::SUCCESS);
+
+    std::string expected = first;
+    expected.replace(0, second.size(), second);
+    EntryRecord record{};
+    ASSERT_EQ(Volume::open(image + ".r0"), ErrorCode::SUCCESS);
+    EXPECT_EQ(read_all("/home/t/f"), first);
+    EXPECT_EQ(Volume::stat("/home/t/g", record), ErrorCode::FILE_NOT_FOUND);
+    ASSERT_EQ(Volume::open(image + ".r1"), ErrorCode::SUCCESS);
+    EXPECT_EQ(read_all("/home/t/f"), expected);
+    EXPECT_EQ(read_all("/home/t/g"), "g");
+}
+
+// 快照文件头部记录的块数与文件大小不符时拒绝还原
+TEST_F(VolumeTest, RestoreRejectsDamagedSnapshot) {
+    ASSERT_EQ(Volume::write_at("/home/t/f", 0, "abc", 3), ErrorCode::SUCCESS);
+    ASSERT_EQ(save({}), ErrorCode::SUCCESS);
+    int fd = ::open(Snapshot::path(0).c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    Snapshot::Header header{};
+    ASSERT_EQ(pread(fd, &header, sizeof(header), 0), (ssize_t)sizeof(header));
+    header.count = 0x7fffffff;
+    ASSERT_EQ(pwrite(fd, &header, sizeof(header), 0), (ssize_t)sizeof(header));
+    ::close(fd);
+
+    Filesystem fs;
+    Filesystem::response.str("");
+    EXPECT_EQ(fs.save({"-r", "0", image + ".r0"}), ErrorCode::FAILURE);
+    EXPECT_NE(Filesystem::response.str().find("damaged"), std::string::npos) << Filesystem::response.str();
+    Filesystem::response.str("");
+}
+
+// 命名快照：覆盖前复制旧内容，各快照读到创建时的内容；删除较新的快照时其保存的块并入前一个快照
+TEST_F(VolumeTest, NamedSnapshotsCopyOnWrite) {
+    std::string a = pattern(2 * BLOCK_SIZE), b(2 * BLOCK_SIZE, 'b'), c(2 * BLOCK_SIZE, 'c');
+    std::string kept(BLOCK_SIZE, 'k'), later(BLOCK_SIZE, 'l');
+    ASSERT_EQ(Volume::write_at("/home/t/f", 0, a.data(), a.size()), ErrorCode::SUCCESS);
+    ASSERT_EQ(Volume::write_at("/home/t/g", 0, kept.data(), kept.size()), ErrorCode::SUCCESS);
+    ASSERT_EQ(save({"@s1"}), ErrorCode::SUCCESS);
+    ASSERT_EQ(Volume::write_at("/home/t/f", 0, b.data(), b.size()), ErrorCode::SUCCESS);
+    ASSERT_EQ(save({"@s2"}), ErrorCode::SUCCESS);
+    // g 在两个快照之间没有变化，只有 s2 保存了它的旧内容
+    uint64_t preserved = NamedSnapshot::preserved;
+    ASSERT_EQ(Volume::write_at("/home/t/f", 0, c.data(), c.size()), ErrorCode::SUCCESS);
+    ASSERT_EQ(Volume::write_at("/home/t/g", 0, later.data(), later.size()), ErrorCode::SUCCESS);
+    EXPECT_GT(NamedSnapshot::preserved, preserved);
+
+    EXPECT_EQ(read_snapshot("s1", "/home/t/f"), a);
+    EXPECT_EQ(read_snapshot("s2", "/home/t/f"), b);
+    EXPECT_EQ(read_snapshot("s1", "/home/t/g"), kept);
+    EXPECT_EQ(read_all("/home/t/f"), c);
+
+    // 重启后从快照文件重建索引
+    Volume::close();
+    ASSERT_EQ(Volume::open(image), ErrorCode::SUCCESS);
+    ASSERT_EQ(NamedSnapshot::chain.size(), 2u);
+    EXPECT_EQ(read_snapshot("s1", "/home/t/f"), a);
+    EXPECT_EQ(read_snapshot("s2", "/home/t/f"), b);
+
+    ASSERT_EQ(save({"-d", "@s2"}), ErrorCode::SUCCESS);
+    EXPECT_EQ(NamedSnapshot::find("s2"), nullptr);
+    EXPECT_EQ(read_snapshot("s1", "/home/t/f"), a);
+    EXPECT_EQ(read_snapshot("s1", "/home/t/g"), kept);
+    EXPECT_EQ(read_all("/home/t/g"), later);
+
+    ASSERT_EQ(save({"-d", "@s1"}), ErrorCode::SUCCESS);
+    EXPECT_TRUE(NamedSnapshot::chain.empty());
+    EXPECT_EQ(read_all("/home/t/f"), c);
+}
+
+// rd 摘下的目录树由回收线程释放，回收后位图计数恢复，检查没有问题
+TEST_F(VolumeTest, ReclaimerFreesRemovedTree) {
+    uint32_t blocks = Filesystem::blocks_bitmap->counter, inodes = Filesystem::inodes_bitmap->counter;
+    make_tree("/home/t/d");
+    ASSERT_EQ(remove_tree("/home/t/d"), ErrorCode::SUCCESS);
+    EntryRecord record{};
+    EXPECT_EQ(Volume::stat("/home/t/d", record), ErrorCode::FILE_NOT_FOUND);
+    EXPECT_EQ(Reclaimer::pending, 1u);
+    EXPECT_NE(Filesystem::super->superblock.orphan_inode, 0u);
+    EXPECT_GT(Filesystem::inodes_bitmap->counter, inodes);
+
+    Reclaimer::drain();
+    EXPECT_EQ(Reclaimer::pending, 0u);
+    EXPECT_EQ(Filesystem::super->superblock.orphan_inode, 0u);
+    EXPECT_EQ(Filesystem::blocks_bitmap->counter, blocks);
+    EXPECT_EQ(Filesystem::inodes_bitmap->counter, inodes);
+    std::string output;
+    EXPECT_EQ(check("", output), ErrorCode::SUCCESS) << output;
+}
+
+// check 先回收孤儿链表，其中的目录树不会被当作不可达的 inode
+TEST_F(VolumeTest, CheckDrainsOrphansFirst) {
+    uint32_t blocks = Filesystem::blocks_bitmap->counter, inodes = Filesystem::inodes_bitmap->counter;
+    make_tree("/home/t/d");
+    ASSERT_EQ(remove_tree("/home/t/d"), ErrorCode::SUCCESS);
+    ASSERT_EQ(Reclaimer::pending, 1u);
+
+    std::string output;
+    EXPECT_EQ(check("", output), ErrorCode::SUCCESS) << output;
+    EXPECT_NE(output.find("functioning properly"), std::string::npos) << output;
+    EXPECT_EQ(Reclaimer::pending, 0u);
+    EXPECT_EQ(Filesystem::blocks_bitmap->counter, blocks);
+    EXPECT_EQ(Filesystem::inodes_bitmap->counter, inodes);
+}
+
+// 孤儿链表随超级块持久化，重启后继续回收
+TEST_F(VolumeTest, ReclaimerResumesAfterRestart) {
+    uint32_t blocks = Filesystem::blocks_bitmap->counter, inodes = Filesystem::inodes_bitmap->counter;
+    make_tree("/home/t/d");
+    make_tree("/home/t/e");
+    ASSERT_EQ(remove_tree("/home/t/d"), ErrorCode::SUCCESS);
+    ASSERT_EQ(remove_tree("/home/t/e"), ErrorCode::SUCCESS);
+    ASSERT_EQ(Reclaimer::pending, 2u);
+
+    // 关闭镜像会先回收，复制一份还没有回收的镜像来模拟重启
+    std::string crashed = image + ".crashed";
+    std::filesystem::copy_file(image, crashed);
+    ASSERT_EQ(Volume::open(crashed), ErrorCode::SUCCESS);
+    EXPECT_EQ(Reclaimer::pending, 2u);
+    EXPECT_NE(Filesystem::super->superblock.orphan_inode, 0u);
+
+    Reclaimer::drain();
+    EXPECT_EQ(Filesystem::super->superblock.orphan_inode, 0u);
+    EXPECT_EQ(Filesystem::blocks_bitmap->counter, blocks);
+    EXPECT_EQ(Filesystem::inodes_bitmap->counter, inodes);
+    std::string output;
+    EXPECT_EQ(check("", output), ErrorCode::SUCCESS) << output;
+}
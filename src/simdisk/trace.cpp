@@ -0,0 +1,131 @@
+//
+// Created by eric on 12/12/23.
+//
+#include "trace.h"
+#include <fcntl.h>
+#include <sys/uio.h>
+
+// 当前构建的操作码名表
+static std::string opcode_names() {
+    std::string names((size_t)Opcode::COUNT * TRACE_NAME_SIZE, '\0');
+    for (size_t i = 0; i < (size_t)Opcode::COUNT; ++i) {
+        const char* name = Command::name((Opcode)i);
+        memcpy(names.data() + i * TRACE_NAME_SIZE, name, std::min(strlen(name), (size_t)TRACE_NAME_SIZE - 1));
+    }
+    return names;
+}
+
+bool Trace::open(const std::string& file) {
+    if (fd >= 0) ::close(fd);
+    path = file;
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return false;
+    TraceHeader header{TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRecord), (uint32_t)Opcode::COUNT};
+    std::string names = opcode_names();
+    // 新文件先写入文件头和操作码名表
+    if (lseek(fd, 0, SEEK_END) == 0) {
+        iovec parts[2] = {{&header, sizeof(header)}, {names.data(), names.size()}};
+        writev(fd, parts, 2);
+        return true;
+    }
+    // 追加到已有的文件时，文件头和操作码名表必须与当前构建完全相同
+    TraceHeader existing{};
+    std::string recorded(names.size(), '\0');
+    if (pread(fd, &existing, sizeof(existing), 0) != sizeof(existing) || memcmp(&existing, &header, sizeof(header)) != 0
+        || pread(fd, recorded.data(), recorded.size(), sizeof(header)) != (ssize_t)recorded.size() || recorded != names) {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief 追加一条请求
+ *
+ * 头部、请求数据和批量请求项用一次 writev 写入，进程异常退出时最多丢失正在写的一条。
+ */
+void Trace::record(const TraceRecord& record, std::string_view data, std::string_view payload) {
+    if (fd < 0) return;
+    iovec parts[3] = {
+        {const_cast<TraceRecord*>(&record), sizeof(record)},
+        {const_cast<char*>(data.data()), data.size()},
+        {const_cast<char*>(payload.data()), payload.size()},
+    };
+    if (writev(fd, parts, 3) > 0) ++recorded;
+}
+
+int Trace::open_read(const std::string& file, std::string& error) {
+    int in = ::open(file.c_str(), O_RDONLY);
+    if (in < 0) {
+        error = "cannot be opened";
+        return -1;
+    }
+    if (!read_header(in, error)) {
+        ::close(in);
+        return -1;
+    }
+    return in;
+}
+
+// 读满 size 字节
+static bool read_full(int in, void* data, size_t size) {
+    auto* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = read(in, p, size);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief 读取文件头和操作码名表
+ *
+ * 按命令名把记录时的操作码映射为当前的操作码；当前构建没有的命令映射为 Opcode::NONE，
+ * 重放时与Shell发送的未知命令一样处理，其名字记入 unknown。
+ */
+bool Trace::read_header(int in, std::string& error) {
+    TraceHeader header{};
+    if (!read_full(in, &header, sizeof(header)) || header.magic != TRACE_MAGIC) {
+        error = "is not a request trace";
+        return false;
+    }
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord) || header.opcodes > 256) {
+        error = "was recorded in trace format " + std::to_string(header.version) + ", this build reads format "
+                + std::to_string(TRACE_VERSION);
+        return false;
+    }
+    std::string names(header.opcodes * TRACE_NAME_SIZE, '\0');
+    if (!read_full(in, names.data(), names.size())) {
+        error = "has an incomplete opcode table";
+        return false;
+    }
+    memset(opcodes, (uint8_t)Opcode::NONE, sizeof(opcodes));
+    unknown.clear();
+    for (uint32_t i = 1; i < header.opcodes; ++i) {
+        std::string name(names.c_str() + i * TRACE_NAME_SIZE, strnlen(names.c_str() + i * TRACE_NAME_SIZE, TRACE_NAME_SIZE));
+        Opcode opcode = Command::parse(name).opcode;
+        if (opcode == Opcode::NONE) unknown.push_back(name);
+        opcodes[i] = (uint8_t)opcode;
+    }
+    return true;
+}
+
+bool Trace::next(int in, TraceRecord& record, std::string& data, std::string& payload) {
+    if (!read_full(in, &record, sizeof(record))) return false;
+    data.resize(record.length);
+    payload.resize(record.payload);
+    if (!read_full(in, data.data(), data.size()) || !read_full(in, payload.data(), payload.size())) return false;
+    // 二进制编码的命令以操作码开头，批量请求的各项也可能是二进制的
+    if (record.binary && !data.empty()) data[0] = (char)opcodes[(uint8_t)data[0]];
+    size_t offset = 0;
+    while (offset + sizeof(BatchItem) <= payload.size()) {
+        auto* item = reinterpret_cast<BatchItem*>(payload.data() + offset);
+        if (offset + BatchItem::space(item->length) > payload.size()) break;
+        if (item->binary && item->length > 0) item->data()[0] = (char)opcodes[(uint8_t)item->data()[0]];
+        offset += BatchItem::space(item->length);
+    }
+    return true;
+}
@@ -0,0 +1,77 @@
+//
+// Created by eric on 12/12/23.
+//
+
+#ifndef SIMPLE_OS_TRACE_H
+#define SIMPLE_OS_TRACE_H
+#include "../common/common.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define TRACE_MAGIC 0x45435254                    // 请求记录文件标志 "TRCE"
+#define TRACE_VERSION 2                           // 记录格式的版本
+#define TRACE_NAME_SIZE 16                        // 操作码名表中每个命令名占用的字节数
+
+/**
+ * @brief 请求记录文件头
+ *
+ * 其后是 opcodes 个 TRACE_NAME_SIZE 字节的命令名，下标为记录时的操作码。
+ * 二进制请求中的操作码与构建有关，重放时按命令名换算为当前的操作码。
+ */
+struct TraceHeader {
+    uint32_t magic;          // TRACE_MAGIC
+    uint32_t version;        // TRACE_VERSION
+    uint32_t record_size;    // 每条记录头部的字节数
+    uint32_t opcodes;        // 操作码名表的项数
+};
+
+/**
+ * @brief 一条请求的记录头部
+ *
+ * 其后紧跟 length 字节的请求数据和 payload 字节的批量请求项（批量请求的各项位于Shell的数据区中，
+ * 不在请求数据里）。
+ */
+struct TraceRecord {
+    int64_t time;            // 请求进入消息队列的时间，自 1970 年起的纳秒数
+    uint32_t pid;            // Shell 的进程ID
+    uint32_t id;             // 请求ID
+    uint32_t length;         // 请求数据的字节数
+    uint32_t payload;        // 批量请求项的字节数
+    uint8_t option;          // 请求选项
+    uint8_t binary;          // 请求数据是否为二进制编码的命令
+    uint8_t reserved[6];
+};
+static_assert(sizeof(TraceRecord) == 32);
+
+/**
+ * @brief 请求记录
+ *
+ * 用 --record 启动时，处理线程把取出的每个请求追加到记录文件，
+ * 之后可用 --replay 在进程内按原有的时间间隔或尽快重放，用相同的输入比较不同版本的性能。
+ */
+struct Trace {
+    inline static int fd = -1;                  // 记录文件，未记录时为 -1
+    inline static std::string path;             // 记录文件路径
+    inline static uint64_t recorded = 0;        // 已记录的请求数
+    inline static uint8_t opcodes[256];         // 记录时的操作码到当前操作码的映射
+    inline static std::vector<std::string> unknown; // 记录中当前构建没有的命令，按未知命令重放
+
+    // 打开（追加）记录文件，已有的文件必须由操作码相同的构建记录
+    static bool open(const std::string& file);
+
+    // 追加一条请求
+    static void record(const TraceRecord& record, std::string_view data, std::string_view payload);
+
+    // 打开记录文件并读取文件头和操作码名表，返回文件描述符，失败时返回 -1 并在 error 中说明原因
+    static int open_read(const std::string& file, std::string& error);
+
+    // 读取下一条请求，其中的操作码已换算为当前的操作码；文件结束或记录不完整时返回 false
+    static bool next(int in, TraceRecord& record, std::string& data, std::string& payload);
+
+private:
+    // 读取文件头和操作码名表，建立操作码的映射
+    static bool read_header(int in, std::string& error);
+};
+#endif //SIMPLE_OS_TRACE_H
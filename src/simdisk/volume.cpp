@@ -0,0 +1,212 @@
+//
+// Created by eric on 12/14/23.
+//
+#include "volume.h"
+#include <algorithm>
+#include <sys/stat.h>
+
+using AutoBlock = Filesystem::AutoBlock;
+using AutoEntry = Filesystem::AutoEntry;
+
+// 单个文件最多使用的数据块数（直接块、一级间接块和二级间接块），随块大小变化
+#define MAX_FILE_BLOCKS (6 + POINTERS_PER_BLOCK + (uint64_t)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
+
+/**
+ * @brief AutoQuiet 结构体
+ *
+ * Volume 不输出文本：离开作用域时丢弃引擎写入 Filesystem::response 的内容，
+ * 长时间使用时输出不会累积。
+ */
+struct AutoQuiet {
+    ~AutoQuiet() {
+        Filesystem::response.str("");
+    }
+};
+
+ErrorCode Volume::open(const std::string& image, bool create) {
+    AutoQuiet quiet;
+    if (opened) close();
+    struct stat st{};
+    if (!create && ::stat(image.c_str(), &st) != 0) return ErrorCode::FILE_NOT_FOUND;
+    state = !create;
+    ErrorCode err = create ? fs._new(image) : fs.load(image);
+    if (err != ErrorCode::SUCCESS) return err;
+    opened = true;
+    return ErrorCode::SUCCESS;
+}
+
+void Volume::close() {
+    if (!opened) return;
+    AutoQuiet quiet;
+    // 没有回收线程，rd 留下的目录树在关闭前回收
+    Reclaimer::drain();
+    fs.release();
+    Disk::close_disk();
+    Filesystem::super = nullptr;
+    user_log = nullptr;
+    // 校验和表属于这个镜像，下一个镜像载入之前的读取不能用它校验
+    ChecksumTable::size = 0;
+    ChecksumTable::table.clear();
+    ChecksumTable::dirty.clear();
+    ChecksumTable::deferred.clear();
+    opened = false;
+}
+
+ErrorCode Volume::lookup(const std::string& path, AutoEntry& parent, AutoEntry& entry) {
+    if (!opened) return ErrorCode::FAILURE;
+    Filesystem::current_shell_pid = 0;
+    auto [directory, name] = fs.split_path_and_name(path);
+    parent.set(fs.get_path_entry(directory).second);
+    if (parent == nullptr) return ErrorCode::FILE_NOT_FOUND;
+    entry.set(fs.get_path_entry(path).second);
+    return entry == nullptr ? ErrorCode::FILE_NOT_FOUND : ErrorCode::SUCCESS;
+}
+
+ErrorCode Volume::stat(const std::string& path, EntryRecord& record) {
+    AutoQuiet quiet;
+    AutoEntry parent, entry;
+    ErrorCode err = lookup(path, parent, entry);
+    if (err != ErrorCode::SUCCESS) return err;
+    record = Filesystem::entry_record(*entry.elem(), Filesystem::get_inode(entry.elem()->inode_id));
+    return ErrorCode::SUCCESS;
+}
+
+ErrorCode Volume::readdir(const std::string& path, std::vector<EntryRecord>& records) {
+    AutoQuiet quiet;
+    AutoEntry parent, entry;
+    ErrorCode err = lookup(path, parent, entry);
+    if (err != ErrorCode::SUCCESS) return err;
+    Inode* inode = Filesystem::get_inode(entry.elem()->inode_id);
+    if (inode->type != 'd') return ErrorCode::FILE_NOT_MATCH;
+    if (fs.check_entry(entry.elem(), user.c_str(), Option::READ) != ErrorCode::SUCCESS) return ErrorCode::PERMISSION_DENIED;
+    AutoBlock block(0, inode);
+    for (const auto& file: block.elem()->all_entries()) {
+        if (file.is_valid) records.push_back(Filesystem::entry_record(file, Filesystem::get_inode(file.inode_id)));
+    }
+    return ErrorCode::SUCCESS;
+}
+
+ErrorCode Volume::mkdir(const std::string& path) {
+    AutoQuiet quiet;
+    AutoEntry parent, entry;
+    ErrorCode err = lookup(path, parent, entry);
+    if (err == ErrorCode::SUCCESS) return ErrorCode::EXISTS;
+    if (parent == nullptr) return err;
+    if (fs.check_entry(parent.elem(), user.c_str(), Option::WRITE) != ErrorCode::SUCCESS) return ErrorCode::PERMISSION_DENIED;
+    return Reclaimer::transact([&] { return fs.new_directory(parent.elem(), fs.split_path_and_name(path).second.c_str(), user.c_str()); });
+}
+
+ErrorCode Volume::unlink(const std::string& path) {
+    AutoQuiet quiet;
+    AutoEntry parent, entry;
+    ErrorCode err = lookup(path, parent, entry);
+    if (err != ErrorCode::SUCCESS) return err;
+    if (fs.check_entry(parent.elem(), user.c_str(), Option::WRITE) != ErrorCode::SUCCESS) return ErrorCode::PERMISSION_DENIED;
+    return Reclaimer::transact([&] { return fs.delete_file(parent.elem(), entry.elem()->name, user.c_str()); });
+}
+
+ErrorCode Volume::read_at(const std::string& path, uint64_t offset, char* data, size_t size, size_t& read) {
+    AutoQuiet quiet;
+    read = 0;
+    AutoEntry parent, entry;
+    ErrorCode err = lookup(path, parent, entry);
+    if (err != ErrorCode::SUCCESS) return err;
+    Inode* inode = Filesystem::get_inode(entry.elem()->inode_id);
+    if (inode->type == 'd') return ErrorCode::FILE_NOT_MATCH;
+    if (fs.check_entry(entry.elem(), user.c_str(), Option::READ) != ErrorCode::SUCCESS) return ErrorCode::PERMISSION_DENIED;
+    if (offset >= inode->size) return ErrorCode::SUCCESS;
+    uint64_t end = std::min<uint64_t>(inode->size, offset + size);
+    uint32_t block_size = Filesystem::super->superblock.block_size;
+    std::vector<uint32_t> blocks = get_blocks(inode);
+    for (uint64_t i = offset / block_size; i * block_size < end && i < blocks.size(); ++i) {
+        AutoBlock block(blocks[i]);
+        uint64_t from = std::max<uint64_t>(offset, i * block_size), to = std::min<uint64_t>(end, (i + 1) * block_size);
+        memcpy(data + (from - offset), block.elem()->data + (from - i * block_size), to - from);
+        read += to - from;
+    }
+    return ErrorCode::SUCCESS;
+}
+
+// 释放 Inode 的间接块（不含其指向的数据块）
+static void release_indirect(Inode* inode) {
+    if (inode->i_block[7] != null) {
+        AutoBlock block(inode->i_block[7]);
+        for (uint32_t pointer: block.elem()->all_pointers()) {
+            if (pointer != null) Filesystem::delete_block(pointer);
+        }
+    }
+    for (uint32_t i = 6; i < 9; ++i) {
+        if (inode->i_block[i] != null) Filesystem::delete_block(inode->i_block[i]);
+    }
+}
+
+/**
+ * @brief 写入文件的指定位置
+ *
+ * 需要更多数据块时只分配新块，重建间接块后写入；否则直接改写 [offset, offset + size) 涉及的块。
+ * 原文件末尾到 offset 之间的部分与数据一起写入 0。
+ */
+ErrorCode Volume::write_at(const std::string& path, uint64_t offset, const char* data, size_t size) {
+    AutoQuiet quiet;
+    AutoEntry parent, entry;
+    ErrorCode err = lookup(path, parent, entry);
+    if (err == ErrorCode::FILE_NOT_FOUND && parent != nullptr) {
+        if (fs.check_entry(parent.elem(), user.c_str(), Option::WRITE) != ErrorCode::SUCCESS) return ErrorCode::PERMISSION_DENIED;
+        err = Reclaimer::transact([&] { return fs.new_file(parent.elem(), fs.split_path_and_name(path).second.c_str(), user.c_str()); });
+        if (err != ErrorCode::SUCCESS) return err;
+        entry.set(fs.get_path_entry(path).second);
+    } else if (err != ErrorCode::SUCCESS) {
+        return err;
+    }
+    Inode* inode = Filesystem::get_inode(entry.elem()->inode_id);
+    if (inode->type == 'd') return ErrorCode::FILE_NOT_MATCH;
+    if (fs.check_entry(entry.elem(), user.c_str(), Option::WRITE) != ErrorCode::SUCCESS) return ErrorCode::PERMISSION_DENIED;
+    uint64_t end = offset + size;
+    if (size == 0) return ErrorCode::SUCCESS;
+    uint32_t block_size = Filesystem::super->superblock.block_size;
+    uint64_t needed = (end + block_size - 1) / block_size;
+    if (needed > MAX_FILE_BLOCKS || end > UINT32_MAX) return ErrorCode::EXCEEDED;
+    return Reclaimer::transact([&] { return write_blocks(parent.elem()->inode_id, entry.elem()->inode_id, offset, data, size); });
+}
+
+// 在一个事务中写入文件的数据块，并更新 inode 和所在目录的用量
+ErrorCode Volume::write_blocks(uint32_t directory_id, uint32_t inode_id, uint64_t offset, const char* data, size_t size) {
+    Inode* inode = Filesystem::get_inode(inode_id);
+    uint64_t end = offset + size;
+    uint32_t block_size = Filesystem::super->superblock.block_size;
+    uint64_t needed = (end + block_size - 1) / block_size;
+    Filesystem::goal_group = Filesystem::inode_group(inode_id);
+    uint32_t old_size = inode->size, old_capacity = inode->capacity;
+    std::vector<uint32_t> blocks = get_blocks(inode);
+    if (needed > blocks.size()) {
+        size_t old = blocks.size();
+        blocks.resize(needed);
+        for (size_t i = old; i < needed; ++i) {
+            auto [id, block] = Filesystem::new_block();
+            if (id == null) {
+                // 空间不足，归还本次分配的块
+                for (size_t j = old; j < i; ++j) Filesystem::delete_block(blocks[j]);
+                return ErrorCode::EXCEEDED;
+            }
+            Filesystem::release_block(block);
+            blocks[i] = id;
+        }
+        release_indirect(inode);
+        memset(inode->i_block, null, sizeof(inode->i_block));
+        set_blocks(inode, blocks, needed);
+        inode->capacity = needed * block_size;
+    }
+    uint64_t from = std::min<uint64_t>(offset, inode->size);
+    for (uint64_t i = from / block_size; i < needed; ++i) {
+        AutoBlock block(blocks[i], Filesystem::GET | Filesystem::WRITE_MODE | Filesystem::DATA_MODE);
+        uint64_t start = i * block_size;
+        uint64_t lo = std::max<uint64_t>(from, start), hi = std::min<uint64_t>(end, start + block_size);
+        uint64_t split = std::clamp<uint64_t>(offset, lo, hi);
+        memset(block.elem()->data + (lo - start), 0, split - lo);
+        memcpy(block.elem()->data + (split - start), data + (split - offset), hi - split);
+    }
+    inode->size = std::max<uint64_t>(inode->size, end);
+    Filesystem::save_inode(inode_id);
+    fs.account(directory_id, (int64_t)inode->size - old_size, ((int64_t)inode->capacity - old_capacity) / block_size);
+    return ErrorCode::SUCCESS;
+}
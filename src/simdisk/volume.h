@@ -0,0 +1,96 @@
+//
+// Created by eric on 12/14/23.
+//
+
+#ifndef SIMPLE_OS_VOLUME_H
+#define SIMPLE_OS_VOLUME_H
+#include "filesystem.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief 进程内访问磁盘镜像的接口
+ *
+ * 直接调用文件系统引擎，不经过共享内存和Shell，也不向 Filesystem::response 输出文本：
+ * 每个函数返回错误码，结果以 EntryRecord 等结构返回。修改磁盘的操作各自作为一个事务提交。
+ *
+ * 与 Filesystem 一样，一个进程同时只能打开一个镜像。打开时取得镜像文件的独占锁，镜像被 Simdisk 服务
+ * 或其他进程打开时 open 返回 LOCKED；本接口不使用 /usr/lock 下的文件锁。路径一律为绝对路径，权限按 user 检查。
+ */
+class Volume {
+public:
+    inline static std::string user = "root";    // 权限检查使用的用户名
+
+/**
+ * @brief 打开磁盘镜像
+ *
+ * @param image 镜像文件路径
+ * @param create 为 true 时格式化新镜像（大小等由 Geometry 决定），否则载入已有镜像
+ * @return ErrorCode 镜像不存在时返回 FILE_NOT_FOUND，正被其他进程使用时返回 LOCKED
+ */
+    static ErrorCode open(const std::string& image, bool create = false);
+
+    // 关闭镜像：回收 rd 留下的目录树，释放文件系统占用的内存和镜像的锁
+    static void close();
+
+/**
+ * @brief 获取文件或目录的信息
+ *
+ * @param path 路径
+ * @param record 文件信息
+ * @return ErrorCode 路径不存在时返回 FILE_NOT_FOUND
+ */
+    static ErrorCode stat(const std::string& path, EntryRecord& record);
+
+/**
+ * @brief 列出目录
+ *
+ * @param path 目录路径
+ * @param records 目录中每一项（含 . 和 ..）的信息
+ * @return ErrorCode 路径不是目录时返回 FILE_NOT_MATCH
+ */
+    static ErrorCode readdir(const std::string& path, std::vector<EntryRecord>& records);
+
+    // 创建目录
+    static ErrorCode mkdir(const std::string& path);
+
+    // 删除文件（不能删除目录）
+    static ErrorCode unlink(const std::string& path);
+
+/**
+ * @brief 从文件的指定位置读取
+ *
+ * @param path 文件路径
+ * @param offset 起始位置
+ * @param data 缓冲区
+ * @param size 最多读取的字节数
+ * @param read 实际读取的字节数，超出文件末尾的部分不读取
+ * @return ErrorCode 操作结果
+ */
+    static ErrorCode read_at(const std::string& path, uint64_t offset, char* data, size_t size, size_t& read);
+
+/**
+ * @brief 写入文件的指定位置
+ *
+ * 文件不存在时先创建。只改写涉及的数据块；写入位置超出文件末尾时扩展文件，中间部分以 0 填充。
+ *
+ * @param path 文件路径
+ * @param offset 起始位置
+ * @param data 数据
+ * @param size 字节数
+ * @return ErrorCode 超出单个文件的最大长度时返回 EXCEEDED
+ */
+    static ErrorCode write_at(const std::string& path, uint64_t offset, const char* data, size_t size);
+
+private:
+    inline static Filesystem fs;
+    inline static bool opened = false;
+
+    // 查找路径对应的目录项，parent 为其所在目录
+    static ErrorCode lookup(const std::string& path, Filesystem::AutoEntry& parent, Filesystem::AutoEntry& entry);
+
+    // write_at 中修改磁盘的部分，作为一个事务执行
+    static ErrorCode write_blocks(uint32_t directory_id, uint32_t inode_id, uint64_t offset, const char* data, size_t size);
+};
+#endif //SIMPLE_OS_VOLUME_H
@@ -0,0 +1,364 @@
+//
+// Created by eric on 12/15/23.
+//
+#include "filesystem.h"
+#include <atomic>
+#include <deque>
+#include <fnmatch.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace {
+// 一个工作线程的目录队列
+struct WorkQueue {
+    std::mutex mutex;
+    std::deque<Filesystem::WalkDirectory> directories;
+};
+
+// 拼接路径
+std::string join(const std::string& parent, const char* name) {
+    if (!parent.empty() && parent.back() == '/') return parent + name;
+    return parent + '/' + name;
+}
+
+// 去掉路径末尾多余的 '/'，根目录除外
+std::string trim(std::string path) {
+    while (path.size() > 1 && path.back() == '/') path.pop_back();
+    return path;
+}
+
+// 一个目录的子树用量
+struct Usage {
+    uint32_t parent_id;      // 上级目录的 inode
+    uint32_t depth;          // 相对于起始目录的深度
+    std::string path;        // 显示的路径
+    uint64_t bytes;          // 文件的总字节数
+    uint64_t blocks;         // 文件和目录占用的块数
+};
+
+/**
+ * @brief 遍历目录树统计每个目录的子树用量
+ *
+ * 先统计每个目录自身的数据块和其中的文件，遍历结束后按深度从深到浅累加到上级目录。
+ *
+ * @param fs 文件系统
+ * @param root_id 起始目录
+ * @param root_path 起始目录显示的路径
+ * @param user 用户名，为空时不检查权限
+ * @param denied 没有读权限而跳过的目录数
+ * @return 目录的 inode 到其子树用量的映射
+ */
+std::map<uint32_t, Usage> collect_usage(Filesystem& fs, uint32_t root_id, const std::string& root_path, const char* user, uint32_t& denied) {
+    std::map<uint32_t, Usage> usages;
+    std::mutex mutex;
+    uint32_t block_size = Filesystem::super->superblock.block_size;
+    fs.walk(root_id, root_path, [&](const Filesystem::WalkDirectory& directory, const std::vector<const Entry*>& entries) {
+        Usage usage{directory.parent_id, directory.depth, directory.path, 0, 1};
+        for (const Entry* file: entries) {
+            Inode* child = Filesystem::get_inode(file->inode_id);
+            // 子目录在遍历到它时单独统计
+            if (child->type == 'd') continue;
+            usage.bytes += child->size;
+            usage.blocks += child->capacity / block_size;
+        }
+        std::lock_guard<std::mutex> guard(mutex);
+        usages[directory.inode_id] = std::move(usage);
+    }, denied, user);
+    std::vector<Usage*> order;
+    for (auto& [id, usage]: usages) {
+        order.push_back(&usage);
+    }
+    std::sort(order.begin(), order.end(), [](const Usage* a, const Usage* b) { return a->depth > b->depth; });
+    for (Usage* usage: order) {
+        if (usage->depth == 0) continue;
+        auto parent = usages.find(usage->parent_id);
+        if (parent == usages.end()) continue;
+        parent->second.bytes += usage->bytes;
+        parent->second.blocks += usage->blocks;
+    }
+    return usages;
+}
+
+// 按 ll 的格式输出大小
+void print_size(std::ostream& out, uint64_t size) {
+    if (size < 1024) {
+        out << std::right << std::setw(9) << size << "B";
+    } else if (size < 1024 * 1024) {
+        out << std::right << std::setw(9) << std::fixed << std::setprecision(2) << size / 1024. << "K";
+    } else {
+        out << std::right << std::setw(9) << std::fixed << std::setprecision(2) << size / (1024. * 1024) << "M";
+    }
+}
+}
+
+/**
+ * @brief 并行遍历目录树
+ *
+ * 每个工作线程有自己的目录队列：从自己的队头取目录，因此大体按层（广度优先）推进；
+ * 自己的队列为空时从其他线程的队尾窃取。读取一个目录时先把其中的子目录放入自己的队列，
+ * 并提示内核预读子目录的数据块，再调用 visit，使其他线程在 visit 输出结果时继续遍历。
+ * 没有读权限的目录不列出也不进入，只计数；已经遍历过的目录（损坏的目录树中的环）不再进入。
+ * 快照视图中读取 inode 会修改共享的缓存，只用一个线程遍历。
+ *
+ * @param root_id   起始目录的 inode
+ * @param root_path 起始目录显示的路径
+ * @param visit     处理每个目录的目录项，会被多个线程同时调用
+ * @param denied    没有读权限而跳过的目录数
+ * @param user      用户名，为空时不检查权限
+ * @return uint32_t 遍历的目录数
+ */
+uint32_t Filesystem::walk(uint32_t root_id, const std::string& root_path, const WalkVisitor& visit, uint32_t& denied, const char* user) {
+    uint32_t threads_num = NamedSnapshot::view ? 1 : std::clamp(std::thread::hardware_concurrency(), 1u, 8u);
+    std::vector<WorkQueue> queues(threads_num);
+    std::unique_ptr<std::atomic<bool>[]> seen(new std::atomic<bool>[super->superblock.inodes_num]());
+    // 已入队但尚未处理完的目录数，降为 0 时遍历结束
+    std::atomic<uint32_t> pending{1}, visited{0}, skipped{0};
+    seen[root_id] = true;
+    queues[0].directories.push_back({root_id, root_id, 0, root_path});
+
+    auto take = [&](uint32_t t, WalkDirectory& directory) {
+        for (uint32_t k = 0; k < threads_num; ++k) {
+            WorkQueue& queue = queues[(t + k) % threads_num];
+            std::lock_guard<std::mutex> guard(queue.mutex);
+            if (queue.directories.empty()) continue;
+            if (k == 0) {
+                directory = std::move(queue.directories.front());
+                queue.directories.pop_front();
+            } else {
+                directory = std::move(queue.directories.back());
+                queue.directories.pop_back();
+            }
+            return true;
+        }
+        return false;
+    };
+    auto work = [&](uint32_t t) {
+        WalkDirectory directory;
+        std::vector<const Entry*> entries;
+        while (pending.load(std::memory_order_acquire) > 0) {
+            if (!take(t, directory)) {
+                std::this_thread::yield();
+                continue;
+            }
+            Inode* inode = get_inode(directory.inode_id);
+            Entry self{};
+            self.inode_id = directory.inode_id;
+            self.is_valid = true;
+            if (user != nullptr && check_entry(&self, user, Option::READ) != ErrorCode::SUCCESS) {
+                ++skipped;
+                pending.fetch_sub(1, std::memory_order_acq_rel);
+                continue;
+            }
+            AutoBlock block(0, inode);
+            entries.clear();
+            for (const auto& file: block.elem()->all_entries()) {
+                if (!file.is_valid || strcmp(file.name, ".") == 0 || strcmp(file.name, "..") == 0) continue;
+                entries.push_back(&file);
+                Inode* child = get_inode(file.inode_id);
+                if (child->type != 'd' || seen[file.inode_id].exchange(true)) continue;
+                Disk::prefetch(child->i_block[0]);
+                pending.fetch_add(1, std::memory_order_relaxed);
+                std::lock_guard<std::mutex> guard(queues[t].mutex);
+                queues[t].directories.push_back({file.inode_id, directory.inode_id, directory.depth + 1, join(directory.path, file.name)});
+            }
+            visit(directory, entries);
+            ++visited;
+            pending.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint32_t t = 1; t < threads_num; ++t) {
+        threads.emplace_back(work, t);
+    }
+    work(0);
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    denied = skipped;
+    return visited;
+}
+
+/**
+ * @brief dir -s：递归列出目录下的所有子目录
+ *
+ * 每个目录的子目录在该目录读取完后立即输出，流式请求时边遍历边发送给Shell，
+ * 因此不同分支的输出顺序不固定。
+ *
+ * @param path 路径，为空时为当前目录
+ * @param user 用户名
+ * @return ErrorCode 操作结果
+ */
+ErrorCode Filesystem::dir_tree(const std::string& path, const char* user) {
+    AutoEntry entry;
+    if (path.empty()) {
+        entry.set(Entry::clone(pid_map[current_shell_pid].current_entry.elem()));
+    } else {
+        entry.set(get_path_entry(path).second);
+        if (entry == nullptr) {
+            response << "dir: cannot access '" << path << "': No such file or directory" << '\n';
+            return ErrorCode::FAILURE;
+        }
+    }
+    std::ostream& out = output();
+    if (get_inode(entry.elem()->inode_id)->type != 'd') {
+        out << trim(path) << '\n';
+        return ErrorCode::SUCCESS;
+    }
+    std::mutex mutex;
+    uint32_t denied = 0;
+    walk(entry.elem()->inode_id, path.empty() ? "." : trim(path), [&](const WalkDirectory& directory, const std::vector<const Entry*>& entries) {
+        std::string lines;
+        for (const Entry* file: entries) {
+            if (get_inode(file->inode_id)->type == 'd') lines += join(directory.path, file->name) + '\n';
+        }
+        if (lines.empty()) return;
+        std::lock_guard<std::mutex> guard(mutex);
+        out << lines;
+    }, denied, user);
+    if (denied > 0) response << "dir: " << denied << " directories skipped: Permission denied" << '\n';
+    return denied > 0 ? ErrorCode::FAILURE : ErrorCode::SUCCESS;
+}
+
+/**
+ * @brief du：输出目录树中每个目录的用量
+ *
+ * 每个目录的 inode 缓存了其子树中文件的总字节数和占用的块数，由修改文件的操作沿上级目录逐级更新，
+ * 因此 -s 只读取一个 inode；不带 -s 时遍历目录树只是为了列出目录，每个目录的用量直接取缓存，
+ * 最后按路径排序输出。没有缓存的目录（快照中的旧版磁盘）改为遍历时统计。
+ *
+ * @param path 路径，为空时为当前目录
+ * @param summary 是否只输出起始目录的合计（-s）
+ * @param user 用户名
+ * @return ErrorCode 操作结果
+ */
+ErrorCode Filesystem::du(const std::string& path, bool summary, const char* user) {
+    AutoEntry entry;
+    if (path.empty()) {
+        entry.set(Entry::clone(pid_map[current_shell_pid].current_entry.elem()));
+    } else {
+        entry.set(get_path_entry(path).second);
+        if (entry == nullptr) {
+            response << "du: cannot access '" << path << "': No such file or directory" << '\n';
+            return ErrorCode::FAILURE;
+        }
+    }
+    uint32_t block_size = super->superblock.block_size;
+    uint32_t root_id = entry.elem()->inode_id;
+    Inode* root = get_inode(root_id);
+    std::string root_path = path.empty() ? "." : trim(path);
+    std::map<uint32_t, Usage> usages;
+    uint32_t denied = 0;
+    if (root->type != 'd') {
+        usages[root_id] = {root_id, 0, root_path, root->size, root->capacity / block_size};
+    } else if (check_entry(entry.elem(), user, Option::READ) != ErrorCode::SUCCESS) {
+        response << "du: cannot read directory '" << root_path << "': Permission denied" << '\n';
+        return ErrorCode::FAILURE;
+    } else if (!root->has_usage()) {
+        usages = collect_usage(*this, root_id, root_path, user, denied);
+    } else if (summary) {
+        usages[root_id] = {root_id, 0, root_path, root->usage_bytes(), root->usage_blocks()};
+    } else {
+        std::mutex mutex;
+        walk(root_id, root_path, [&](const WalkDirectory& directory, const std::vector<const Entry*>&) {
+            Inode* inode = get_inode(directory.inode_id);
+            std::lock_guard<std::mutex> guard(mutex);
+            usages[directory.inode_id] = {directory.parent_id, directory.depth, directory.path, inode->usage_bytes(), inode->usage_blocks()};
+        }, denied, user);
+    }
+    std::vector<const Usage*> order;
+    for (const auto& [id, usage]: usages) {
+        if (!summary || usage.depth == 0) order.push_back(&usage);
+    }
+    std::sort(order.begin(), order.end(), [](const Usage* a, const Usage* b) { return a->path < b->path; });
+    std::ostream& out = output();
+    for (const Usage* usage: order) {
+        print_size(out, usage->bytes);
+        print_size(out, usage->blocks * block_size);
+        out << "  " << usage->path << '\n';
+    }
+    if (denied > 0) response << "du: " << denied << " directories skipped: Permission denied" << '\n';
+    return denied > 0 ? ErrorCode::FAILURE : ErrorCode::SUCCESS;
+}
+
+/**
+ * @brief 重新统计每个目录缓存的子树用量
+ *
+ * 载入没有缓存的旧版磁盘时统计一次；check 用它核对缓存，check -r 用它修复。
+ *
+ * @param apply 是否写回统计结果
+ * @return uint32_t 缓存与统计结果不一致的目录数
+ */
+uint32_t Filesystem::rebuild_usage(bool apply) {
+    uint32_t denied = 0, stale = 0;
+    std::map<uint32_t, Usage> usages = collect_usage(*this, super->superblock.root_inode_id, "/", nullptr, denied);
+    for (const auto& [id, usage]: usages) {
+        Inode* inode = get_inode(id);
+        if (inode->has_usage() && inode->usage_bytes() == usage.bytes && inode->usage_blocks() == usage.blocks) continue;
+        ++stale;
+        if (apply) {
+            inode->set_usage(usage.bytes, usage.blocks);
+            save_inode(id);
+        }
+    }
+    return stale;
+}
+
+/**
+ * @brief find：在目录树中按名称查找文件和目录
+ *
+ * 参数为 [路径] [-name 模式]，模式为 shell 通配符；不给出 -name 时列出所有文件和目录。
+ * 结果在每个目录读取完后立即输出。
+ *
+ * @param args 命令参数
+ * @param user 用户名
+ * @return ErrorCode 操作结果
+ */
+ErrorCode Filesystem::find(const std::vector<std::string>& args, const char* user) {
+    std::string path, pattern = "*";
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-name") {
+            if (i + 1 == args.size()) {
+                response << "find: missing argument to '-name'" << '\n';
+                return ErrorCode::FAILURE;
+            }
+            pattern = args[++i];
+        } else if (args[i][0] == '-') {
+            response << "find: unknown predicate '" << args[i] << "'" << '\n';
+            return ErrorCode::FAILURE;
+        } else if (path.empty()) {
+            path = args[i];
+        } else {
+            response << "find: paths must precede expression: '" << args[i] << "'" << '\n';
+            return ErrorCode::FAILURE;
+        }
+    }
+    AutoEntry entry;
+    if (path.empty()) {
+        entry.set(Entry::clone(pid_map[current_shell_pid].current_entry.elem()));
+    } else {
+        entry.set(get_path_entry(path).second);
+        if (entry == nullptr) {
+            response << "find: '" << path << "': No such file or directory" << '\n';
+            return ErrorCode::FAILURE;
+        }
+    }
+    std::ostream& out = output();
+    if (get_inode(entry.elem()->inode_id)->type != 'd') {
+        if (fnmatch(pattern.c_str(), entry.elem()->name, 0) == 0) out << trim(path) << '\n';
+        return ErrorCode::SUCCESS;
+    }
+    std::mutex mutex;
+    uint32_t denied = 0;
+    walk(entry.elem()->inode_id, path.empty() ? "." : trim(path), [&](const WalkDirectory& directory, const std::vector<const Entry*>& entries) {
+        std::string lines;
+        for (const Entry* file: entries) {
+            if (fnmatch(pattern.c_str(), file->name, 0) == 0) lines += join(directory.path, file->name) + '\n';
+        }
+        if (lines.empty()) return;
+        std::lock_guard<std::mutex> guard(mutex);
+        out << lines;
+    }, denied, user);
+    if (denied > 0) response << "find: " << denied << " directories skipped: Permission denied" << '\n';
+    return denied > 0 ? ErrorCode::FAILURE : ErrorCode::SUCCESS;
+}